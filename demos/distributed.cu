@@ -134,9 +134,11 @@ int main(int argc, char **argv)
     int commRank;  (MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
 
     distributedrender = new DistributedRender();
+    for (int i=1; i<argc; i++) if (std::string(argv[i]) == "-gather") distributedrender->gatherGeometry = true;
     distributedrender->initContour(); 
+    distributedrender->compositeImage("distributed.tga", 512, 512);
     
-    if (commRank == 0) initGL(argc, argv);
+    if (distributedrender->gatherGeometry && (commRank == 0)) initGL(argc, argv);
 
     (MPI_Finalize());
 
@@ -28,6 +28,7 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #include <thrust/iterator/discard_iterator.h>
 #include <thrust/binary_search.h>
 #include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -36,9 +37,31 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 
 #include "distributedrender.h"
 #include <piston/dthrust.h>
+#include <piston/render.h>
+#include <piston/image_compositor.h>
 
+#define PACKED __attribute__((packed))
 
-DistributedRender::DistributedRender()
+struct TGAHeader
+{
+    unsigned char  identsize		;   // size of ID field that follows 18 uint8 header (0 usually)
+    unsigned char  colourmaptype	;   // type of colour map 0=none, 1=has palette
+    unsigned char  imagetype		;   // type of image 0=none,1=indexed,2=rgb,3=grey,+8=rle packed
+
+    unsigned short colourmapstart	PACKED;   // first colour map entry in palette
+    unsigned short colourmaplength	PACKED;   // number of colours in palette
+    unsigned char  colourmapbits	;         // number of bits per palette entry 15,16,24,32
+
+    unsigned short xstart		PACKED;   // image x origin
+    unsigned short ystart		PACKED;   // image y origin
+    unsigned short width		PACKED;   // image width in pixels
+    unsigned short height		PACKED;   // image height in pixels
+    unsigned char  bits			;         // image bits per pixel 8,16,24,32
+    unsigned char  descriptor		;         // image descriptor bits (vh flip bits)
+};
+
+
+DistributedRender::DistributedRender() : gatherGeometry(false)
 {
 }
 
@@ -102,9 +125,9 @@ void DistributedRender::display()
     glEnableClientState(GL_NORMAL_ARRAY);
 
     glColor3f(1.0f, 0.0f, 0.0f);     
-    glNormalPointer(GL_FLOAT, 0, &normals2[0]);
+    glNormalPointer(GL_FLOAT, 0, &normals[0]);
     //glColorPointer(4, GL_FLOAT, 0, &colors[0]);
-    glVertexPointer(4, GL_FLOAT, 0, &vertices2[0]);
+    glVertexPointer(4, GL_FLOAT, 0, &vertices[0]);
     glDrawArrays(GL_TRIANGLES, 0, vertices.size());     
 
     glPopMatrix();
@@ -123,7 +146,8 @@ void DistributedRender::initContour()
     int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
     int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
 
-    if (commRank == 0)
+    // the serial reference contour and the gathered geometry only feed the interactive view on rank 0
+    if (gatherGeometry && (commRank == 0))
     {
       cayley2 = new tangle_field<SPACE>(GRID_SIZE, GRID_SIZE, GRID_SIZE);
       contour2 = new marching_cube<tangle_field<SPACE>, tangle_field<SPACE> >(*cayley2, *cayley2, 0.46f);
@@ -143,8 +167,11 @@ void DistributedRender::initContour()
 
     (*contour)();
     
-    dthrust::device_to_host(contour->num_total_vertices, contour->vertices, vertices); 
-    dthrust::device_to_host(contour->num_total_vertices, contour->normals, normals);  
+    if (gatherGeometry)
+    {
+      dthrust::device_to_host(contour->num_total_vertices, contour->vertices, vertices);
+      dthrust::device_to_host(contour->num_total_vertices, contour->normals, normals);
+    }
 
     int gsize1 = 24;  int gsize2 = 15;
     int lsize1 = gsize1/commSize;  
@@ -165,6 +192,44 @@ void DistributedRender::initContour()
 }
 
 
+// every rank renders only its own part of the contour, the frames are depth composited onto rank 0
+void DistributedRender::compositeImage(std::string fileName, int width, int height)
+{
+    int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+
+    // render transforms its input in place
+    thrust::device_vector<float4> localVertices(contour->vertices.begin(), contour->vertices.begin()+contour->num_total_vertices);
+    thrust::device_vector<float3> localNormals(contour->normals.begin(), contour->normals.begin()+contour->num_total_vertices);
+    thrust::device_vector<float4> localColors(contour->num_total_vertices, make_float4(1.0f, 0.0f, 0.0f, 1.0f));
+
+    render<thrust::device_vector<float4>::iterator, thrust::device_vector<float3>::iterator, thrust::device_vector<float4>::iterator>
+      renders(localVertices.begin(), localNormals.begin(), localColors.begin(), localVertices.size(), width, height);
+    renders.setPerspective(cameraFOV, 1.0f, 1.0f, 4.0f*fabs(cameraZ-center_pos.z));
+    renders.setLookAt(make_float3(center_pos.x, center_pos.y, cameraZ), center_pos, camera_up);
+    renders.setLightProperties(make_float3(0.5f, 0.5f, 0.5f), make_float3(0.5f, 0.5f, 0.5f), 1.0f, 0.0f, 0.0f,
+                               make_float4(GRID_SIZE/2.0f, GRID_SIZE/2.0f, 4.0f*GRID_SIZE, 1.0f));
+    renders();
+
+    image_compositor compositor(width, height, renders.pixelSize);
+    compositor(renders);
+
+    if (commRank == 0)
+    {
+      TGAHeader tgah;
+      memset(&tgah, 0, sizeof(TGAHeader));
+      tgah.bits = 8*renders.pixelSize;
+      tgah.height = height;
+      tgah.width = width;
+      tgah.imagetype = 2;
+
+      std::ofstream ofile(fileName.c_str(), std::ios_base::binary);
+      ofile.write((char*)&tgah, sizeof(tgah));
+      ofile.write(&compositor.frame[0], renders.pixelSize*width*height);
+      ofile.close();
+    }
+}
+
+
 void DistributedRender::initGL()
 {
     glClearColor(1.0f, 1.0f, 1.0f, 0.0f);
@@ -36,6 +36,8 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #endif
 
 
+#include <string>
+
 #include "piston/util/quaternion.h"
 #include <piston/piston_math.h>
 #include <piston/choose_container.h>
@@ -61,6 +63,7 @@ public:
   void initContour();
   void initGL();
   void timeContours();
+  void compositeImage(std::string fileName, int width, int height);
   void cleanup();
   void resetView();
 
@@ -75,6 +78,9 @@ public:
   float zoomLevelPct, zoomLevelPctDefault;
   float isovaluePct;
 
+  // gather the whole contour onto rank 0 for the interactive view, off by default
+  bool gatherGeometry;
+
   thrust::host_vector<float4> vertices;
   thrust::host_vector<float4> vertices2;
   thrust::host_vector<float3> normals;
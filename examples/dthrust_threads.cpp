@@ -0,0 +1,292 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* Runs the distributed filters on ranks that are the threads of this
+ * process (see piston/thread_mpi.h) and compares their results with the
+ * serial filters on the whole data set: dmarching_cube with marching_cube on
+ * a tangle field, and the dthrust primitives with thrust on an array split
+ * over the ranks. Built with DISTRIBUTED_PISTON and PISTON_THREAD_MPI.
+ * Built with PISTON_THREAD_MPI_HYBRID as well (dthrustHybridOMP) and started
+ * with mpirun, the threads of every process are ranks on top of MPI.
+ *
+ * Usage: dthrustThreadsOMP [ranks per process] [grid size] [number of elements] */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <stdlib.h>
+#include <math.h>
+
+#include <thrust/host_vector.h>
+#include <thrust/device_vector.h>
+#include <thrust/reduce.h>
+#include <thrust/count.h>
+#include <thrust/extrema.h>
+#include <thrust/copy.h>
+#include <thrust/sort.h>
+#include <thrust/scan.h>
+#include <thrust/sequence.h>
+
+#include <piston/choose_container.h>
+#include <piston/util/tangle_field.h>
+#include <piston/marching_cube.h>
+#include <piston/dmarching_cube.h>
+#include <piston/dthrust.h>
+
+using namespace piston;
+
+#define SPACE thrust::detail::default_device_space_tag
+
+int gridSize = 32;
+int numElements = 100000;
+
+
+// element i of the array the primitives are run on, with many equal values
+inline int element_value(int i)
+{
+    return (int) ((((unsigned int) i)*2654435761u) >> 22) - 512;
+}
+
+
+struct is_odd
+{
+    __host__ __device__
+    bool operator()(int x) const { return (x & 1) != 0; }
+};
+
+
+// cell of a vertex in a grid of 1/1000 of a cell of the volume
+inline long long vertex_key(long long x, long long y, long long z)
+{
+    const long long n = 1000LL*(gridSize+2);
+    return (x*n + y)*n + z;
+}
+
+
+// whether the two lists have the same vertices within 1/1000 of a cell, in any order
+bool same_vertices(const thrust::host_vector<float4>& a, const thrust::host_vector<float4>& b)
+{
+    if (a.size() != b.size()) return false;
+
+    std::multimap<long long, int> cells;
+    for (unsigned int i=0; i<a.size(); i++)
+      cells.insert(std::make_pair(vertex_key(llround(a[i].x*1000.0), llround(a[i].y*1000.0), llround(a[i].z*1000.0)), i));
+
+    // a vertex close enough may have been rounded into a neighbouring cell
+    for (unsigned int i=0; i<b.size(); i++)
+    {
+      const long long x = llround(b[i].x*1000.0), y = llround(b[i].y*1000.0), z = llround(b[i].z*1000.0);
+      bool found = false;
+      for (int n=0; !found && (n<27); n++)
+      {
+	std::pair<std::multimap<long long, int>::iterator, std::multimap<long long, int>::iterator> range =
+	    cells.equal_range(vertex_key(x + n%3 - 1, y + (n/3)%3 - 1, z + n/9 - 1));
+	for (std::multimap<long long, int>::iterator c=range.first; !found && (c!=range.second); c++)
+	{
+	  const float4 &v = a[c->second];
+	  if ((fabs(v.x - b[i].x) < 1e-3f) && (fabs(v.y - b[i].y) < 1e-3f) && (fabs(v.z - b[i].z) < 1e-3f)) { cells.erase(c);  found = true; }
+	}
+      }
+      if (!found) return false;
+    }
+    return true;
+}
+
+
+// prints on rank 0 whether the distributed result is the same as the serial
+// one on every rank, and returns that on all ranks
+bool report(bool same, std::string txt)
+{
+    int commRank;  MPI_Comm_rank(MPI_COMM_WORLD, &commRank);
+    int different = same ? 0 : 1, numDifferent = 0;
+    MPI_Allreduce(&different, &numDifferent, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+    std::string output = (numDifferent == 0) ? txt+" - Result is the same" : txt+" - Result is NOT the same";
+    if (commRank == 0) std::cout << output << std::endl;
+    return numDifferent == 0;
+}
+
+
+bool compareContours(float isovalue)
+{
+    int commRank;  MPI_Comm_rank(MPI_COMM_WORLD, &commRank);
+
+    tangle_field<SPACE> field(gridSize, gridSize, gridSize);
+    dmarching_cube<tangle_field<SPACE>, tangle_field<SPACE> > distributed(field, field, isovalue);
+    distributed();
+
+    thrust::host_vector<float4> distributedVertices;
+    dthrust::device_to_host(distributed.num_total_vertices, distributed.vertices, distributedVertices);
+
+    bool same = true;
+    if (commRank == 0)
+    {
+      marching_cube<tangle_field<SPACE>, tangle_field<SPACE> > serial(field, field, isovalue);
+      serial();
+      thrust::host_vector<float4> serialVertices(serial.vertices_begin(), serial.vertices_end());
+
+      // the serial vertices are in the physical coordinates of the field,
+      // [-1,1] on every axis, the distributed ones in grid coordinates
+      const float scale = 0.5f*(gridSize-1);
+      for (unsigned int i=0; i<serialVertices.size(); i++)
+      {
+	serialVertices[i].x = (serialVertices[i].x + 1.0f)*scale;
+	serialVertices[i].y = (serialVertices[i].y + 1.0f)*scale;
+	serialVertices[i].z = (serialVertices[i].z + 1.0f)*scale;
+      }
+
+      // the ranks generate the triangles of their blocks, so only the set of vertices is the same
+      same = (serialVertices.size() > 0) && same_vertices(serialVertices, distributedVertices);
+      std::cout << "number of vertices " << serialVertices.size() << " serial, " << distributedVertices.size() << " distributed" << std::endl;
+    }
+    return report(same, "dmarching_cube");
+}
+
+
+bool comparePrimitives()
+{
+    int commSize;  MPI_Comm_size(MPI_COMM_WORLD, &commSize);
+    int commRank;  MPI_Comm_rank(MPI_COMM_WORLD, &commRank);
+
+    // every rank has the whole array for the serial results and its part of it
+    thrust::host_vector<int> values(numElements);
+    for (int i=0; i<numElements; i++) values[i] = element_value(i);
+    const int first = ((long long) numElements*commRank)/commSize;
+    const int last = ((long long) numElements*(commRank+1))/commSize;
+    thrust::device_vector<int> all(values.begin(), values.end());
+    thrust::device_vector<int> local(values.begin()+first, values.begin()+last);
+
+    bool result = true;
+
+    result &= report(dthrust::reduce(local.begin(), local.end(), 7) == thrust::reduce(all.begin(), all.end(), 7), "reduce");
+
+    result &= report(dthrust::count_if(local.begin(), local.end(), is_odd()) == thrust::count_if(all.begin(), all.end(), is_odd()), "count_if");
+
+    {
+      thrust::pair<dthrust::global_element<int>, dthrust::global_element<int> > minmax = dthrust::minmax_element(local.begin(), local.end());
+      thrust::pair<thrust::device_vector<int>::iterator, thrust::device_vector<int>::iterator> serial = thrust::minmax_element(all.begin(), all.end());
+      result &= report((minmax.first.value == *serial.first) && (minmax.first.index == serial.first - all.begin()) &&
+                       (minmax.second.value == *serial.second) && (minmax.second.index == serial.second - all.begin()), "minmax_element");
+    }
+
+    {
+      thrust::device_vector<int> selected(local.size());
+      long long offset;
+      selected.resize(dthrust::copy_if(local.begin(), local.end(), selected.begin(), is_odd(), offset) - selected.begin());
+      thrust::host_vector<int> gathered;
+      dthrust::device_to_host(selected.size(), selected, gathered);
+
+      bool same = (offset == thrust::count_if(all.begin(), all.begin()+first, is_odd()));
+      if (commRank == 0)
+      {
+	thrust::device_vector<int> serial(all.size());
+	serial.resize(thrust::copy_if(all.begin(), all.end(), serial.begin(), is_odd()) - serial.begin());
+	thrust::host_vector<int> serialHost = serial;
+	same = same && (gathered.size() == serialHost.size()) && std::equal(gathered.begin(), gathered.end(), serialHost.begin());
+      }
+      result &= report(same, "copy_if");
+    }
+
+    {
+      // the values are the global indices of the keys
+      thrust::device_vector<int> keys = local;
+      thrust::device_vector<int> indices(local.size());
+      thrust::sequence(indices.begin(), indices.end(), first);
+      dthrust::sort_by_key(keys, indices);
+      thrust::host_vector<int> gatheredKeys, gatheredIndices;
+      dthrust::device_to_host(keys.size(), keys, gatheredKeys);
+      dthrust::device_to_host(indices.size(), indices, gatheredIndices);
+
+      bool same = true;
+      if (commRank == 0)
+      {
+	thrust::device_vector<int> serial = all;
+	thrust::sort(serial.begin(), serial.end());
+	thrust::host_vector<int> serialHost = serial;
+	same = (gatheredKeys.size() == serialHost.size()) && std::equal(gatheredKeys.begin(), gatheredKeys.end(), serialHost.begin());
+	for (unsigned int i=0; same && (i<gatheredIndices.size()); i++) same = (values[gatheredIndices[i]] == gatheredKeys[i]);
+	std::sort(gatheredIndices.begin(), gatheredIndices.end());
+	for (unsigned int i=0; same && (i<gatheredIndices.size()); i++) same = (gatheredIndices[i] == (int) i);
+      }
+      result &= report(same, "sort_by_key");
+    }
+
+    {
+      thrust::device_vector<int> inclusive(local.size()), exclusive(local.size());
+      dthrust::inclusive_scan(local.begin(), local.end(), inclusive.begin(), thrust::plus<int>());
+      dthrust::exclusive_scan(local.begin(), local.end(), exclusive.begin(), 3, thrust::plus<int>());
+      thrust::host_vector<int> gatheredInclusive, gatheredExclusive;
+      dthrust::device_to_host(inclusive.size(), inclusive, gatheredInclusive);
+      dthrust::device_to_host(exclusive.size(), exclusive, gatheredExclusive);
+
+      bool same = true;
+      if (commRank == 0)
+      {
+	thrust::device_vector<int> serialInclusive(all.size()), serialExclusive(all.size());
+	thrust::inclusive_scan(all.begin(), all.end(), serialInclusive.begin(), thrust::plus<int>());
+	thrust::exclusive_scan(all.begin(), all.end(), serialExclusive.begin(), 3, thrust::plus<int>());
+	thrust::host_vector<int> inclusiveHost = serialInclusive, exclusiveHost = serialExclusive;
+	same = (gatheredInclusive.size() == inclusiveHost.size()) && std::equal(gatheredInclusive.begin(), gatheredInclusive.end(), inclusiveHost.begin()) &&
+	       (gatheredExclusive.size() == exclusiveHost.size()) && std::equal(gatheredExclusive.begin(), gatheredExclusive.end(), exclusiveHost.begin());
+      }
+      result &= report(same, "scan");
+    }
+
+    return result;
+}
+
+
+// the program every rank runs, as it would under MPI
+int rank_main(int argc, char* argv[])
+{
+    MPI_Init(&argc, &argv);
+
+    int commRank, commSize;
+    MPI_Comm_rank(MPI_COMM_WORLD, &commRank);  MPI_Comm_size(MPI_COMM_WORLD, &commSize);
+    if (commRank == 0) std::cout << commSize << " ranks, grid size " << gridSize << ", " << numElements << " elements" << std::endl;
+
+    bool same = compareContours(0.46f);
+    same &= comparePrimitives();
+
+    MPI_Finalize();
+    return same ? 0 : 1;
+}
+
+
+int main(int argc, char* argv[])
+{
+    int numRanks = 4;
+    if (argc > 1) numRanks = atoi(argv[1]);
+    if (argc > 2) gridSize = atoi(argv[2]);
+    if (argc > 3) numElements = atoi(argv[3]);
+    if ((numRanks < 1) || (gridSize < 2) || (numElements < 1))
+    {
+	std::cout << "Usage: dthrustThreadsOMP [ranks per process] [grid size] [number of elements]" << std::endl;
+	return 1;
+    }
+
+    return piston::thread_mpi::run(numRanks, rank_main, argc, argv);
+}
@@ -0,0 +1 @@
+dthrust_threads.cpp
\ No newline at end of file
@@ -0,0 +1,229 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef BLOCK_DECOMPOSITION_H_
+#define BLOCK_DECOMPOSITION_H_
+
+#include <algorithm>
+
+#include <thrust/copy.h>
+#include <thrust/host_vector.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/iterator/permutation_iterator.h>
+
+#include <piston/piston_math.h>
+
+#include <piston/dthrust.h>
+
+namespace piston {
+
+/* Decomposition of a dim0 x dim1 x dim2 point grid into a 3D grid of blocks
+ * of cells, one block per rank of MPI_COMM_WORLD, for DISTRIBUTED_PISTON.
+ * The number of blocks along each axis comes from MPI_Dims_create, the
+ * largest factor goes to the axis with the most cells. Block p along an
+ * axis of n cells starts at cell floor(n*p/procs), so block sizes differ
+ * by at most one cell and the larger blocks are spread out, toward the end
+ * (5 cells on 3 blocks are split 1, 2, 2). Ranks are ordered as
+ * in MPI_Cart_create (z fastest) with x, y, z as the cartesian dimensions.
+ *
+ * A block holds the points of its cells, x fastest, then y, then z. That
+ * is the points it owns plus one ghost layer at each upper face that is
+ * not on the border of the volume, owned by the next block along the axis.
+ * With more blocks than cells along an axis some blocks are empty, they
+ * hold no points and are skipped by exchange_ghosts(). */
+struct block_decomposition
+{
+    int dims[3];	// points of the whole volume
+    int procs[3];	// blocks along each axis
+    int coords[3];	// position of the block of this rank
+    int begin[3];	// first cell of the block along each axis
+    int cells[3];	// cells of the block along each axis
+    int local_dims[3];	// points of the block along each axis, 0 if it is empty
+    int lower[3];	// ranks of the nearest non-empty blocks below and above
+    int upper[3];	// along each axis, MPI_PROC_NULL if there is none
+
+    // local point id of the m-th point of the point layer at index layer
+    // along an axis of the block
+    struct face_index_functor : public thrust::unary_function<int, int>
+    {
+	const int axis, layer;
+	const int nx, ny, nz;
+
+	face_index_functor(int axis, int layer, const int local_dims[3]) :
+	    axis(axis), layer(layer), nx(local_dims[0]), ny(local_dims[1]), nz(local_dims[2]) {}
+
+	__host__ __device__
+	int operator()(int m) const {
+	    switch (axis) {
+	    case 0:  return layer + nx*(m % ny) + nx*ny*(m / ny);
+	    case 1:  return (m % nx) + nx*layer + nx*ny*(m / nx);
+	    default: return (m % nx) + nx*(m / nx) + nx*ny*layer;
+	    }
+	}
+    };
+
+    // transform from the local point id to the physical coordinates of the point
+    struct local_coordinates_functor : public thrust::unary_function<int, float3>
+    {
+	const int nx, ny;
+	const int i0, j0, k0;
+	const float3 origin, spacing;
+
+	local_coordinates_functor(const int local_dims[3], const int begin[3], float3 origin, float3 spacing) :
+	    nx(local_dims[0]), ny(local_dims[1]), i0(begin[0]), j0(begin[1]), k0(begin[2]),
+	    origin(origin), spacing(spacing) {}
+
+	__host__ __device__
+	float3 operator()(int point_id) const {
+	    const int i = point_id % nx + i0;
+	    const int j = (point_id / nx) % ny + j0;
+	    const int k = point_id / (nx*ny) + k0;
+	    return make_float3(origin.x + spacing.x*i, origin.y + spacing.y*j, origin.z + spacing.z*k);
+	}
+    };
+
+    block_decomposition() {
+	for (int d = 0; d < 3; d++) {
+	    dims[d] = procs[d] = 1;
+	    coords[d] = begin[d] = cells[d] = local_dims[d] = 0;
+	    lower[d] = upper[d] = MPI_PROC_NULL;
+	}
+    }
+
+    void decompose(int dim0, int dim1, int dim2) {
+	int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+	int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+
+	dims[0] = dim0;  dims[1] = dim1;  dims[2] = dim2;
+
+	// MPI_Dims_create returns the factors in non-increasing order
+	int factors[3] = { 0, 0, 0 };
+	MPI_CHECK(MPI_Dims_create(commSize, 3, factors));
+	int axes[3] = { 0, 1, 2 };
+	for (int a = 0; a < 3; a++)
+	    for (int b = a+1; b < 3; b++)
+		if (dims[axes[b]] > dims[axes[a]]) std::swap(axes[a], axes[b]);
+	for (int a = 0; a < 3; a++) procs[axes[a]] = factors[a];
+
+	coords[0] = commRank / (procs[2]*procs[1]);
+	coords[1] = (commRank / procs[2]) % procs[1];
+	coords[2] = commRank % procs[2];
+
+	block_extent(commRank, begin, local_dims);
+	for (int d = 0; d < 3; d++) {
+	    cells[d] = block_begin(d, coords[d]+1) - begin[d];
+	    lower[d] = upper[d] = MPI_PROC_NULL;
+	    if (local_dims[d] == 0) continue;
+
+	    // the blocks along an axis are empty or not depending only on
+	    // their position along that axis
+	    int c[3] = { coords[0], coords[1], coords[2] };
+	    for (c[d] = coords[d]-1; c[d] >= 0; c[d]--)
+		if (block_begin(d, c[d]+1) > block_begin(d, c[d])) { lower[d] = rank(c); break; }
+	    for (c[d] = coords[d]+1; c[d] < procs[d]; c[d]++)
+		if (block_begin(d, c[d]+1) > block_begin(d, c[d])) { upper[d] = rank(c); break; }
+	}
+    }
+
+    // first cell along axis d of the block at position p
+    int block_begin(int d, int p) const {
+	return (int) (((long long) (dims[d]-1) * p) / procs[d]);
+    }
+
+    // first cell and number of points along each axis of the block of a rank
+    void block_extent(int r, int first[3], int points[3]) const {
+	const int c[3] = { r / (procs[2]*procs[1]), (r / procs[2]) % procs[1], r % procs[2] };
+	bool empty = false;
+	for (int d = 0; d < 3; d++) {
+	    first[d] = block_begin(d, c[d]);
+	    points[d] = block_begin(d, c[d]+1) - first[d] + 1;
+	    empty = empty || (points[d] == 1);
+	}
+	if (empty) points[0] = points[1] = points[2] = 0;
+    }
+
+    int rank(const int c[3]) const {
+	return (c[0]*procs[1] + c[1])*procs[2] + c[2];
+    }
+
+    int local_points() const {
+	return local_dims[0]*local_dims[1]*local_dims[2];
+    }
+
+    int local_cells() const {
+	return cells[0]*cells[1]*cells[2];
+    }
+
+    /* Fill the ghost layers of the local point values (local_points()
+     * values, x fastest) from the owners. The axes are done one after the
+     * other, each sending the first point layer to the block below and
+     * receiving the last one from the block above with nonblocking point
+     * to point messages, the ghost layers received for x and y are part of
+     * the layers sent for y and z, which takes care of the ghost edges and
+     * corners. Collective over MPI_COMM_WORLD. */
+    template <typename Container>
+    void exchange_ghosts(Container &values) const {
+	typedef typename Container::value_type T;
+	typedef thrust::permutation_iterator<typename Container::iterator,
+	        thrust::transform_iterator<face_index_functor, thrust::counting_iterator<int> > > FaceIterator;
+
+	if (local_points() == 0) return;
+
+	for (int d = 0; d < 3; d++) {
+	    if ((lower[d] == MPI_PROC_NULL) && (upper[d] == MPI_PROC_NULL)) continue;
+
+	    const int faceSize = local_points() / local_dims[d];
+	    const int bytes = faceSize*sizeof(T);
+
+	    FaceIterator first(values.begin(), thrust::make_transform_iterator(thrust::counting_iterator<int>(0),
+	                                                                       face_index_functor(d, 0, local_dims)));
+	    FaceIterator last(values.begin(), thrust::make_transform_iterator(thrust::counting_iterator<int>(0),
+	                                                                      face_index_functor(d, local_dims[d]-1, local_dims)));
+
+	    thrust::host_vector<T> sendFace, recvFace;
+	    MPI_Request requests[2];
+	    int nrequests = 0;
+	    if (upper[d] != MPI_PROC_NULL) {
+		recvFace.resize(faceSize);
+		MPI_CHECK(MPI_Irecv(thrust::raw_pointer_cast(&*recvFace.begin()), bytes, MPI_BYTE, upper[d], d, MPI_COMM_WORLD, &requests[nrequests++]));
+	    }
+	    if (lower[d] != MPI_PROC_NULL) {
+		Container face(first, first+faceSize);
+		sendFace = face;
+		MPI_CHECK(MPI_Isend(thrust::raw_pointer_cast(&*sendFace.begin()), bytes, MPI_BYTE, lower[d], d, MPI_COMM_WORLD, &requests[nrequests++]));
+	    }
+	    MPI_CHECK(MPI_Waitall(nrequests, requests, MPI_STATUSES_IGNORE));
+
+	    if (upper[d] != MPI_PROC_NULL) {
+		Container face(recvFace.begin(), recvFace.end());
+		thrust::copy(face.begin(), face.end(), last);
+	    }
+	}
+    }
+};
+
+} // namespace piston
+
+#endif /* BLOCK_DECOMPOSITION_H_ */
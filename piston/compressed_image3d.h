@@ -0,0 +1,430 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef COMPRESSED_IMAGE3D_H_
+#define COMPRESSED_IMAGE3D_H_
+
+#include <vector>
+#include <cstring>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <piston/image3d.h>
+
+namespace piston {
+
+/* image3d holding its point data as compressed bricks.
+ *
+ * The volume is split into bricks of brick_size^3 points (smaller at the
+ * upper borders), each brick is compressed on its own:
+ * 	- error_bound == 0: lossless, the differences of the bit patterns of
+ * 	  consecutive values are zigzag/varint coded.
+ * 	- error_bound > 0: the values are quantized to steps of 2*error_bound
+ * 	  above the brick minimum, the differences of consecutive steps are
+ * 	  zigzag/varint coded. Decoded values are within error_bound.
+ * The brick index stores the offset, size and value range of every brick,
+ * constant bricks (e.g. empty space) take no storage and are never decoded.
+ * marching_cube and threshold_geometry skip the cells of bricks not
+ * containing the values they look for through cell_culling, so those bricks
+ * are not decoded either.
+ *
+ * The point data iterator decodes the bricks touched by the filter into an
+ * LRU cache, one per OpenMP thread so no locking is needed. Decoding
+ * is done on the host, so this only works with the host and OpenMP
+ * backends.
+ *
+ * Layout is the order of the point ids seen by the filters, the bricks are
+ * stored independent of it. The default 32 bit ids limit the volume to 2^32
+ * points, larger ones need e.g.
+ * 	compressed_image3d<Space, linear_layout<unsigned long long> >. */
+template <typename MemorySpace =  thrust::detail::default_device_space_tag, typename Layout = linear_layout<> >
+struct compressed_image3d : public piston::image3d<MemorySpace, Layout>
+{
+    typedef piston::image3d<MemorySpace, Layout> Parent;
+    typedef typename Parent::IndexType IndexType;
+
+    struct brick_info
+    {
+	size_t offset;		// into the compressed stream
+	size_t size;		// bytes, 0 for constant bricks
+	float min_value;
+	float max_value;
+	float cells_min;	// range of the cells with their lower corner in the brick,
+	float cells_max;	// they reach into the next bricks
+    };
+
+    // decoded bricks of one thread, least recently used one is replaced
+    struct brick_cache
+    {
+	std::vector<float> values;
+	std::vector<int> brick_of_slot;
+	std::vector<unsigned> last_use;
+	unsigned clock;
+	int mru_slot;
+
+	brick_cache() : clock(0), mru_slot(0) {}
+    };
+
+    //TODO: move this to parent class?
+    typedef typename thrust::iterator_traits<typename Parent::GridCoordinatesIterator>::value_type
+	    GridCoordinatesType;
+
+    // transfrom grid_coordinates (i, j, k) generated by image3d to shifted and
+    // scaled physical_coordinates (x, y, z)
+    struct physical_coordinates_functor : public thrust::unary_function<GridCoordinatesType,
+								        thrust::tuple<float, float, float> >
+    {
+        const float xmin, ymin, zmin;
+        const float deltax, deltay, deltaz;
+
+        physical_coordinates_functor(float xmin   = 0.0f, float ymin   = 0.0f, float zmin   = 0.0f,
+                                     float deltax = 1.0f, float deltay = 1.0f, float deltaz = 1.0f) :
+            xmin(xmin), ymin(ymin), zmin(zmin),
+            deltax(deltax), deltay(deltay), deltaz(deltaz) {}
+
+        __host__ __device__
+        thrust::tuple<float, float, float> operator()(const GridCoordinatesType& grid_coord) const {
+            const float x = xmin + deltax * thrust::get<0>(grid_coord);
+            const float y = ymin + deltay * thrust::get<1>(grid_coord);
+            const float z = zmin + deltaz * thrust::get<2>(grid_coord);
+
+            return thrust::make_tuple(x, y, z);
+        }
+    };
+
+    // return the value of a point, decoding its brick if it is not cached
+    struct point_value_functor : public thrust::unary_function<IndexType, float>
+    {
+	const compressed_image3d *volume;
+
+	point_value_functor(const compressed_image3d *volume) : volume(volume) {}
+
+	__host__
+	float operator()(IndexType point_id) const {
+	    return volume->value(point_id);
+	}
+    };
+
+    typedef typename thrust::transform_iterator<physical_coordinates_functor,
+	    typename Parent::GridCoordinatesIterator> PhysicalCoordinatesIterator;
+    PhysicalCoordinatesIterator phys_coordinates_iterator;
+
+    typedef thrust::transform_iterator<point_value_functor, typename Parent::CountingIterator> PointDataIterator;
+
+    const int brick_size;
+    const float error_bound;
+    int bricks_x, bricks_y, bricks_z;
+
+    std::vector<brick_info> brick_index;
+    std::vector<unsigned char> stream;
+
+    // FixME: const correctness, the caches are modified by const lookups
+    mutable std::vector<brick_cache> caches;
+
+    // compress the point data read from an iterator in the order of Layout,
+    // e.g. point_data_begin() of another dataset or a host pointer, one brick
+    // at a time. cache_bricks is the least number of bricks cached per
+    // thread, the caches are made large enough for the access pattern of the
+    // filters.
+    template <typename InputIterator>
+    compressed_image3d(int xdim, int ydim, int zdim, InputIterator point_data,
+                       float error_bound = 0.0f, int brick_size = 32, int cache_bricks = 16,
+                       const float *origin = 0, const float *spacing = 0) :
+	Parent(xdim, ydim, zdim),
+	phys_coordinates_iterator(Parent::grid_coordinates_iterator,
+	                          physical_coordinates_functor(origin  ? origin[0]  : 0.0f, origin  ? origin[1]  : 0.0f,
+	                                                       origin  ? origin[2]  : 0.0f, spacing ? spacing[0] : 1.0f,
+	                                                       spacing ? spacing[1] : 1.0f, spacing ? spacing[2] : 1.0f)),
+	brick_size(brick_size), error_bound(error_bound),
+	bricks_x((xdim + brick_size - 1) / brick_size),
+	bricks_y((ydim + brick_size - 1) / brick_size),
+	bricks_z((zdim + brick_size - 1) / brick_size)
+    {
+	brick_index.resize(bricks_x * bricks_y * bricks_z);
+
+	std::vector<float> values(brick_size * brick_size * brick_size);
+	for (int b = 0; b < (int) brick_index.size(); b++) {
+	    int n = 0;
+	    for_each_point(b, gather<InputIterator>(point_data, values, n));
+	    compress(b, values, n);
+	}
+	set_cells_range();
+
+	// filters walk the point ids x fastest, so with a linear layout a row of
+	// cells touches the bricks of up to 4 rows of bricks. All of them have to
+	// fit, otherwise every brick switch decodes a whole brick again.
+	if (cache_bricks < 4*bricks_x)
+	    cache_bricks = 4*bricks_x;
+	if (cache_bricks > (int) brick_index.size())
+	    cache_bricks = brick_index.size();
+
+#ifdef _OPENMP
+	caches.resize(omp_get_max_threads());
+#else
+	caches.resize(1);
+#endif
+	for (size_t t = 0; t < caches.size(); t++) {
+	    caches[t].values.resize(cache_bricks * brick_size * brick_size * brick_size);
+	    caches[t].brick_of_slot.assign(cache_bricks, -1);
+	    caches[t].last_use.assign(cache_bricks, 0);
+	}
+    }
+
+    // FixME: const correctness, should we change it to cbegin()/cend()?
+    PhysicalCoordinatesIterator physical_coordinates_begin() {
+ 	return phys_coordinates_iterator;
+    }
+    PhysicalCoordinatesIterator physical_coordinates_end() {
+	return phys_coordinates_iterator+this->NPoints;
+    }
+
+    PointDataIterator point_data_begin() {
+	return thrust::make_transform_iterator(typename Parent::CountingIterator(0), point_value_functor(this));
+    }
+    PointDataIterator point_data_end() {
+	return point_data_begin() + this->NPoints;
+    }
+
+    size_t compressed_bytes() const {
+	return stream.size() + brick_index.size()*sizeof(brick_info);
+    }
+
+    // number of bricks whose cells may have values in [min_value, max_value],
+    // the cells of the others are skipped by filters looking for that range.
+    int count_active_bricks(float min_value, float max_value) const {
+	int count = 0;
+	for (size_t b = 0; b < brick_index.size(); b++)
+	    count += brick_active(b, min_value, max_value);
+	return count;
+    }
+    bool brick_active(int brick, float min_value, float max_value) const {
+	return (brick_index[brick].cells_max >= min_value) && (brick_index[brick].cells_min <= max_value);
+    }
+    bool cell_active(int i, int j, int k, float min_value, float max_value) const {
+	return brick_active(((k / brick_size)*bricks_y + j / brick_size)*bricks_x + i / brick_size,
+	                    min_value, max_value);
+    }
+
+    // return the value of a point, the hot path is a hit on the most
+    // recently used brick of the calling thread.
+    float value(IndexType point_id) const {
+	const thrust::tuple<IndexType, IndexType, IndexType> ijk = this->layout.coordinates(point_id);
+	const int i = thrust::get<0>(ijk);
+	const int j = thrust::get<1>(ijk);
+	const int k = thrust::get<2>(ijk);
+
+	const int brick = ((k / brick_size)*bricks_y + j / brick_size)*bricks_x + i / brick_size;
+	const brick_info &info = brick_index[brick];
+	if (info.size == 0)
+	    return info.min_value;
+
+#ifdef _OPENMP
+	brick_cache &cache = caches[omp_get_thread_num()];
+#else
+	brick_cache &cache = caches[0];
+#endif
+	int slot = cache.mru_slot;
+	if (cache.brick_of_slot[slot] != brick) {
+	    slot = lookup(cache, brick);
+	    cache.mru_slot = slot;
+	}
+
+	const int local = ((k % brick_size)*brick_size + j % brick_size)*brick_size + i % brick_size;
+	return cache.values[slot * brick_size * brick_size * brick_size + local];
+    }
+
+private:
+    // find a brick in the cache, decoding it into the least recently used
+    // slot if it is not there.
+    int lookup(brick_cache &cache, int brick) const {
+	const int nslots = cache.brick_of_slot.size();
+	cache.clock++;
+
+	int victim = 0;
+	for (int s = 0; s < nslots; s++) {
+	    if (cache.brick_of_slot[s] == brick) {
+		cache.last_use[s] = cache.clock;
+		return s;
+	    }
+	    if (cache.last_use[s] < cache.last_use[victim])
+		victim = s;
+	}
+
+	cache.brick_of_slot[victim] = brick;
+	cache.last_use[victim] = cache.clock;
+	for_each_point(brick, decode(*this, brick, &cache.values[victim * brick_size * brick_size * brick_size]));
+	return victim;
+    }
+
+    // call f(point_id, local) for the points of a brick in storage order
+    template <typename F>
+    void for_each_point(int brick, F f) const {
+	const int bi = (brick % bricks_x) * brick_size;
+	const int bj = ((brick / bricks_x) % bricks_y) * brick_size;
+	const int bk = (brick / (bricks_x * bricks_y)) * brick_size;
+
+	for (int k = bk; k < bk + brick_size && k < (int) this->dim2; k++)
+	    for (int j = bj; j < bj + brick_size && j < (int) this->dim1; j++)
+		for (int i = bi; i < bi + brick_size && i < (int) this->dim0; i++)
+		    f(this->layout.index(i, j, k),
+		      ((k - bk)*brick_size + (j - bj))*brick_size + (i - bi));
+    }
+
+    // the cells of a brick use the points of the next bricks in x, y and z,
+    // lossy decoded values are within error_bound of the range.
+    void set_cells_range() {
+	for (int b = 0; b < (int) brick_index.size(); b++) {
+	    const int bi = b % bricks_x, bj = (b / bricks_x) % bricks_y, bk = b / (bricks_x * bricks_y);
+	    brick_info &info = brick_index[b];
+	    info.cells_min = info.min_value;
+	    info.cells_max = info.max_value;
+	    for (int k = bk; k <= bk + 1 && k < bricks_z; k++)
+		for (int j = bj; j <= bj + 1 && j < bricks_y; j++)
+		    for (int i = bi; i <= bi + 1 && i < bricks_x; i++) {
+			const brick_info &next = brick_index[(k*bricks_y + j)*bricks_x + i];
+			info.cells_min = (next.min_value < info.cells_min) ? next.min_value : info.cells_min;
+			info.cells_max = (next.max_value > info.cells_max) ? next.max_value : info.cells_max;
+		    }
+	    info.cells_min -= error_bound;
+	    info.cells_max += error_bound;
+	}
+    }
+
+    template <typename InputIterator>
+    struct gather
+    {
+	InputIterator input;
+	std::vector<float> &values;
+	int &n;
+
+	gather(InputIterator input, std::vector<float> &values, int &n) :
+	    input(input), values(values), n(n) {}
+
+	void operator()(size_t point_id, int) { values[n++] = *(input + point_id); }
+    };
+
+    static unsigned int float_bits(float f) {
+	unsigned int u;
+	std::memcpy(&u, &f, sizeof(u));
+	return u;
+    }
+    static float bits_float(unsigned int u) {
+	float f;
+	std::memcpy(&f, &u, sizeof(f));
+	return f;
+    }
+
+    void put_varint(unsigned int delta) {
+	unsigned int u = (delta << 1) ^ (0u - (delta >> 31));	// zigzag
+	while (u >= 0x80) {
+	    stream.push_back((unsigned char) (u | 0x80));
+	    u >>= 7;
+	}
+	stream.push_back((unsigned char) u);
+    }
+    static unsigned int get_varint(const unsigned char *&p) {
+	unsigned int u = 0;
+	int shift = 0;
+	while (*p & 0x80) {
+	    u |= (unsigned int) (*p++ & 0x7f) << shift;
+	    shift += 7;
+	}
+	u |= (unsigned int) (*p++) << shift;
+	return (u >> 1) ^ (0u - (u & 1));
+    }
+
+    float step() const {
+	return 2.0f * error_bound;
+    }
+
+    void compress(int brick, const std::vector<float> &values, int n) {
+	brick_info &info = brick_index[brick];
+	info.min_value = info.max_value = values[0];
+	for (int v = 1; v < n; v++) {
+	    info.min_value = (values[v] < info.min_value) ? values[v] : info.min_value;
+	    info.max_value = (values[v] > info.max_value) ? values[v] : info.max_value;
+	}
+
+	info.offset = stream.size();
+	info.size = 0;
+	if (info.max_value - info.min_value <= ((error_bound > 0.0f) ? error_bound : 0.0f)) {
+	    // (nearly) constant brick, keep the value in the index only
+	    info.max_value = info.min_value;
+	    return;
+	}
+
+	// differences are taken modulo 2^32, the bit patterns of floats
+	// wrap around
+	unsigned int previous = 0;
+	for (int v = 0; v < n; v++) {
+	    const unsigned int current = (error_bound > 0.0f) ?
+		(unsigned int) std::floor((values[v] - info.min_value) / step() + 0.5f) :
+		float_bits(values[v]);
+	    put_varint(current - previous);
+	    previous = current;
+	}
+	info.size = stream.size() - info.offset;
+    }
+
+    struct decode
+    {
+	const compressed_image3d &volume;
+	const unsigned char *p;
+	float *values;
+	const float min_value;
+	unsigned int current;
+
+	decode(const compressed_image3d &volume, int brick, float *values) :
+	    volume(volume), p(&volume.stream[volume.brick_index[brick].offset]), values(values),
+	    min_value(volume.brick_index[brick].min_value), current(0) {}
+
+	void operator()(size_t, int local) {
+	    current += get_varint(p);
+	    values[local] = (volume.error_bound > 0.0f) ?
+		min_value + current * volume.step() :
+		bits_float(current);
+	}
+    };
+};
+
+// the cells of the bricks not containing the values are skipped
+template <typename MemorySpace, typename Layout>
+struct cell_culling<compressed_image3d<MemorySpace, Layout> >
+{
+    const compressed_image3d<MemorySpace, Layout> *volume;
+
+    cell_culling(const compressed_image3d<MemorySpace, Layout> &volume) : volume(&volume) {}
+
+    template <typename CellIndex>
+    __host__
+    bool operator()(CellIndex i, CellIndex j, CellIndex k, float min_value, float max_value) const {
+	return volume->cell_active(i, j, k, min_value, max_value);
+    }
+};
+
+}
+#endif /* COMPRESSED_IMAGE3D_H_ */
@@ -0,0 +1,466 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DISTRIBUTED_HALO_H_
+#define DISTRIBUTED_HALO_H_
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <thrust/host_vector.h>
+
+#include <piston/halo_merge.h>
+#include <piston/block_decomposition.h>
+
+#include <piston/dthrust.h>
+
+namespace piston {
+
+/* Friends-of-friends halos of particles distributed over the ranks of
+ * MPI_COMM_WORLD, for DISTRIBUTED_PISTON.
+ *
+ * The bounding box of all particles is cut into cells of at least the
+ * maximum linking length, and the cells into one block per rank with a
+ * block_decomposition. Every particle is sent to the rank of its block,
+ * and also, as a ghost, to the ranks with a block within the maximum
+ * linking length of it, which are in the neighboring cells. Each rank
+ * builds a halo_merge tree of its own and its ghost particles, so every
+ * link between two particles is found on the rank of either of them.
+ *
+ * For a linking length, the local halos are labelled with the smallest
+ * global particle id in them. Every ghost links the label of its local
+ * halo to the label its particle has on its owner, and the linked labels
+ * are joined by a union-find distributed over the ranks: the rank
+ * label % commSize keeps the parent of a label, the larger root of every
+ * link is hooked onto the smaller one, and pointer jumping brings the
+ * hooked labels back to roots. The number of roots with a link at least
+ * halves with every hooking and the jumps halve the paths, so both take
+ * a logarithmic number of rounds, and only the labels that still move are
+ * sent. The halos smaller than particleSize are dropped afterwards,
+ * counted over all ranks. */
+class distributed_halo
+{
+public:
+    typedef halo::Point Point;
+
+    // a particle as exchanged between the ranks
+    struct particle
+    {
+	Point pos;
+	long long id;
+    };
+
+    float xscal;			// scale factor for linking length
+    float min_ll, max_ll;		// linking lengths the merge trees are built for, unscaled
+    Point lBound, uBound;		// bounds of all particles
+    float cellLen[3];			// cell size along each axis
+    block_decomposition decomposition;	// blocks of cells
+
+    std::vector<particle> particles;	// the particles of this rank, followed by its ghosts
+    int numOfOwnParticles;
+    halo_merge *mergeTree;
+
+    // the ghosts sent to each rank, as indices of own particles, and the ghosts received from each rank
+    std::vector<std::vector<int> > ghostsSent, ghostsReceived;
+
+    thrust::host_vector<long long> haloIndex;	// for each own particle the smallest particle id in its halo, -1 if it is too small
+    long long numOfHalos, numOfHaloParticles;	// over all ranks
+
+    distributed_halo(float min_linkLength, float max_linkLength, const std::vector<Point> &positions,
+                     const std::vector<long long> &ids, int np = 1, float rL = -1) :
+        min_ll(min_linkLength), max_ll(max_linkLength), numOfOwnParticles(0), mergeTree(0), numOfHalos(0), numOfHaloParticles(0)
+    {
+	// scale amount for particles
+	if (rL == -1) xscal = 1;
+	else          xscal = rL / (1.0*np);
+
+	int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+
+	setBounds(positions);
+
+	// cells of at least the maximum linking length, so the particles within it are in the neighboring cells
+	const float ll = max_ll*xscal;
+	const float lower[3] = { lBound.x, lBound.y, lBound.z }, upper[3] = { uBound.x, uBound.y, uBound.z };
+	int numOfCells[3];
+	for (int d=0; d<3; d++)
+	{
+	  numOfCells[d] = std::max(1, (int) std::floor((upper[d] - lower[d]) / ll));
+	  cellLen[d] = (upper[d] > lower[d]) ? (upper[d] - lower[d]) / numOfCells[d] : ll;
+	}
+	decomposition.decompose(numOfCells[0]+1, numOfCells[1]+1, numOfCells[2]+1);
+
+	// send every particle to the rank of its block & as a ghost to the ranks of blocks within ll
+	std::vector<std::vector<particle> > sendOwn(commSize), sendGhosts(commSize);
+	std::vector<int> ranks;
+	for (unsigned int i=0; i<positions.size(); i++)
+	{
+	  particle p;  p.pos = positions[i];  p.id = ids[i];
+	  int cell[3];  getCell(p.pos, cell);
+	  sendOwn[cellOwner(cell)].push_back(p);
+	}
+	exchange(sendOwn, particles);
+	numOfOwnParticles = particles.size();
+
+	int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+	ghostsSent.assign(commSize, std::vector<int>());
+	for (int i=0; i<numOfOwnParticles; i++)
+	{
+	  int cell[3];  getCell(particles[i].pos, cell);
+	  ranks.clear();
+	  int c[3];
+	  for (c[0] = std::max(0, cell[0]-1); c[0] <= std::min(numOfCells[0]-1, cell[0]+1); c[0]++)
+	    for (c[1] = std::max(0, cell[1]-1); c[1] <= std::min(numOfCells[1]-1, cell[1]+1); c[1]++)
+	      for (c[2] = std::max(0, cell[2]-1); c[2] <= std::min(numOfCells[2]-1, cell[2]+1); c[2]++)
+	      {
+		int r = cellOwner(c);
+		if ((r != commRank) && (std::find(ranks.begin(), ranks.end(), r) == ranks.end())
+		    && (distanceToBlock(particles[i].pos, r) <= ll)) ranks.push_back(r);
+	      }
+	  for (unsigned int j=0; j<ranks.size(); j++)
+	  {
+	    sendGhosts[ranks[j]].push_back(particles[i]);
+	    ghostsSent[ranks[j]].push_back(i);
+	  }
+	}
+	std::vector<particle> ghosts;
+	std::vector<int> received = exchange(sendGhosts, ghosts);
+	ghostsReceived.assign(commSize, std::vector<int>());
+	for (int r=0, g=numOfOwnParticles; r<commSize; r++)
+	  for (int k=0; k<received[r]; k++) ghostsReceived[r].push_back(g++);
+	particles.insert(particles.end(), ghosts.begin(), ghosts.end());
+
+	std::vector<Point> localPositions(particles.size());
+	for (unsigned int i=0; i<particles.size(); i++) localPositions[i] = particles[i].pos;
+	mergeTree = new halo_merge(min_ll, max_ll, localPositions, np, rL);
+    }
+
+    ~distributed_halo() { delete mergeTree; }
+
+    // find the halos at linkLength with at least particleSize particles, collective
+    void operator()(float linkLength, int particleSize)
+    {
+	int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+	const int numOfParticles = particles.size();
+
+	// the local halos, labelled with their smallest global particle id
+	thrust::host_vector<int> localHalo(numOfParticles);
+	if (numOfParticles > 0)
+	{
+	  mergeTree->findHalos(linkLength*xscal, 1);
+	  localHalo = mergeTree->haloIndex;
+	}
+	std::vector<long long> label(numOfParticles, -1);
+	for (int i=0; i<numOfParticles; i++)
+	{
+	  long long &l = label[localHalo[i]];
+	  if ((l == -1) || (particles[i].id < l)) l = particles[i].id;
+	}
+
+	// every ghost links its local halo here to the local halo of its particle on the owner
+	std::vector<std::vector<long long> > sendLabels(commSize);
+	for (int r=0; r<commSize; r++)
+	  for (unsigned int k=0; k<ghostsSent[r].size(); k++) sendLabels[r].push_back(label[localHalo[ghostsSent[r][k]]]);
+	std::vector<long long> ownerLabels;
+	exchange(sendLabels, ownerLabels);
+	std::vector<std::pair<long long, long long> > links;
+	for (int r=0, g=0; r<commSize; r++)
+	  for (unsigned int k=0; k<ghostsReceived[r].size(); k++, g++)
+	  {
+	    const long long a = label[localHalo[ghostsReceived[r][k]]], b = ownerLabels[g];
+	    if (a != b) links.push_back(std::make_pair(std::max(a, b), std::min(a, b)));
+	  }
+
+	std::map<long long, long long> parent;
+	stitchHalos(parent, links);
+
+	// every local halo takes the root of its label
+	std::vector<int> halos;
+	std::vector<long long> roots;
+	for (int i=0; i<numOfParticles; i++) if (label[i] != -1) { halos.push_back(i);  roots.push_back(label[i]); }
+	findParents(parent, roots);
+	for (unsigned int k=0; k<halos.size(); k++) label[halos[k]] = roots[k];
+
+	haloIndex.resize(numOfOwnParticles);
+	for (int i=0; i<numOfOwnParticles; i++) haloIndex[i] = label[localHalo[i]];
+
+	filterHalos(particleSize);
+    }
+
+protected:
+    void setBounds(const std::vector<Point> &positions)
+    {
+	float lower[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, upper[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (unsigned int i=0; i<positions.size(); i++)
+	{
+	  lower[0] = std::min(lower[0], positions[i].x);  upper[0] = std::max(upper[0], positions[i].x);
+	  lower[1] = std::min(lower[1], positions[i].y);  upper[1] = std::max(upper[1], positions[i].y);
+	  lower[2] = std::min(lower[2], positions[i].z);  upper[2] = std::max(upper[2], positions[i].z);
+	}
+	float globalLower[3], globalUpper[3];
+	MPI_CHECK(MPI_Allreduce(lower, globalLower, 3, MPI_FLOAT, MPI_MIN, MPI_COMM_WORLD));
+	MPI_CHECK(MPI_Allreduce(upper, globalUpper, 3, MPI_FLOAT, MPI_MAX, MPI_COMM_WORLD));
+	if (globalLower[0] > globalUpper[0]) for (int d=0; d<3; d++) globalLower[d] = globalUpper[d] = 0;  // no particles at all
+	lBound = Point(globalLower[0], globalLower[1], globalLower[2]);
+	uBound = Point(globalUpper[0], globalUpper[1], globalUpper[2]);
+    }
+
+    void getCell(const Point &p, int cell[3]) const
+    {
+	const float pos[3] = { p.x, p.y, p.z }, lower[3] = { lBound.x, lBound.y, lBound.z };
+	for (int d=0; d<3; d++)
+	{
+	  const int cells = decomposition.dims[d]-1;
+	  cell[d] = std::min(cells-1, std::max(0, (int) ((pos[d] - lower[d]) / cellLen[d])));
+	}
+    }
+
+    // the rank of the block containing a cell
+    int cellOwner(const int cell[3]) const
+    {
+	int c[3];
+	for (int d=0; d<3; d++)
+	{
+	  int p = (int) (((long long) cell[d] * decomposition.procs[d]) / (decomposition.dims[d]-1));
+	  while ((p+1 < decomposition.procs[d]) && (decomposition.block_begin(d, p+1) <= cell[d])) p++;
+	  while (decomposition.block_begin(d, p) > cell[d]) p--;
+	  c[d] = p;
+	}
+	return decomposition.rank(c);
+    }
+
+    float distanceToBlock(const Point &p, int r) const
+    {
+	int first[3], points[3];
+	decomposition.block_extent(r, first, points);
+	const float pos[3] = { p.x, p.y, p.z }, lower[3] = { lBound.x, lBound.y, lBound.z };
+	float dist2 = 0;
+	for (int d=0; d<3; d++)
+	{
+	  const float blockLower = lower[d] + first[d]*cellLen[d];
+	  const float blockUpper = lower[d] + (first[d] + points[d] - 1)*cellLen[d];
+	  const float outside = std::max(0.0f, std::max(blockLower - pos[d], pos[d] - blockUpper));
+	  dist2 += outside*outside;
+	}
+	return std::sqrt(dist2);
+    }
+
+    // send the elements to their ranks, returns the number received from each rank
+    template <typename T>
+    std::vector<int> exchange(const std::vector<std::vector<T> > &send, std::vector<T> &received)
+    {
+	int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+
+	std::vector<int> sendCounts(commSize), sendDispls(commSize+1, 0), recvCounts(commSize), recvDispls(commSize+1, 0);
+	std::vector<T> sendBuffer;
+	for (int r=0; r<commSize; r++)
+	{
+	  sendCounts[r] = send[r].size();
+	  sendDispls[r+1] = sendDispls[r] + sendCounts[r];
+	  sendBuffer.insert(sendBuffer.end(), send[r].begin(), send[r].end());
+	}
+	MPI_CHECK(MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &recvCounts[0], 1, MPI_INT, MPI_COMM_WORLD));
+	for (int r=0; r<commSize; r++) recvDispls[r+1] = recvDispls[r] + recvCounts[r];
+	received.resize(recvDispls[commSize]);
+
+	MPI_Datatype elementType;
+	MPI_CHECK(MPI_Type_contiguous(sizeof(T), MPI_BYTE, &elementType));
+	MPI_CHECK(MPI_Type_commit(&elementType));
+	MPI_CHECK(MPI_Alltoallv(sendBuffer.empty() ? 0 : &sendBuffer[0], &sendCounts[0], &sendDispls[0], elementType,
+	                        received.empty() ? 0 : &received[0], &recvCounts[0], &recvDispls[0], elementType, MPI_COMM_WORLD));
+	MPI_CHECK(MPI_Type_free(&elementType));
+	return recvCounts;
+    }
+
+    /* Joins the labels of every link, given as (larger, smaller), in the
+     * parents kept by this rank, collective. Labels without a parent are
+     * roots, and on return every other label kept here points at its root. */
+    void stitchHalos(std::map<long long, long long> &parent, std::vector<std::pair<long long, long long> > links)
+    {
+	int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+
+	long long localLinks = links.size(), numOfLinks;
+	MPI_CHECK(MPI_Allreduce(&localLinks, &numOfLinks, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD));
+	while (numOfLinks > 0)
+	{
+	  // hook the larger root of every link onto the smallest root it is linked to
+	  std::vector<std::vector<std::pair<long long, long long> > > sendHooks(commSize);
+	  for (unsigned int k=0; k<links.size(); k++) sendHooks[links[k].first % commSize].push_back(links[k]);
+	  std::vector<std::pair<long long, long long> > hooks;
+	  exchange(sendHooks, hooks);
+	  std::vector<long long> hooked;
+	  for (unsigned int k=0; k<hooks.size(); k++)
+	  {
+	    std::map<long long, long long>::iterator p = parent.find(hooks[k].first);
+	    if (p == parent.end()) { parent[hooks[k].first] = hooks[k].second;  hooked.push_back(hooks[k].first); }
+	    else if (hooks[k].second < p->second) p->second = hooks[k].second;
+	  }
+	  jumpToRoots(parent, hooked);
+
+	  // the links between the new roots, without the ones inside a halo now
+	  std::vector<long long> ends;
+	  for (unsigned int k=0; k<links.size(); k++) { ends.push_back(links[k].first);  ends.push_back(links[k].second); }
+	  findParents(parent, ends);
+	  links.clear();
+	  for (unsigned int k=0; k<ends.size(); k+=2)
+	    if (ends[k] != ends[k+1]) links.push_back(std::make_pair(std::max(ends[k], ends[k+1]), std::min(ends[k], ends[k+1])));
+	  std::sort(links.begin(), links.end());
+	  links.erase(std::unique(links.begin(), links.end()), links.end());
+
+	  localLinks = links.size();
+	  MPI_CHECK(MPI_Allreduce(&localLinks, &numOfLinks, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD));
+	}
+
+	// the labels hooked in earlier rounds still point at the roots of their round
+	std::vector<long long> labels;
+	for (std::map<long long, long long>::iterator p = parent.begin(); p != parent.end(); ++p) labels.push_back(p->first);
+	jumpToRoots(parent, labels);
+    }
+
+    // pointer jumping of the labels kept here, each round sends only the labels whose parent is not a root yet, collective
+    void jumpToRoots(std::map<long long, long long> &parent, std::vector<long long> pending)
+    {
+	int active = 1;
+	while (active)
+	{
+	  std::vector<long long> grandparents(pending.size());
+	  for (unsigned int k=0; k<pending.size(); k++) grandparents[k] = parent[pending[k]];
+	  findParents(parent, grandparents);
+	  std::vector<long long> moved;
+	  for (unsigned int k=0; k<pending.size(); k++)
+	  {
+	    long long &p = parent[pending[k]];
+	    if (grandparents[k] == p) continue;
+	    p = grandparents[k];
+	    moved.push_back(pending[k]);
+	  }
+	  pending.swap(moved);
+
+	  int localActive = !pending.empty();
+	  MPI_CHECK(MPI_Allreduce(&localActive, &active, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD));
+	}
+    }
+
+    // replaces every label by its parent, asked from the rank keeping it, collective
+    void findParents(const std::map<long long, long long> &parent, std::vector<long long> &labels)
+    {
+	int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+
+	std::vector<std::vector<long long> > sendLabels(commSize);
+	for (unsigned int k=0; k<labels.size(); k++) sendLabels[labels[k] % commSize].push_back(labels[k]);
+	std::vector<long long> asked;
+	std::vector<int> askedCounts = exchange(sendLabels, asked);
+
+	// the parents go back in the order the labels came in
+	std::vector<std::vector<long long> > sendParents(commSize);
+	for (int r=0, k=0; r<commSize; r++)
+	  for (int j=0; j<askedCounts[r]; j++, k++)
+	  {
+	    std::map<long long, long long>::const_iterator p = parent.find(asked[k]);
+	    sendParents[r].push_back((p == parent.end()) ? asked[k] : p->second);
+	  }
+	std::vector<long long> parents;
+	exchange(sendParents, parents);
+
+	std::vector<int> next(commSize+1, 0);
+	for (int r=0; r<commSize; r++) next[r+1] = next[r] + sendLabels[r].size();
+	for (unsigned int k=0; k<labels.size(); k++) labels[k] = parents[next[labels[k] % commSize]++];
+    }
+
+    /* The halo sizes are summed over all ranks by the rank label % commSize,
+     * which answers with the total for every label it was sent, then the
+     * own particles of too small halos get -1. */
+    void filterHalos(int particleSize)
+    {
+	int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+
+	// local particle count of every label
+	std::vector<long long> labels(haloIndex.begin(), haloIndex.end());
+	std::sort(labels.begin(), labels.end());
+	std::vector<std::vector<long long> > sendLabels(commSize), sendSizes(commSize);
+	for (unsigned int i=0; i<labels.size(); )
+	{
+	  unsigned int j = i;
+	  while ((j < labels.size()) && (labels[j] == labels[i])) j++;
+	  sendLabels[labels[i] % commSize].push_back(labels[i]);
+	  sendSizes[labels[i] % commSize].push_back(j - i);
+	  i = j;
+	}
+
+	std::vector<int> sendCounts(commSize), sendDispls(commSize+1, 0), recvCounts(commSize), recvDispls(commSize+1, 0);
+	std::vector<long long> sendBuffer;
+	for (int r=0; r<commSize; r++)
+	{
+	  sendCounts[r] = 2*sendLabels[r].size();
+	  sendDispls[r+1] = sendDispls[r] + sendCounts[r];
+	  for (unsigned int k=0; k<sendLabels[r].size(); k++) { sendBuffer.push_back(sendLabels[r][k]);  sendBuffer.push_back(sendSizes[r][k]); }
+	}
+	MPI_CHECK(MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &recvCounts[0], 1, MPI_INT, MPI_COMM_WORLD));
+	for (int r=0; r<commSize; r++) recvDispls[r+1] = recvDispls[r] + recvCounts[r];
+	std::vector<long long> recvBuffer(recvDispls[commSize]);
+	MPI_CHECK(MPI_Alltoallv(sendBuffer.empty() ? 0 : &sendBuffer[0], &sendCounts[0], &sendDispls[0], MPI_LONG_LONG,
+	                        recvBuffer.empty() ? 0 : &recvBuffer[0], &recvCounts[0], &recvDispls[0], MPI_LONG_LONG, MPI_COMM_WORLD));
+
+	// total size of the labels of this rank
+	std::vector<std::pair<long long, long long> > totals;
+	for (unsigned int k=0; k<recvBuffer.size(); k+=2) totals.push_back(std::make_pair(recvBuffer[k], recvBuffer[k+1]));
+	std::sort(totals.begin(), totals.end());
+	std::vector<std::pair<long long, long long> > sums;
+	long long localHalos = 0;
+	for (unsigned int k=0; k<totals.size(); k++)
+	{
+	  if (sums.empty() || (sums.back().first != totals[k].first)) sums.push_back(totals[k]);
+	  else sums.back().second += totals[k].second;
+	}
+	for (unsigned int k=0; k<sums.size(); k++) if (sums[k].second >= particleSize) localHalos++;
+
+	// the totals go back in the order the labels came in
+	for (unsigned int k=0; k<recvBuffer.size(); k+=2)
+	  recvBuffer[k+1] = std::lower_bound(sums.begin(), sums.end(), std::make_pair(recvBuffer[k], (long long) -1))->second;
+	MPI_CHECK(MPI_Alltoallv(recvBuffer.empty() ? 0 : &recvBuffer[0], &recvCounts[0], &recvDispls[0], MPI_LONG_LONG,
+	                        sendBuffer.empty() ? 0 : &sendBuffer[0], &sendCounts[0], &sendDispls[0], MPI_LONG_LONG, MPI_COMM_WORLD));
+
+	std::vector<std::pair<long long, long long> > sizes;
+	for (unsigned int k=0; k<sendBuffer.size(); k+=2) sizes.push_back(std::make_pair(sendBuffer[k], sendBuffer[k+1]));
+	std::sort(sizes.begin(), sizes.end());
+
+	long long localHaloParticles = 0;
+	for (int i=0; i<numOfOwnParticles; i++)
+	{
+	  long long size = std::lower_bound(sizes.begin(), sizes.end(), std::make_pair((long long) haloIndex[i], (long long) -1))->second;
+	  if (size >= particleSize) localHaloParticles++;
+	  else haloIndex[i] = -1;
+	}
+
+	MPI_CHECK(MPI_Allreduce(&localHalos, &numOfHalos, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD));
+	MPI_CHECK(MPI_Allreduce(&localHaloParticles, &numOfHaloParticles, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD));
+    }
+};
+
+} // namespace piston
+
+#endif /* DISTRIBUTED_HALO_H_ */
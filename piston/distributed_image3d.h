@@ -0,0 +1,137 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DISTRIBUTED_IMAGE3D_H_
+#define DISTRIBUTED_IMAGE3D_H_
+
+#include <iostream>
+
+#include <thrust/host_vector.h>
+#include <thrust/device_vector.h>
+#include <thrust/transform.h>
+
+#include <piston/image3d.h>
+#include <piston/piston_math.h>
+#include <piston/block_decomposition.h>
+
+#include <piston/dthrust.h>
+
+namespace piston {
+
+/* image3d read in parallel from a raw float32 file (x fastest, then y, then
+ * z, after header_bytes) for DISTRIBUTED_PISTON. Instead of scattering the
+ * volume from rank 0 as image3d::distributeValues() does, every rank reads
+ * only its own block of the block_decomposition, ghost layers included,
+ * with one collective MPI-IO read through a subarray file view. The grid
+ * coordinates of the block are computed locally from origin and spacing.
+ *
+ * dim0, dim1, dim2, NPoints and NCells describe the whole volume, the block
+ * is in point_data_device and grid_coord_device as for distributeValues(),
+ * which does nothing here. */
+template <typename MemorySpace = thrust::detail::default_device_space_tag>
+struct distributed_image3d : public piston::image3d<MemorySpace>
+{
+    typedef piston::image3d<MemorySpace> Parent;
+
+    float3 origin;
+    float3 spacing;
+
+    bool valid;		// false if the file could not be read, NCells_local is 0 then
+
+    distributed_image3d(const char *filename, int xdim, int ydim, int zdim, long header_bytes = 0,
+                        const float *origin = 0, const float *spacing = 0) :
+	Parent(xdim, ydim, zdim),
+	origin(origin ? make_float3(origin[0], origin[1], origin[2]) : make_float3(0.0f, 0.0f, 0.0f)),
+	spacing(spacing ? make_float3(spacing[0], spacing[1], spacing[2]) : make_float3(1.0f, 1.0f, 1.0f)),
+	valid(false)
+    {
+	int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+
+	block_decomposition &blocks = this->decomposition;
+	blocks.decompose(xdim, ydim, zdim);
+	this->NCells_local = 0;
+
+	MPI_File file;
+	if (MPI_File_open(MPI_COMM_WORLD, (char *) filename, MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS) {
+	    if (commRank == 0) std::cout << "File: " << filename << " can't be opened " << std::endl;
+	    return;
+	}
+
+	// the size is the same for all ranks, so they agree on success and
+	// the collectives of the filters still match
+	MPI_Offset fileSize = 0;
+	MPI_CHECK(MPI_File_get_size(file, &fileSize));
+	if (fileSize < header_bytes + (MPI_Offset) this->NPoints*sizeof(float)) {
+	    if (commRank == 0) std::cout << "File: " << filename << " is too short " << std::endl;
+	    MPI_CHECK(MPI_File_close(&file));
+	    return;
+	}
+
+	// empty blocks take part in the collective read with nothing to read
+	MPI_Datatype blockType = MPI_FLOAT;
+	if (blocks.local_points() > 0) {
+	    int sizes[3] = { zdim, ydim, xdim };
+	    int subsizes[3] = { blocks.local_dims[2], blocks.local_dims[1], blocks.local_dims[0] };
+	    int starts[3] = { blocks.begin[2], blocks.begin[1], blocks.begin[0] };
+	    MPI_CHECK(MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_FLOAT, &blockType));
+	    MPI_CHECK(MPI_Type_commit(&blockType));
+	}
+
+	thrust::host_vector<float> point_data_local(blocks.local_points());
+	MPI_Status status;
+	MPI_CHECK(MPI_File_set_view(file, header_bytes, MPI_FLOAT, blockType, (char *) "native", MPI_INFO_NULL));
+	MPI_CHECK(MPI_File_read_all(file, thrust::raw_pointer_cast(&*point_data_local.begin()),
+	                            point_data_local.size(), MPI_FLOAT, &status));
+	MPI_CHECK(MPI_File_close(&file));
+	if (blockType != MPI_FLOAT) MPI_CHECK(MPI_Type_free(&blockType));
+
+	this->point_data_device = point_data_local;
+	this->grid_coord_device.resize(point_data_local.size());
+	thrust::transform(thrust::counting_iterator<int>(0), thrust::counting_iterator<int>(0)+point_data_local.size(),
+	                  this->grid_coord_device.begin(),
+	                  block_decomposition::local_coordinates_functor(blocks.local_dims, blocks.begin,
+	                                                                 this->origin, this->spacing));
+
+	this->NCells_local = blocks.local_cells();
+	valid = true;
+    }
+
+    // the block is read by the constructor
+    void distributeValues(bool includeGrid=true) {}
+
+    // refresh the ghost layers after the owned points of point_data_device
+    // were modified, collective
+    void exchange_ghosts() {
+	this->decomposition.exchange_ghosts(this->point_data_device);
+	this->modified();
+    }
+
+    bool is_open() const {
+	return valid;
+    }
+};
+
+} // namespace piston
+
+#endif /* DISTRIBUTED_IMAGE3D_H_ */
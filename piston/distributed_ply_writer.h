@@ -0,0 +1,170 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DISTRIBUTED_PLY_WRITER_H_
+#define DISTRIBUTED_PLY_WRITER_H_
+
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <thrust/host_vector.h>
+
+#include <piston/piston_math.h>
+
+#include <piston/dthrust.h>
+
+namespace piston {
+
+/* Write the triangles of a distributed contour (every three consecutive
+ * vertices are a triangle, as generated by dmarching_cube) into one binary
+ * PLY file without gathering them. The local vertices go to position
+ * vertex_offset of the total_vertices of all ranks in the file, every rank
+ * writes its vertices and faces directly with MPI_File_write_at_all, rank 0
+ * also writes the header. The vertices are stored in rank order with the
+ * normals and, if scalars is not 0, the scalars; the faces index them
+ * globally. The file is little endian, as the hosts are. The face indices
+ * are 32 bit, so at most UINT_MAX vertices can be written. Collective,
+ * returns false on all ranks if there are more or the file can't be
+ * written. */
+template <typename VerticesContainer, typename NormalsContainer, typename ScalarContainer>
+bool write_distributed_ply(const char *filename, long long num_vertices, long long vertex_offset, long long total_vertices,
+                           const VerticesContainer &vertices, const NormalsContainer &normals,
+                           const ScalarContainer *scalars)
+{
+    int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+
+    if (total_vertices > (long long) UINT_MAX)
+    {
+      if (commRank == 0) std::cout << "File: " << filename << " can't hold " << total_vertices << " vertices " << std::endl;
+      return false;
+    }
+
+    std::ostringstream header;
+    header << "ply\n"
+           << "format binary_little_endian 1.0\n"
+           << "element vertex " << total_vertices << "\n"
+           << "property float x\nproperty float y\nproperty float z\n"
+           << "property float nx\nproperty float ny\nproperty float nz\n";
+    if (scalars) header << "property float scalar\n";
+    header << "element face " << total_vertices/3 << "\n"
+           << "property list uchar uint vertex_indices\n"
+           << "end_header\n";
+    const std::string headerString = header.str();
+
+    // interleave the vertex records and build the face records on the host
+    const int vertexFloats = scalars ? 7 : 6;
+    const int vertexBytes = vertexFloats*sizeof(float);
+    const int faceBytes = 1 + 3*sizeof(unsigned int);
+
+    thrust::host_vector<float4> verticesHost(vertices.begin(), vertices.begin()+num_vertices);
+    thrust::host_vector<float3> normalsHost(normals.begin(), normals.begin()+num_vertices);
+    thrust::host_vector<float> scalarsHost;
+    if (scalars) scalarsHost.assign(scalars->begin(), scalars->begin()+num_vertices);
+
+    std::vector<float> vertexRecords((size_t) num_vertices*vertexFloats);
+    for (long long v=0; v<num_vertices; v++)
+    {
+      float *record = &vertexRecords[v*vertexFloats];
+      const float4 p = verticesHost[v];
+      const float3 n = normalsHost[v];
+      record[0] = p.x;  record[1] = p.y;  record[2] = p.z;
+      record[3] = n.x;  record[4] = n.y;  record[5] = n.z;
+      if (scalars) record[6] = scalarsHost[v];
+    }
+
+    std::vector<char> faceRecords((size_t) (num_vertices/3)*faceBytes);
+    for (long long f=0; f<num_vertices/3; f++)
+    {
+      char *record = &faceRecords[f*faceBytes];
+      record[0] = 3;
+      for (int i=0; i<3; i++)
+      {
+        const unsigned int index = (unsigned int) (vertex_offset + 3*f + i);
+        std::memcpy(record + 1 + i*sizeof(unsigned int), &index, sizeof(unsigned int));
+      }
+    }
+
+    MPI_File file;
+    if (MPI_File_open(MPI_COMM_WORLD, (char *) filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+    {
+      if (commRank == 0) std::cout << "File: " << filename << " can't be opened " << std::endl;
+      return false;
+    }
+    MPI_CHECK(MPI_File_set_size(file, 0));
+
+    // counted in records, so the local counts fit in an int
+    MPI_Datatype vertexType, faceType;
+    MPI_CHECK(MPI_Type_contiguous(vertexBytes, MPI_BYTE, &vertexType));  MPI_CHECK(MPI_Type_commit(&vertexType));
+    MPI_CHECK(MPI_Type_contiguous(faceBytes, MPI_BYTE, &faceType));  MPI_CHECK(MPI_Type_commit(&faceType));
+
+    const MPI_Offset verticesStart = headerString.size();
+    const MPI_Offset facesStart = verticesStart + (MPI_Offset) total_vertices*vertexBytes;
+    MPI_Status status;
+    if (commRank == 0)
+      MPI_CHECK(MPI_File_write_at(file, 0, (void *) headerString.c_str(), headerString.size(), MPI_CHAR, &status));
+    MPI_CHECK(MPI_File_write_at_all(file, verticesStart + (MPI_Offset) vertex_offset*vertexBytes,
+                                    vertexRecords.empty() ? 0 : &vertexRecords[0], num_vertices, vertexType, &status));
+    MPI_CHECK(MPI_File_write_at_all(file, facesStart + (MPI_Offset) (vertex_offset/3)*faceBytes,
+                                    faceRecords.empty() ? 0 : &faceRecords[0], num_vertices/3, faceType, &status));
+
+    MPI_CHECK(MPI_Type_free(&vertexType));
+    MPI_CHECK(MPI_Type_free(&faceType));
+    MPI_CHECK(MPI_File_close(&file));
+    return true;
+}
+
+// the local vertices of every rank, their position among the vertices of
+// all ranks comes from one MPI_Exscan and their total from one MPI_Allreduce
+template <typename VerticesContainer, typename NormalsContainer, typename ScalarContainer>
+bool write_distributed_ply(const char *filename, long long num_vertices,
+                           const VerticesContainer &vertices, const NormalsContainer &normals,
+                           const ScalarContainer *scalars)
+{
+    int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+
+    long long vertex_offset = 0, total_vertices = 0;
+    MPI_CHECK(MPI_Exscan(&num_vertices, &vertex_offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD));
+    MPI_CHECK(MPI_Allreduce(&num_vertices, &total_vertices, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD));
+    if (commRank == 0) vertex_offset = 0;
+
+    return write_distributed_ply(filename, num_vertices, vertex_offset, total_vertices, vertices, normals, scalars);
+}
+
+// the triangles of a contour filter such as dmarching_cube, placed with the
+// global vertex offset and count it has computed already
+template <typename ContourFilter>
+bool write_distributed_ply(const char *filename, ContourFilter &contour, bool withScalars = true)
+{
+    return write_distributed_ply(filename, (long long) contour.num_total_vertices,
+                                 contour.global_vertex_offset, contour.global_num_vertices,
+                                 contour.vertices, contour.normals, withScalars ? &contour.scalars : 0);
+}
+
+} // namespace piston
+
+#endif /* DISTRIBUTED_PLY_WRITER_H_ */
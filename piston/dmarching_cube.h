@@ -26,6 +26,8 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #define DMARCHING_CUBE_H_
 
 #include <thrust/copy.h>
+#include <thrust/count.h>
+#include <thrust/reduce.h>
 #include <thrust/scan.h>
 #include <thrust/transform_scan.h>
 #include <thrust/binary_search.h>
@@ -91,17 +93,42 @@ public:
     value_type minIso, maxIso;
 
 
+    // everything needed to generate the vertices of a cell without the
+    // grid, active cells are sent to other ranks this way for load balancing
+    struct active_cell
+    {
+	float  f[8];		// point data at the corners
+	float3 p[8];		// coordinates of the corners
+	float  s[8];		// source scalars at the corners
+	int    cubeindex;
+	int    num_vertices;
+    };
+
+    typedef typename detail::choose_container<InputPointDataIterator, active_cell>::type ActiveCellsContainer;
+
+    struct isosurface_functor;
+
+    bool loadBalance;	// redistribute the active cells so all ranks generate about the same number of vertices
+
+    IndicesContainer	active_cell_ids;	// local ids of the cells generating vertices, load balancing only
+    ActiveCellsContainer	active_cells;	// active cells to generate the vertices of, load balancing only
+
     VerticesContainer	vertices; 	// output vertices, only valid ones
     NormalsContainer	normals;	// surface normal computed by cross product of triangle edges
     ScalarContainer	scalars;	// interpolated scalar output
 
     unsigned int num_total_vertices;
 
+    long long global_vertex_offset;	// position of the local vertices in the vertices of all ranks
+    long long global_num_vertices;	// number of vertices of all ranks
+    long long local_num_vertices;	// send buffer of the nonblocking collectives computing the two above
+
 
     dmarching_cube(InputDataSet1 &input, InputDataSet2 &source, value_type isovalue = value_type()) :
 	           input(input), source(source), isovalue(isovalue), discardMinVals(true), 
 	           triTable((int*) triTable_array, (int*) triTable_array+256*16),
-	           numVertsTable((int *) numVerticesTable_array, (int *) numVerticesTable_array+256) 
+	           numVertsTable((int *) numVerticesTable_array, (int *) numVerticesTable_array+256),
+	           loadBalance(false), global_vertex_offset(0), global_num_vertices(0)
     { 
         input.distributeValues(true);  source.distributeValues(false);
     }
@@ -114,6 +141,8 @@ public:
 	  num_vertices.clear();
 	}
 	output_vertices_enum.clear();
+	active_cell_ids.clear();
+	active_cells.clear();
 	vertices.clear();
 	normals.clear();
 	scalars.clear();
@@ -127,29 +156,157 @@ public:
 
 	thrust::transform(CountingIterator(0), CountingIterator(0)+NCells,
 	                  thrust::make_zip_iterator(thrust::make_tuple(case_index.begin(), num_vertices.begin())),
-	                  classify_cell(thrust::raw_pointer_cast(&*input.point_data_device.begin()), isovalue, discardMinVals, input.dim0, input.dim1, input.dim2, 
+	                  classify_cell(thrust::raw_pointer_cast(&*input.point_data_device.begin()), isovalue, discardMinVals,
+	                                input.decomposition.local_dims[0], input.decomposition.local_dims[1], input.decomposition.local_dims[2],
 	                                numVertsTable.begin()));
         //dthrust::output_global_vector(num_vertices, input.NCells, NCells);
 
+        if (loadBalance) { balanced_generation(NCells);  return; }
+
         output_vertices_enum.resize(NCells);  
         thrust::exclusive_scan(num_vertices.begin(), num_vertices.end(), output_vertices_enum.begin());        
         
-        num_total_vertices = output_vertices_enum[NCells-1] + num_vertices[NCells-1];
+        num_total_vertices = (NCells > 0) ? output_vertices_enum[NCells-1] + num_vertices[NCells-1] : 0;
         vertices.resize(num_total_vertices);
         normals.resize(num_total_vertices);
         scalars.resize(num_total_vertices);
 
+        // the global counts are in flight while the vertices are generated
+        MPI_Request requests[2];
+        start_global_counts(requests, true);
+
         thrust::for_each(thrust::make_zip_iterator(thrust::make_tuple(CountingIterator(0), output_vertices_enum.begin(), case_index.begin(), num_vertices.begin())),
 	                 thrust::make_zip_iterator(thrust::make_tuple(CountingIterator(0)+NCells,   output_vertices_enum.end(),   case_index.end(),   num_vertices.end())), 
-                         isosurface_functor(thrust::raw_pointer_cast(&*input.point_data_device.begin()), thrust::raw_pointer_cast(&*input.grid_coord_device.begin()),
-                                            thrust::raw_pointer_cast(&*source.point_data_device.begin()),  
-                                            isovalue, input.dim0, input.dim1, input.dim2, triTable.begin(),
-	                                    thrust::raw_pointer_cast(&*vertices.begin()),
-	                                    thrust::raw_pointer_cast(&*normals.begin()),
-	                                    thrust::raw_pointer_cast(&*scalars.begin())));
+                         make_isosurface_functor());
+
+        finish_global_counts(requests, true);
+    }
+
+    // start the nonblocking collectives for global_vertex_offset and,
+    // if withTotal, global_num_vertices from num_total_vertices
+    void start_global_counts(MPI_Request requests[2], bool withTotal)
+    {
+        local_num_vertices = num_total_vertices;
+        MPI_CHECK(MPI_Iexscan(&local_num_vertices, &global_vertex_offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD, &requests[0]));
+        if (withTotal) { MPI_CHECK(MPI_Iallreduce(&local_num_vertices, &global_num_vertices, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD, &requests[1])); }
+    }
+
+    void finish_global_counts(MPI_Request requests[2], bool withTotal)
+    {
+        int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+        MPI_CHECK(MPI_Waitall(withTotal ? 2 : 1, requests, MPI_STATUSES_IGNORE));
+        // the result of MPI_Iexscan is undefined on rank 0
+        if (commRank == 0) global_vertex_offset = 0;
+    }
+
+    isosurface_functor make_isosurface_functor()
+    {
+        return isosurface_functor(thrust::raw_pointer_cast(&*input.point_data_device.begin()), thrust::raw_pointer_cast(&*input.grid_coord_device.begin()),
+                                  thrust::raw_pointer_cast(&*source.point_data_device.begin()),  
+                                  isovalue, input.decomposition.local_dims[0], input.decomposition.local_dims[1], input.decomposition.local_dims[2],
+	                          triTable.begin(),
+	                          thrust::raw_pointer_cast(&*vertices.begin()),
+	                          thrust::raw_pointer_cast(&*normals.begin()),
+	                          thrust::raw_pointer_cast(&*scalars.begin()));
+    }
+
+    /* Load balanced vertex generation. The active cells are packed with
+     * their corner data and split by their global vertex offsets so every
+     * rank gets a contiguous part of about the same number of vertices,
+     * then exchanged with MPI_Alltoallv. The vertices end up in the same
+     * global order as without load balancing, only distributed differently.
+     *
+     * The offset of the rank and the total are computed with nonblocking
+     * collectives while the cells are packed and copied to the host, and
+     * are added to the local offsets at the end. */
+    void balanced_generation(int NCells)
+    {
+        int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+        int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+
+        long long localVertices = thrust::reduce(num_vertices.begin(), num_vertices.end());
+        long long rankOffset = 0;
+        MPI_Request requests[2];
+        MPI_CHECK(MPI_Iexscan(&localVertices, &rankOffset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD, &requests[0]));
+        MPI_CHECK(MPI_Iallreduce(&localVertices, &global_num_vertices, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD, &requests[1]));
+
+        int numActive = thrust::count_if(num_vertices.begin(), num_vertices.end(), is_active());
+        active_cell_ids.resize(numActive);
+        thrust::copy_if(CountingIterator(0), CountingIterator(0)+NCells, num_vertices.begin(), active_cell_ids.begin(), is_active());
+
+        active_cells.resize(numActive);
+        thrust::transform(active_cell_ids.begin(), active_cell_ids.end(), active_cells.begin(),
+                          gather_cell_functor(make_isosurface_functor(),
+                                              thrust::raw_pointer_cast(&*case_index.begin()),
+                                              thrust::raw_pointer_cast(&*num_vertices.begin())));
+
+        thrust::host_vector<active_cell> sendCells = active_cells;
+        thrust::host_vector<long long> offsets(numActive);
+        thrust::transform_exclusive_scan(sendCells.begin(), sendCells.end(), offsets.begin(), cell_num_vertices(), 0LL, thrust::plus<long long>());
+
+        MPI_CHECK(MPI_Waitall(2, requests, MPI_STATUSES_IGNORE));
+        if (commRank == 0) rankOffset = 0;
+        thrust::transform(offsets.begin(), offsets.end(), thrust::make_constant_iterator(rankOffset), offsets.begin(), thrust::plus<long long>());
+
+        // the destination of a cell only grows with its offset, so the cells
+        // for each rank are contiguous
+        std::vector<int> sendCounts(commSize, 0), recvCounts(commSize), sendDispls(commSize, 0), recvDispls(commSize, 0);
+        for (int i=0; i<numActive; i++)
+          sendCounts[(int) ((offsets[i]*commSize) / global_num_vertices)]++;
+        MPI_CHECK(MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &recvCounts[0], 1, MPI_INT, MPI_COMM_WORLD));
+        for (int r=1; r<commSize; r++)
+        {
+          sendDispls[r] = sendDispls[r-1] + sendCounts[r-1];
+          recvDispls[r] = recvDispls[r-1] + recvCounts[r-1];
+        }
+
+        MPI_Datatype cellType;
+        MPI_CHECK(MPI_Type_contiguous(sizeof(active_cell), MPI_BYTE, &cellType));
+        MPI_CHECK(MPI_Type_commit(&cellType));
+        thrust::host_vector<active_cell> recvCells(recvDispls[commSize-1] + recvCounts[commSize-1]);
+        MPI_CHECK(MPI_Alltoallv(thrust::raw_pointer_cast(&*sendCells.begin()), &sendCounts[0], &sendDispls[0], cellType,
+                                thrust::raw_pointer_cast(&*recvCells.begin()), &recvCounts[0], &recvDispls[0], cellType, MPI_COMM_WORLD));
+        MPI_CHECK(MPI_Type_free(&cellType));
+
+        active_cells = recvCells;
+        numActive = active_cells.size();
+
+        output_vertices_enum.resize(numActive);
+        thrust::transform_exclusive_scan(active_cells.begin(), active_cells.end(), output_vertices_enum.begin(),
+                                         cell_num_vertices(), 0, thrust::plus<int>());
+
+        num_total_vertices = (numActive > 0) ? output_vertices_enum[numActive-1] + ((active_cell) active_cells[numActive-1]).num_vertices : 0;
+        vertices.resize(num_total_vertices);
+        normals.resize(num_total_vertices);
+        scalars.resize(num_total_vertices);
+
+        start_global_counts(requests, false);
+
+        thrust::for_each(thrust::make_zip_iterator(thrust::make_tuple(active_cells.begin(), output_vertices_enum.begin())),
+                         thrust::make_zip_iterator(thrust::make_tuple(active_cells.end(),   output_vertices_enum.end())),
+                         active_cell_functor(make_isosurface_functor()));
+
+        finish_global_counts(requests, false);
     }
 
 
+    struct is_active : public thrust::unary_function<int, bool>
+    {
+	__host__ __device__
+	bool operator()(int num_vertices) const {
+	    return num_vertices > 0;
+	}
+    };
+
+    struct cell_num_vertices : public thrust::unary_function<active_cell, int>
+    {
+	__host__ __device__
+	int operator()(const active_cell& cell) const {
+	    return cell.num_vertices;
+	}
+    };
+
+
     struct classify_cell : public thrust::unary_function<int, thrust::tuple<int, int> >
     {
         float*                  point_data;
@@ -289,10 +446,16 @@ public:
 
             if (numVertices == 0) return;
 
-	    const int verticesForEdge[] = { 0, 1, 1, 2, 3, 2, 0, 3,
-	                                    4, 5, 5, 6, 7, 6, 4, 7,
-	                                    0, 4, 1, 5, 2, 6, 3, 7 };
+	    float f[8];
+	    float3 p[8];
+	    float s[8];
+	    gather(cell_id, f, p, s);
+	    polygonize(f, p, s, cubeindex, numVertices, outputVertId);
+	}
 
+	// point data, coordinates and source scalars at the corners of a cell
+	__host__ __device__
+	void gather(int cell_id, float f[8], float3 p[8], float s[8]) const {
 	    const int x = cell_id % (xdim - 1);
 	    const int y = (cell_id / (xdim - 1)) % (ydim -1);
 	    const int z = cell_id / cells_per_layer;
@@ -309,7 +472,6 @@ public:
 	    i[6] = i[2]   + xdim * ydim;
 	    i[7] = i[3]   + xdim * ydim;
 
-	    float f[8];
 	    f[0] = *(point_data + i[0]);
 	    f[1] = *(point_data + i[1]);
 	    f[2] = *(point_data + i[2]);
@@ -320,7 +482,6 @@ public:
 	    f[7] = *(point_data + i[7]);
 
 	    // TODO: Reconsider what GridCoordinates should be (tuple or float3)
-	    float3 p[8];
 	    p[0] = (*(grid_coord + i[0]));
 	    p[1] = (*(grid_coord + i[1]));
 	    p[2] = (*(grid_coord + i[2]));
@@ -330,7 +491,6 @@ public:
 	    p[6] = (*(grid_coord + i[6]));
 	    p[7] = (*(grid_coord + i[7]));
 
-	    float s[8];
 	    s[0] = *(scalar_source + i[0]);
 	    s[1] = *(scalar_source + i[1]);
 	    s[2] = *(scalar_source + i[2]);
@@ -339,6 +499,15 @@ public:
 	    s[5] = *(scalar_source + i[5]);
 	    s[6] = *(scalar_source + i[6]);
 	    s[7] = *(scalar_source + i[7]);
+	}
+
+	// generate the vertices, normals and scalars of a cell
+	__host__ __device__
+	void polygonize(const float f[8], const float3 p[8], const float s[8],
+	                int cubeindex, int numVertices, int outputVertId) {
+	    const int verticesForEdge[] = { 0, 1, 1, 2, 3, 2, 0, 3,
+	                                    4, 5, 5, 6, 7, 6, 4, 7,
+	                                    0, 4, 1, 5, 2, 6, 3, 7 };
 
 	    // interpolation for vertex positions and associated scalar values
 	    for (int v = 0; v < numVertices; v++) {
@@ -364,6 +533,40 @@ public:
 	}
     };
 
+    // pack an active cell with its corner data, for load balancing
+    struct gather_cell_functor : public thrust::unary_function<int, active_cell>
+    {
+	isosurface_functor isosurface;
+	const int *case_index;
+	const int *num_vertices;
+
+	gather_cell_functor(isosurface_functor isosurface, const int *case_index, const int *num_vertices) :
+	    isosurface(isosurface), case_index(case_index), num_vertices(num_vertices) {}
+
+	__host__ __device__
+	active_cell operator()(int cell_id) const {
+	    active_cell cell;
+	    isosurface.gather(cell_id, cell.f, cell.p, cell.s);
+	    cell.cubeindex = case_index[cell_id];
+	    cell.num_vertices = num_vertices[cell_id];
+	    return cell;
+	}
+    };
+
+    // generate the vertices of a packed active cell
+    struct active_cell_functor : public thrust::unary_function<thrust::tuple<active_cell, int>, void>
+    {
+	isosurface_functor isosurface;
+
+	active_cell_functor(isosurface_functor isosurface) : isosurface(isosurface) {}
+
+	__host__ __device__
+	void operator()(thrust::tuple<active_cell, int> cell_tuple) {
+	    const active_cell cell = thrust::get<0>(cell_tuple);
+	    isosurface.polygonize(cell.f, cell.p, cell.s, cell.cubeindex, cell.num_vertices, thrust::get<1>(cell_tuple));
+	}
+    };
+
     VerticesIterator vertices_begin() {
 	return vertices.begin();
     }
@@ -4,11 +4,32 @@
 #include <thrust/device_vector.h>
 #include <thrust/sequence.h>
 #include <thrust/scan.h>
+#include <thrust/reduce.h>
+#include <thrust/transform.h>
+#include <thrust/count.h>
+#include <thrust/copy.h>
+#include <thrust/sort.h>
+#include <thrust/extrema.h>
+#include <thrust/binary_search.h>
+#include <thrust/pair.h>
+#include <thrust/functional.h>
 #include <thrust/iterator/constant_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
 
+#include <algorithm>
+#include <vector>
 #include <iostream>
 #include <typeinfo>
+#ifdef PISTON_THREAD_MPI
+#include <piston/thread_mpi.h>
+#else
 #include <mpi.h>
+#endif
+
+// storage of the per rank state of the collectives, thread local when the ranks are threads
+#ifndef PISTON_THREAD_LOCAL
+#define PISTON_THREAD_LOCAL
+#endif
 
 namespace dthrust
 {
@@ -38,6 +59,9 @@ template <typename T>
 void device_to_host(int hsize, thrust::device_vector<T>& d, thrust::host_vector<T>& h);
 
 
+// Distributed scan over the concatenation of the local ranges of all ranks in
+// rank order.  binop must be associative, the totals of the lower ranks are
+// combined with one MPI_Exscan (a user-defined MPI_Op unless binop is plus).
 template <typename InputIterator, typename OutputIterator, typename T, typename BinaryOperation>
 OutputIterator scan(InputIterator first, InputIterator last, OutputIterator result, T init, bool inclusiveScan, BinaryOperation binop);
 
@@ -45,7 +69,8 @@ OutputIterator scan(InputIterator first, InputIterator last, OutputIterator resu
 template <typename InputIterator, typename OutputIterator, typename BinaryOperation>
 OutputIterator inclusive_scan(InputIterator first, InputIterator last, OutputIterator result, BinaryOperation binop)
 {
-    return dthrust::scan(first, last, result, 0, true, binop);
+    typedef typename thrust::iterator_value<OutputIterator>::type ValueType;
+    return dthrust::scan(first, last, result, ValueType(), true, binop);
 }
 
 
@@ -70,10 +95,80 @@ OutputIterator transform(InputIterator1 first1, InputIterator1 last1, OutputIter
 }
 
 
+// The reductions below combine the local ranges of all ranks in rank order
+// with one MPI_Allreduce, their result is returned on every rank.
+template <typename InputIterator, typename T, typename BinaryFunction>
+T reduce(InputIterator first, InputIterator last, T init, BinaryFunction binary_op);
+
+
+template <typename InputIterator, typename T>
+T reduce(InputIterator first, InputIterator last, T init)
+{
+    return dthrust::reduce(first, last, init, thrust::plus<T>());
+}
+
+
+template <typename InputIterator>
+typename thrust::iterator_value<InputIterator>::type reduce(InputIterator first, InputIterator last)
+{
+    typedef typename thrust::iterator_value<InputIterator>::type T;
+    return dthrust::reduce(first, last, T(), thrust::plus<T>());
+}
+
+
+template <typename InputIterator, typename Predicate>
+long long count_if(InputIterator first, InputIterator last, Predicate pred);
+
+
+// An element of the distributed range, index is its position in the
+// concatenation of the local ranges in rank order, -1 if the range is empty.
+template <typename T>
+struct global_element
+{
+    T value;
+    long long index;
+};
+
+
+template <typename ForwardIterator, typename BinaryPredicate>
+thrust::pair<global_element<typename thrust::iterator_value<ForwardIterator>::type>,
+             global_element<typename thrust::iterator_value<ForwardIterator>::type> >
+minmax_element(ForwardIterator first, ForwardIterator last, BinaryPredicate comp);
+
+
+template <typename ForwardIterator>
+thrust::pair<global_element<typename thrust::iterator_value<ForwardIterator>::type>,
+             global_element<typename thrust::iterator_value<ForwardIterator>::type> >
+minmax_element(ForwardIterator first, ForwardIterator last);
+
+
+// Local copy_if, offset is set to the position of the first element copied
+// by this rank in the distributed result.
+template <typename InputIterator, typename OutputIterator, typename Predicate>
+OutputIterator copy_if(InputIterator first, InputIterator last, OutputIterator result, Predicate pred, long long& offset);
+
+
+// Sample sort of the key/value pairs of all ranks, afterwards the keys of a
+// rank are sorted and not greater than the keys of the next rank.  The
+// vectors are resized to the pairs received, which is about the same number
+// on all ranks unless there are many equal keys.  Every rank contributes
+// SORT_SAMPLES_PER_RANK regular samples of its keys (all of them if it has
+// fewer) to pick the splitters, oversampling keeps the parts even with few
+// ranks.
+#define SORT_SAMPLES_PER_RANK 64
+
+template <typename KeyVector, typename ValueVector>
+void sort_by_key(KeyVector& keys, ValueVector& values);
+
+
 template<typename InputIterator, typename OutputVector>
 typename OutputVector::iterator upper_bound_counting(InputIterator first, InputIterator last, int cntMax, OutputVector& result); 
 
 
+template<typename InputIterator, typename OutputIterator, typename UnaryFunction, typename AssociativeOperator>
+OutputIterator transform_inclusive_scan(InputIterator first, InputIterator last, OutputIterator result, UnaryFunction unary_op, AssociativeOperator binary_op);
+
+
 template <typename T>
 void output_global_vector(thrust::device_vector<T>& testing, int gsize, int lsize);
 
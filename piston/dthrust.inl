@@ -59,27 +59,126 @@ void device_to_host(int hsize, thrust::device_vector<T>& d, thrust::host_vector<
 }
 
 
+// Partial result of one rank in a distributed scan or reduction.  Ranks
+// without elements contribute an invalid partial, so no identity element of
+// the operator is needed.
+template <typename T>
+struct partial_result
+{
+    T value;
+    int valid;
+};
+
+
+// Wraps an arbitrary associative BinaryOperation as a user-defined MPI_Op on
+// partial_result<T>, passed as raw bytes.  MPI combines the operands in rank
+// order (invec from the lower ranks), so the operator need not be commutative.
+template <typename T, typename BinaryOperation>
+struct mpi_user_op
+{
+    static PISTON_THREAD_LOCAL BinaryOperation* binop;
+
+    static void apply(void* invec, void* inoutvec, int* len, MPI_Datatype* dt)
+    {
+        partial_result<T>* in = (partial_result<T>*) invec;
+        partial_result<T>* inout = (partial_result<T>*) inoutvec;
+        for (int i=0; i<*len; i++)
+        {
+          if (!in[i].valid) continue;
+          if (inout[i].valid) inout[i].value = (*binop)(in[i].value, inout[i].value);
+          else inout[i] = in[i];
+        }
+    }
+};
+
+template <typename T, typename BinaryOperation>
+PISTON_THREAD_LOCAL BinaryOperation* mpi_user_op<T, BinaryOperation>::binop = 0;
+
+
+// Predefined MPI operation equivalent to binop, MPI_OP_NULL if there is none
+template <typename BinaryOperation>
+MPI_Op get_mpi_op(const BinaryOperation&) { return MPI_OP_NULL; }
+
+template <typename T>
+MPI_Op get_mpi_op(const thrust::plus<T>&) { return MPI_SUM; }
+
+
+// Combines the per-rank partials over MPI_COMM_WORLD with a single
+// MPI_Exscan (exclusive) or MPI_Allreduce.  Returns false if there is nothing
+// to combine: always on rank 0 for MPI_Exscan, and where all the partials
+// combined are invalid.
+template <typename T, typename BinaryOperation>
+bool combine_partials(partial_result<T> partial, T& combined, BinaryOperation binop, bool exclusive)
+{
+    int commRank; MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+
+    MPI_Datatype dataType;  int dataTypeFactor;  dthrust::get_mpi_type<T>(typeid(T), dataType, dataTypeFactor);
+    MPI_Op op = get_mpi_op(binop);
+    if ((op != MPI_OP_NULL) && (dataType != MPI_CHAR))
+    {
+      // predefined operation on a predefined type, empty ranks contribute T()
+      T local = partial.valid ? partial.value : T();
+      if (exclusive) { MPI_CHECK(MPI_Exscan(&local, &combined, dataTypeFactor, dataType, op, MPI_COMM_WORLD)); }
+      else { MPI_CHECK(MPI_Allreduce(&local, &combined, dataTypeFactor, dataType, op, MPI_COMM_WORLD)); }
+      return !exclusive || (commRank > 0);
+    }
+
+    MPI_Datatype partialType;
+    MPI_CHECK(MPI_Type_contiguous(sizeof(partial_result<T>), MPI_BYTE, &partialType));
+    MPI_CHECK(MPI_Type_commit(&partialType));
+    mpi_user_op<T, BinaryOperation>::binop = &binop;
+    MPI_CHECK(MPI_Op_create(&mpi_user_op<T, BinaryOperation>::apply, 0, &op));
+
+    partial_result<T> result;  result.valid = 0;
+    if (exclusive) { MPI_CHECK(MPI_Exscan(&partial, &result, 1, partialType, op, MPI_COMM_WORLD)); }
+    else { MPI_CHECK(MPI_Allreduce(&partial, &result, 1, partialType, op, MPI_COMM_WORLD)); }
+
+    MPI_CHECK(MPI_Op_free(&op));
+    MPI_CHECK(MPI_Type_free(&partialType));
+    mpi_user_op<T, BinaryOperation>::binop = 0;
+
+    // the receive buffer of rank 0 is undefined after MPI_Exscan
+    if ((exclusive && (commRank == 0)) || !result.valid) return false;
+    combined = result.value;
+    return true;
+}
+
+
 template <typename InputIterator, typename OutputIterator, typename T, typename BinaryOperation>
 OutputIterator scan(InputIterator first, InputIterator last, OutputIterator result, T init, bool inclusiveScan, BinaryOperation binop)
 {
-    int commSize; MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize)); 
     int commRank; MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
     int N = last - first;
 
-    T psum = 0;  if (!inclusiveScan) psum = *(last-1);
-
-    if (inclusiveScan) thrust::inclusive_scan(first, last, result, binop);
-    else if (commRank == 0) thrust::exclusive_scan(first, last, result, init, binop);
-    else thrust::exclusive_scan(first, last, result, 0, binop);
+    typedef typename thrust::iterator_value<OutputIterator>::type ValueType;
+    partial_result<ValueType> partial;  partial.valid = 0;
+    ValueType prefix;
 
-    psum += *(result+N-1);  std::vector<T> psums;   
-    MPI_Datatype dataType;  int dataTypeFactor;  dthrust::get_mpi_type<T>(typeid(T), dataType, dataTypeFactor);
-    if (commRank == 0) { psums.resize(commSize+1); psums[0] = 0; }
-    MPI_CHECK(MPI_Gather(&psum, 1, dataType, &psums[1], 1, dataType, 0, MPI_COMM_WORLD)); 
-    if (commRank == 0) std::partial_sum(psums.begin(), psums.end(), psums.begin(), binop); 
-    MPI_CHECK(MPI_Scatter(&psums[0], 1, dataType, &psum, 1, dataType, 0, MPI_COMM_WORLD));
-
-    thrust::transform(result, result+N, thrust::make_constant_iterator(psum), result, binop);
+    if (inclusiveScan)
+    {
+      // local scan, then offset it by the combined totals of the lower ranks
+      if (N > 0)
+      {
+        thrust::inclusive_scan(first, last, result, binop);
+        partial.value = *(result+N-1);  partial.valid = 1;
+      }
+      if (dthrust::combine_partials(partial, prefix, binop, true) && (N > 0))
+        thrust::transform(thrust::make_constant_iterator(prefix), thrust::make_constant_iterator(prefix)+N, result, result, binop);
+    }
+    else
+    {
+      // the local total is needed before the scan, which is then seeded with
+      // init on rank 0 and with the combined totals of the lower ranks elsewhere
+      if (commRank == 0) { partial.value = init;  partial.valid = 1; }
+      if (N > 0)
+      {
+        partial.value = partial.valid ? thrust::reduce(first, last, partial.value, binop)
+                                      : thrust::reduce(first+1, last, ValueType(*first), binop);
+        partial.valid = 1;
+      }
+      if (!dthrust::combine_partials(partial, prefix, binop, true)) prefix = init;
+      if (N > 0) thrust::exclusive_scan(first, last, result, prefix, binop);
+    }
 
     return (result+N);
 }
@@ -88,8 +187,180 @@ OutputIterator scan(InputIterator first, InputIterator last, OutputIterator resu
 template<typename InputIterator, typename OutputIterator, typename UnaryFunction, typename AssociativeOperator>
 OutputIterator transform_inclusive_scan(InputIterator first, InputIterator last, OutputIterator result, UnaryFunction unary_op, AssociativeOperator binary_op)
 {
-    dthrust::transform(first, last, result, unary_op);
-    dthrust::inclusive_scan(result, result+(last-first), result, binary_op); 
+    typedef typename thrust::iterator_value<OutputIterator>::type ValueType;
+    return dthrust::scan(thrust::make_transform_iterator(first, unary_op), thrust::make_transform_iterator(last, unary_op), result, ValueType(), true, binary_op);
+}
+
+
+template <typename InputIterator, typename T, typename BinaryFunction>
+T reduce(InputIterator first, InputIterator last, T init, BinaryFunction binary_op)
+{
+    partial_result<T> partial;  partial.valid = 0;
+    if (first != last) { partial.value = thrust::reduce(first+1, last, T(*first), binary_op);  partial.valid = 1; }
+
+    T combined;
+    if (!dthrust::combine_partials(partial, combined, binary_op, false)) return init;
+    return binary_op(init, combined);
+}
+
+
+template <typename InputIterator, typename Predicate>
+long long count_if(InputIterator first, InputIterator last, Predicate pred)
+{
+    long long count = thrust::count_if(first, last, pred);
+    MPI_CHECK(MPI_Allreduce(MPI_IN_PLACE, &count, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD));
+    return count;
+}
+
+
+// global index of the first element of the local range of this rank
+template <typename InputIterator>
+long long global_offset(InputIterator first, InputIterator last)
+{
+    int commRank; MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+    long long count = last - first;
+    long long offset = 0;
+    MPI_CHECK(MPI_Exscan(&count, &offset, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD));
+    return (commRank == 0) ? 0 : offset;
+}
+
+
+// combines the smallest and largest elements of two ranges, the first
+// one of equal elements wins as the lhs comes from the lower ranks
+template <typename T, typename BinaryPredicate>
+struct minmax_combine
+{
+    BinaryPredicate comp;
+
+    minmax_combine(BinaryPredicate comp) : comp(comp) {}
+
+    thrust::pair<global_element<T>, global_element<T> > operator()(const thrust::pair<global_element<T>, global_element<T> >& lhs,
+                                                                    const thrust::pair<global_element<T>, global_element<T> >& rhs) const
+    {
+        return thrust::make_pair(comp(rhs.first.value, lhs.first.value) ? rhs.first : lhs.first,
+                                 comp(lhs.second.value, rhs.second.value) ? rhs.second : lhs.second);
+    }
+};
+
+
+template <typename ForwardIterator, typename BinaryPredicate>
+thrust::pair<global_element<typename thrust::iterator_value<ForwardIterator>::type>,
+             global_element<typename thrust::iterator_value<ForwardIterator>::type> >
+minmax_element(ForwardIterator first, ForwardIterator last, BinaryPredicate comp)
+{
+    typedef typename thrust::iterator_value<ForwardIterator>::type T;
+    typedef thrust::pair<global_element<T>, global_element<T> > MinMax;
+
+    const long long offset = dthrust::global_offset(first, last);
+
+    partial_result<MinMax> partial;  partial.valid = 0;
+    if (first != last)
+    {
+      thrust::pair<ForwardIterator, ForwardIterator> local = thrust::minmax_element(first, last, comp);
+      partial.value.first.value = *local.first;    partial.value.first.index = offset + (local.first - first);
+      partial.value.second.value = *local.second;  partial.value.second.index = offset + (local.second - first);
+      partial.valid = 1;
+    }
+
+    MinMax combined;
+    if (!dthrust::combine_partials(partial, combined, minmax_combine<T, BinaryPredicate>(comp), false))
+    {
+      combined.first.value = combined.second.value = T();
+      combined.first.index = combined.second.index = -1;
+    }
+    return combined;
+}
+
+
+template <typename ForwardIterator>
+thrust::pair<global_element<typename thrust::iterator_value<ForwardIterator>::type>,
+             global_element<typename thrust::iterator_value<ForwardIterator>::type> >
+minmax_element(ForwardIterator first, ForwardIterator last)
+{
+    return dthrust::minmax_element(first, last, thrust::less<typename thrust::iterator_value<ForwardIterator>::type>());
+}
+
+
+template <typename InputIterator, typename OutputIterator, typename Predicate>
+OutputIterator copy_if(InputIterator first, InputIterator last, OutputIterator result, Predicate pred, long long& offset)
+{
+    OutputIterator end = thrust::copy_if(first, last, result, pred);
+    offset = dthrust::global_offset(result, end);
+    return end;
+}
+
+
+template <typename KeyVector, typename ValueVector>
+void sort_by_key(KeyVector& keys, ValueVector& values)
+{
+    typedef typename KeyVector::value_type K;
+    typedef typename ValueVector::value_type V;
+
+    int commSize; MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+
+    thrust::sort_by_key(keys.begin(), keys.end(), values.begin());
+    if (commSize == 1) return;
+
+    MPI_Datatype keyType, valueType;
+    MPI_CHECK(MPI_Type_contiguous(sizeof(K), MPI_BYTE, &keyType));  MPI_CHECK(MPI_Type_commit(&keyType));
+    MPI_CHECK(MPI_Type_contiguous(sizeof(V), MPI_BYTE, &valueType));  MPI_CHECK(MPI_Type_commit(&valueType));
+
+    // regular samples of the sorted local keys, the splitters are picked
+    // from all of them by every rank alike, samples and binary searches use
+    // the host copy of the keys needed for sending anyway
+    thrust::host_vector<K> sendKeys = keys;
+    const int n = keys.size();
+    const int numSamples = std::min(n, (int) SORT_SAMPLES_PER_RANK);
+    thrust::host_vector<K> samples(numSamples);
+    for (int i=0; i<numSamples; i++) samples[i] = sendKeys[((long long) (i+1)*n) / (numSamples+1)];
+
+    std::vector<int> sampleCounts(commSize), sampleDispls(commSize, 0);
+    MPI_CHECK(MPI_Allgather((void *) &numSamples, 1, MPI_INT, &sampleCounts[0], 1, MPI_INT, MPI_COMM_WORLD));
+    for (int r=1; r<commSize; r++) sampleDispls[r] = sampleDispls[r-1] + sampleCounts[r-1];
+    const int totalSamples = sampleDispls[commSize-1] + sampleCounts[commSize-1];
+    if (totalSamples == 0) { MPI_CHECK(MPI_Type_free(&keyType));  MPI_CHECK(MPI_Type_free(&valueType));  return; }
+
+    thrust::host_vector<K> allSamples(totalSamples);
+    MPI_CHECK(MPI_Allgatherv(thrust::raw_pointer_cast(&*samples.begin()), numSamples, keyType,
+                             thrust::raw_pointer_cast(&*allSamples.begin()), &sampleCounts[0], &sampleDispls[0], keyType, MPI_COMM_WORLD));
+    thrust::sort(allSamples.begin(), allSamples.end());
+
+    thrust::host_vector<K> splitters(commSize-1);
+    for (int r=0; r<commSize-1; r++) splitters[r] = allSamples[((long long) (r+1)*totalSamples) / commSize];
+
+    // keys up to splitter r go to rank r
+    std::vector<int> sendCounts(commSize), recvCounts(commSize), sendDispls(commSize, 0), recvDispls(commSize, 0);
+    int previousBound = 0;
+    for (int r=0; r<commSize; r++)
+    {
+      int bound = (r < commSize-1) ? std::upper_bound(sendKeys.begin(), sendKeys.end(), splitters[r]) - sendKeys.begin() : n;
+      sendCounts[r] = bound - previousBound;
+      previousBound = bound;
+    }
+    MPI_CHECK(MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &recvCounts[0], 1, MPI_INT, MPI_COMM_WORLD));
+    for (int r=1; r<commSize; r++)
+    {
+      sendDispls[r] = sendDispls[r-1] + sendCounts[r-1];
+      recvDispls[r] = recvDispls[r-1] + recvCounts[r-1];
+    }
+    const int m = recvDispls[commSize-1] + recvCounts[commSize-1];
+
+    thrust::host_vector<K> recvKeys(m);
+    MPI_CHECK(MPI_Alltoallv(thrust::raw_pointer_cast(&*sendKeys.begin()), &sendCounts[0], &sendDispls[0], keyType,
+                            thrust::raw_pointer_cast(&*recvKeys.begin()), &recvCounts[0], &recvDispls[0], keyType, MPI_COMM_WORLD));
+    sendKeys.clear();
+    thrust::host_vector<V> sendValues = values, recvValues(m);
+    MPI_CHECK(MPI_Alltoallv(thrust::raw_pointer_cast(&*sendValues.begin()), &sendCounts[0], &sendDispls[0], valueType,
+                            thrust::raw_pointer_cast(&*recvValues.begin()), &recvCounts[0], &recvDispls[0], valueType, MPI_COMM_WORLD));
+    sendValues.clear();
+
+    MPI_CHECK(MPI_Type_free(&keyType));
+    MPI_CHECK(MPI_Type_free(&valueType));
+
+    // the received runs are sorted already, but a stable sort keeps the
+    // order of equal keys across ranks
+    keys = recvKeys;  values = recvValues;
+    thrust::stable_sort_by_key(keys.begin(), keys.end(), values.begin());
 }
 
 
@@ -0,0 +1,226 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef GRADIENT_FILTER_H_
+#define GRADIENT_FILTER_H_
+
+#include <thrust/for_each.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/iterator/zip_iterator.h>
+
+#include <piston/image3d.h>
+#include <piston/piston_math.h>
+#include <piston/choose_container.h>
+
+namespace piston {
+
+/* Gradient of the point data of a structured dataset with respect to its
+ * physical coordinates. Central differences are used in the interior and
+ * one-sided differences at the borders, or optionally the 3x3x3 Sobel
+ * operator, which smooths across the other two axes.
+ *
+ * The result is stored as three float arrays (x, y and z components) in the
+ * point order of the input, vectors_begin() presents them as float3, e.g.
+ * as the vector source of glyph, and a marching_cube with the filter as its
+ * NormalSource takes them as the normals of the contour, see
+ * marching_cube::set_gradient_normals().
+ *
+ * All points are computed in a single pass, visited brick by brick
+ * (BrickSize^3 points) so that neighboring threads read neighboring
+ * points. The gradient is cached, operator() only recomputes it when the
+ * version of the input changed, see image3d::modified(). */
+template <typename InputDataSet, unsigned BrickSize = 8>
+struct gradient_filter
+{
+    typedef typename InputDataSet::PointDataIterator InputPointDataIterator;
+    typedef typename InputDataSet::PhysicalCoordinatesIterator InputPhysicalCoordinatesIterator;
+    typedef typename InputDataSet::IndexType IndexType;
+
+    typedef typename thrust::iterator_space<InputPointDataIterator>::type space_type;
+    typedef typename thrust::counting_iterator<IndexType, space_type> CountingIterator;
+
+    typedef typename detail::choose_container<InputPointDataIterator, float>::type ComponentContainer;
+    typedef typename ComponentContainer::iterator ComponentIterator;
+
+    struct components2float3 : public thrust::unary_function<thrust::tuple<float, float, float>, float3>
+    {
+	__host__ __device__
+	float3 operator()(const thrust::tuple<float, float, float> &xyz) const {
+	    return make_float3(thrust::get<0>(xyz), thrust::get<1>(xyz), thrust::get<2>(xyz));
+	}
+    };
+
+    typedef thrust::transform_iterator<components2float3,
+            thrust::zip_iterator<thrust::tuple<ComponentIterator, ComponentIterator, ComponentIterator> > > VectorsIterator;
+
+    InputDataSet &input;
+    bool useSobel;
+
+    ComponentContainer gradient_x;
+    ComponentContainer gradient_y;
+    ComponentContainer gradient_z;
+
+    bool computed;
+    bool computedSobel;
+    unsigned int computed_version;
+
+    gradient_filter(InputDataSet &input, bool useSobel = false) :
+	input(input), useSobel(useSobel), computed(false), computedSobel(false), computed_version(0) {}
+
+    void freeMemory() {
+	gradient_x.clear();  gradient_y.clear();  gradient_z.clear();
+	computed = false;
+    }
+
+    void operator()() {
+	if (computed && (computed_version == input.version) && (computedSobel == useSobel))
+	    return;
+
+	gradient_x.resize(input.NPoints);
+	gradient_y.resize(input.NPoints);
+	gradient_z.resize(input.NPoints);
+
+	thrust::for_each(CountingIterator(0), CountingIterator(0)+input.NPoints,
+	                 gradient_functor(input, useSobel,
+	                                  thrust::raw_pointer_cast(&*gradient_x.begin()),
+	                                  thrust::raw_pointer_cast(&*gradient_y.begin()),
+	                                  thrust::raw_pointer_cast(&*gradient_z.begin())));
+
+	computed = true;
+	computedSobel = useSobel;
+	computed_version = input.version;
+    }
+
+    // FixME: change float to value_type
+    // compute the gradient at the n-th point in brick order
+    struct gradient_functor : public thrust::unary_function<IndexType, void>
+    {
+	InputPointDataIterator point_data;
+	InputPhysicalCoordinatesIterator physical_coord;
+	const typename InputDataSet::LayoutType layout;
+	const blocked_layout<BrickSize, IndexType> bricks;
+	int dim[3];
+	const bool useSobel;
+
+	float * const gradient_x;
+	float * const gradient_y;
+	float * const gradient_z;
+
+	gradient_functor(InputDataSet &input, bool useSobel,
+	                 float * const gradient_x, float * const gradient_y, float * const gradient_z) :
+	    point_data(input.point_data_begin()),
+	    physical_coord(input.physical_coordinates_begin()),
+	    layout(input.layout), bricks(input.dim0, input.dim1, input.dim2),
+	    useSobel(useSobel),
+	    gradient_x(gradient_x), gradient_y(gradient_y), gradient_z(gradient_z) {
+	    dim[0] = input.dim0;  dim[1] = input.dim1;  dim[2] = input.dim2;
+	}
+
+	__host__ __device__
+	float value(const int p[3]) const {
+	    return *(point_data + layout.index(p[0], p[1], p[2]));
+	}
+
+	__host__ __device__
+	float coordinate(const int p[3], int axis) const {
+	    const float3 xyz = tuple2float3(*(physical_coord + layout.index(p[0], p[1], p[2])));
+	    return (axis == 0) ? xyz.x : ((axis == 1) ? xyz.y : xyz.z);
+	}
+
+	template <typename Tuple>
+	__host__ __device__
+	static float3 tuple2float3(const Tuple& xyz) {
+	    return make_float3((float) thrust::get<0>(xyz),
+	                       (float) thrust::get<1>(xyz),
+	                       (float) thrust::get<2>(xyz));
+	}
+
+	// derivative along an axis, the neighbors are clamped to the dataset
+	// so the difference becomes one-sided at the borders.
+	__host__ __device__
+	float derivative(const int c[3], int axis) const {
+	    if (dim[axis] < 2)
+		return 0.0f;
+
+	    int lo[3] = { c[0], c[1], c[2] };
+	    int hi[3] = { c[0], c[1], c[2] };
+	    lo[axis] = (c[axis] > 0) ? c[axis] - 1 : c[axis];
+	    hi[axis] = (c[axis] < dim[axis] - 1) ? c[axis] + 1 : c[axis];
+
+	    const float h = coordinate(hi, axis) - coordinate(lo, axis);
+	    if (h == 0.0f)
+		return 0.0f;
+
+	    if (!useSobel)
+		return (value(hi) - value(lo)) / h;
+
+	    // smoothing weights 1 2 1 across the two other axes
+	    const int a = (axis + 1) % 3;
+	    const int b = (axis + 2) % 3;
+	    float sum = 0.0f;
+	    float weights = 0.0f;
+	    for (int db = -1; db <= 1; db++) {
+		for (int da = -1; da <= 1; da++) {
+		    int l[3] = { lo[0], lo[1], lo[2] };
+		    int u[3] = { hi[0], hi[1], hi[2] };
+		    l[a] = u[a] = c[a] + da;
+		    l[b] = u[b] = c[b] + db;
+		    if ((l[a] < 0) || (l[a] >= dim[a]) || (l[b] < 0) || (l[b] >= dim[b]))
+			continue;
+
+		    const float w = (2 - da*da) * (2 - db*db);
+		    sum += w * (value(u) - value(l));
+		    weights += w;
+		}
+	    }
+	    return sum / (weights * h);
+	}
+
+	__host__ __device__
+	void operator()(IndexType n) const {
+	    const thrust::tuple<IndexType, IndexType, IndexType> ijk = bricks.coordinates(n);
+	    const int c[3] = { (int) thrust::get<0>(ijk), (int) thrust::get<1>(ijk), (int) thrust::get<2>(ijk) };
+	    const IndexType point_id = layout.index(c[0], c[1], c[2]);
+
+	    gradient_x[point_id] = derivative(c, 0);
+	    gradient_y[point_id] = derivative(c, 1);
+	    gradient_z[point_id] = derivative(c, 2);
+	}
+    };
+
+    VectorsIterator vectors_begin() {
+	return thrust::make_transform_iterator(thrust::make_zip_iterator(thrust::make_tuple(gradient_x.begin(),
+	                                                                                    gradient_y.begin(),
+	                                                                                    gradient_z.begin())),
+	                                       components2float3());
+    }
+    VectorsIterator vectors_end() {
+	return vectors_begin() + gradient_x.size();
+    }
+};
+
+}
+
+#endif /* GRADIENT_FILTER_H_ */
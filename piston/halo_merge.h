@@ -67,6 +67,54 @@ public:
 
     std::cout << "numOfParticles : " << numOfParticles << " \n";
 
+		buildMergeTree(min_linkLength, max_linkLength);
+	}
+
+	// merge tree of the given particles instead of the particles of a file, velocities are 0 & masses 1
+	halo_merge(float min_linkLength, float max_linkLength, const std::vector<Point>& positions, int np=1, float rL=-1) : halo(0,0)
+	{
+		u01 = thrust::uniform_real_distribution<float>(0.0f, 1.0f);
+
+		this->n    		 = 1;
+
+		// scale amount for particles
+	  if(rL==-1) xscal = 1;
+	  else       xscal = rL / (1.0*np);
+
+		numOfParticles = positions.size();
+
+		thrust::host_vector<Node> nodesHost(numOfParticles);
+		for (int i=0; i<numOfParticles; i++)
+		{
+			Node n = Node();
+			n.nodeId = i;	n.haloId = i;	n.count  = 1;
+			n.pos = positions[i];
+			n.vel = Point(0, 0, 0);
+			n.mass = 1;
+			nodesHost[i] = n;
+
+			if(i==0) { lBoundS = n.pos;  uBoundS = n.pos; }
+			else
+			{
+				lBoundS.x = std::min(lBoundS.x, n.pos.x);	uBoundS.x = std::max(uBoundS.x, n.pos.x);
+				lBoundS.y = std::min(lBoundS.y, n.pos.y);	uBoundS.y = std::max(uBoundS.y, n.pos.y);
+				lBoundS.z = std::min(lBoundS.z, n.pos.z);	uBoundS.z = std::max(uBoundS.z, n.pos.z);
+			}
+		}
+		nodes = nodesHost;
+
+		index.resize(numOfParticles);
+		thrust::copy(CountingIterator(0), CountingIterator(0)+numOfParticles, index.begin());
+
+    haloIndex.resize(numOfParticles);
+    thrust::copy(CountingIterator(0), CountingIterator(0)+numOfParticles, haloIndex.begin());
+
+		buildMergeTree(min_linkLength, max_linkLength);
+	}
+
+	// build the merge tree of the particles for linking lengths between min_linkLength & max_linkLength
+	void buildMergeTree(float min_linkLength, float max_linkLength)
+	{
 		if(numOfParticles!=0)
 		{
 			struct timeval begin, mid1, mid2, mid3, mid4, end, diff1, diff2, diff3;
@@ -32,18 +32,186 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #include <piston/choose_container.h>
 
 #ifdef DISTRIBUTED_PISTON
+#include <vector>
+#include <thrust/transform.h>
 #include <piston/piston_math.h>
+#include <piston/block_decomposition.h>
+#ifdef PISTON_THREAD_MPI
+#include <piston/thread_mpi.h>
+#else
 #include <mpi.h>
 #endif
+#endif
 
 namespace piston
 {
 
+namespace detail {
+
+// signed counterpart of an index type, filters use signed cell and vertex
+// ids so that neighbor offsets can go negative.
+template <typename Index> struct signed_index { typedef Index type; };
+template <> struct signed_index<unsigned int>       { typedef int type; };
+template <> struct signed_index<unsigned long>      { typedef long type; };
+template <> struct signed_index<unsigned long long> { typedef long long type; };
+
+} // namespace detail
+
+/* Layout policies map grid coordinates (i, j, k) to the position of a point
+ * in the point data and back. Their Index type is the type of point ids, the
+ * default 32 bits limit data sets to 2^31 cells, use a 64 bit type such as
+ * unsigned long long for larger ones. The data sets take the layout as a
+ * template parameter, e.g. the util fields, mmap_image3d, compressed_image3d
+ * and time_series_image3d. Filters address the eight vertices of a cell
+ * through cell_vertices(), numbered as in marching_cube:
+ * 	0: (i, j, k)      1: (i+1, j, k)      2: (i+1, j+1, k)      3: (i, j+1, k)
+ * 	4: (i, j, k+1)    5: (i+1, j, k+1)    6: (i+1, j+1, k+1)    7: (i, j+1, k+1)
+ */
+
+// x fastest, then y, then z
+template <typename Index = unsigned>
+struct linear_layout
+{
+    typedef Index IndexType;
+
+    IndexType dim0;
+    IndexType dim1;
+    IndexType dim2;
+    IndexType points_per_layer;
+
+    linear_layout(IndexType dim0, IndexType dim1, IndexType dim2) :
+	dim0(dim0), dim1(dim1), dim2(dim2), points_per_layer(dim0*dim1) {}
+
+    __host__ __device__
+    IndexType index(IndexType i, IndexType j, IndexType k) const {
+	return i + j*dim0 + k*points_per_layer;
+    }
+
+    __host__ __device__
+    thrust::tuple<IndexType, IndexType, IndexType> coordinates(IndexType point_id) const {
+	const IndexType i = point_id % dim0;
+	const IndexType j = (point_id/dim0) % dim1;
+	const IndexType k = point_id/points_per_layer;
+
+	return thrust::make_tuple(i, j, k);
+    }
+
+    template <typename CellIndex>
+    __host__ __device__
+    void cell_vertices(CellIndex i, CellIndex j, CellIndex k, CellIndex vertices[8]) const {
+	vertices[0] = i + j*dim0 + k*points_per_layer;
+	vertices[1] = vertices[0] + 1;
+	vertices[2] = vertices[0] + 1 + dim0;
+	vertices[3] = vertices[0] + dim0;
+
+	vertices[4] = vertices[0] + points_per_layer;
+	vertices[5] = vertices[1] + points_per_layer;
+	vertices[6] = vertices[2] + points_per_layer;
+	vertices[7] = vertices[3] + points_per_layer;
+    }
+};
+
+// the points are stored in bricks of BrickSize^3, bricks are ordered x
+// fastest, then y, then z, as are the points inside of a brick. All eight
+// vertices of most cells are then within a few cache lines. Bricks at the
+// upper borders are only as large as needed, so there is no padding and point
+// ids stay in [0, NPoints).
+template <unsigned BrickSize = 8, typename Index = unsigned>
+struct blocked_layout
+{
+    typedef Index IndexType;
+
+    IndexType dim0;
+    IndexType dim1;
+    IndexType dim2;
+
+    blocked_layout(IndexType dim0, IndexType dim1, IndexType dim2) :
+	dim0(dim0), dim1(dim1), dim2(dim2) {}
+
+    // number of points of a brick along an axis
+    __host__ __device__
+    IndexType extent(IndexType brick, IndexType dim) const {
+	const IndexType rest = dim - brick*BrickSize;
+	return (rest < BrickSize) ? rest : BrickSize;
+    }
+
+    __host__ __device__
+    IndexType index(IndexType i, IndexType j, IndexType k) const {
+	const IndexType bi = i / BrickSize, bj = j / BrickSize, bk = k / BrickSize;
+	const IndexType tx = extent(bi, dim0), ty = extent(bj, dim1), tz = extent(bk, dim2);
+
+	return bk*BrickSize*dim0*dim1 + bj*BrickSize*tz*dim0 + bi*BrickSize*tz*ty +
+	       ((k % BrickSize)*ty + j % BrickSize)*tx + i % BrickSize;
+    }
+
+    __host__ __device__
+    thrust::tuple<IndexType, IndexType, IndexType> coordinates(IndexType point_id) const {
+	const IndexType slab = BrickSize*dim0*dim1;
+	const IndexType bk = point_id / slab;
+	IndexType rest = point_id - bk*slab;
+	const IndexType tz = extent(bk, dim2);
+
+	const IndexType row = BrickSize*tz*dim0;
+	const IndexType bj = rest / row;
+	rest -= bj*row;
+	const IndexType ty = extent(bj, dim1);
+
+	const IndexType brick = BrickSize*tz*ty;
+	const IndexType bi = rest / brick;
+	rest -= bi*brick;
+	const IndexType tx = extent(bi, dim0);
+
+	return thrust::make_tuple(bi*BrickSize + rest % tx,
+	                          bj*BrickSize + (rest / tx) % ty,
+	                          bk*BrickSize + rest / (tx*ty));
+    }
+
+    template <typename CellIndex>
+    __host__ __device__
+    void cell_vertices(CellIndex i, CellIndex j, CellIndex k, CellIndex vertices[8]) const {
+	const IndexType li = i % BrickSize, lj = j % BrickSize, lk = k % BrickSize;
+	const IndexType tx = extent(i / BrickSize, dim0);
+	const IndexType ty = extent(j / BrickSize, dim1);
+	const IndexType tz = extent(k / BrickSize, dim2);
+
+	vertices[0] = index(i, j, k);
+	if ((li + 1 < tx) && (lj + 1 < ty) && (lk + 1 < tz)) {
+	    // the cell is inside of a brick
+	    vertices[1] = vertices[0] + 1;
+	    vertices[2] = vertices[0] + 1 + tx;
+	    vertices[3] = vertices[0] + tx;
+
+	    vertices[4] = vertices[0] + tx*ty;
+	    vertices[5] = vertices[1] + tx*ty;
+	    vertices[6] = vertices[2] + tx*ty;
+	    vertices[7] = vertices[3] + tx*ty;
+	} else {
+	    vertices[1] = index(i+1, j,   k);
+	    vertices[2] = index(i+1, j+1, k);
+	    vertices[3] = index(i,   j+1, k);
+
+	    vertices[4] = index(i,   j,   k+1);
+	    vertices[5] = index(i+1, j,   k+1);
+	    vertices[6] = index(i+1, j+1, k+1);
+	    vertices[7] = index(i,   j+1, k+1);
+	}
+    }
+};
+
+namespace detail {
+
+// the point ids of a linear_layout are the x fastest offsets of the points
+template <typename Layout> struct is_linear_layout { static const bool value = false; };
+template <typename Index> struct is_linear_layout<linear_layout<Index> > { static const bool value = true; };
+
+} // namespace detail
+
 // TODO: inherit from image2d?
-template <typename MemorySpace =  thrust::detail::default_device_space_tag>
+template <typename MemorySpace =  thrust::detail::default_device_space_tag, typename Layout = linear_layout<> >
 struct image3d
 {
-    typedef unsigned IndexType;
+    typedef typename Layout::IndexType IndexType;
+    typedef Layout LayoutType;
 
     IndexType dim0;
     IndexType dim1;
@@ -51,38 +219,31 @@ struct image3d
     IndexType NPoints;
     IndexType NCells;
 
+    // position of the points in the point data
+    Layout layout;
+
+    // incremented whenever the point data changes, filters caching results
+    // derived from the point data (e.g. gradient_filter) compare against it.
+    unsigned int version;
+
     // transform from point_id (n) to grid_coordinates (i, j, k)
     struct grid_coordinates_functor : public thrust::unary_function<IndexType, thrust::tuple<IndexType, IndexType, IndexType> >
     {
-	IndexType dim0;
-	IndexType dim1;
-	IndexType dim2;
-	IndexType PointsPerLayer;
+	Layout layout;
 
 	grid_coordinates_functor(IndexType dim0, IndexType dim1, IndexType dim2) :
-	    dim0(dim0), dim1(dim1), dim2(dim2), PointsPerLayer(dim0*dim1) {}
+	    layout(dim0, dim1, dim2) {}
 
 	__host__ __device__
 	thrust::tuple<IndexType, IndexType, IndexType> operator()(const IndexType& point_id) const {
-	    const IndexType i = point_id % dim0;
-	    const IndexType j = (point_id/dim0) % dim1;
-	    const IndexType k = point_id/PointsPerLayer;
-
-	    return thrust::make_tuple(i, j, k);
+	    return layout.coordinates(point_id);
 	}
     };
 
 #ifdef DISTRIBUTED_PISTON
-    struct tuple2float3 : public thrust::unary_function<thrust::tuple<float, float, float>, float3>
-    {
-	__host__ __device__
-	float3 operator()(thrust::tuple<float, float, float> xyz) const {
-	    return make_float3((float) thrust::get<0>((xyz)),
-	                       (float) thrust::get<1>((xyz)),
-	                       (float) thrust::get<2>((xyz)));
-	}
-    };
-
+    // the block of the volume of this rank, its point data including the
+    // ghost layers and its grid coordinates, see block_decomposition
+    block_decomposition decomposition;
     thrust::device_vector<float> point_data_device;
     thrust::device_vector<float3> grid_coord_device;
     int NCells_local;
@@ -103,67 +264,87 @@ struct image3d
 	dim0(xdim), dim1(ydim), dim2(zdim),
 	NPoints(xdim*ydim*zdim),
 	NCells((xdim-1)*(ydim-1)*(zdim-1)),
+	layout(xdim, ydim, zdim),
+	version(0),
 	grid_coordinates_iterator(CountingIterator(0), grid_coordinates_functor(xdim, ydim, zdim)) {}
 
+    void modified() {
+	version++;
+    }
+
 #ifdef DISTRIBUTED_PISTON
+    // send every rank the block of the point_data_vector of rank 0 it gets
+    // in the block decomposition, with the ghost layers, the grid
+    // coordinates are computed by every rank for its own block. The blocks
+    // are received x fastest, point data in another layout is put in that
+    // order on rank 0 before sending.
     void distributeValues(bool includeGrid=true) {
         int commSize;  (MPI_Comm_size(MPI_COMM_WORLD, &commSize));
         int commRank;  (MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
 
-        int pointsPerLayer = dim0*dim1;
-        int layers = dim2-1;
-        int layersPerRank = layers / commSize;
+        decomposition.decompose(dim0, dim1, dim2);
 
-        thrust::host_vector<float> point_data_local;       
-        thrust::host_vector<thrust::tuple<float, float, float> > grid_coord_tuples;
-        thrust::host_vector<float3> grid_coord_host, grid_coord_local; 
-        
-        int *sendCounts, *displs, *sendCounts3, *displs3;
-        int sendSize = pointsPerLayer*(layersPerRank+1);
+        std::vector<MPI_Request> requests;
+        std::vector<MPI_Datatype> blockTypes;
+        thrust::host_vector<float> point_data_local(decomposition.local_points());
 
-        if (commRank == 0)
-        { 
-          grid_coord_host.resize(NPoints); 
-          grid_coord_tuples.resize(NPoints); 
-          thrust::copy(grid_coordinates_begin(), grid_coordinates_end(), grid_coord_tuples.begin());
-          thrust::transform(grid_coord_tuples.begin(), grid_coord_tuples.end(), grid_coord_host.begin(), tuple2float3());
-
-          sendCounts = new int[commSize];
-          displs = new int[commSize];
-          for (unsigned int i=0; i<commSize; i++)
-          {
-            sendCounts[i] = sendSize;
-            displs[i] = i*pointsPerLayer*layersPerRank;
-          }
+        if (decomposition.local_points() > 0)
+        {
+          requests.push_back(MPI_Request());
+          (MPI_Irecv(thrust::raw_pointer_cast(&*point_data_local.begin()), point_data_local.size(), MPI_FLOAT,
+                     0, 0, MPI_COMM_WORLD, &requests.back()));
+        }
 
-          if (includeGrid)
+        thrust::host_vector<float> linear_data;
+        float *send_data = 0;
+        if ((commRank == 0) && detail::is_linear_layout<Layout>::value)
+          send_data = thrust::raw_pointer_cast(&*point_data_vector.begin());
+        else if (commRank == 0)
+        {
+          thrust::host_vector<float> layout_data(point_data_vector.begin(), point_data_vector.end());
+          linear_data.resize(NPoints);
+          for (IndexType k=0; k<dim2; k++)
+            for (IndexType j=0; j<dim1; j++)
+              for (IndexType i=0; i<dim0; i++)
+                linear_data[i + dim0*(j + dim1*k)] = layout_data[layout.index(i, j, k)];
+          send_data = thrust::raw_pointer_cast(&*linear_data.begin());
+        }
+
+        if (commRank == 0)
+        {
+          int sizes[3] = { (int) dim2, (int) dim1, (int) dim0 };
+          for (int r=0; r<commSize; r++)
           {
-            sendCounts3 = new int[commSize];
-            displs3 = new int[commSize];
-            for (unsigned int i=0; i<commSize; i++)
-            {
-              sendCounts3[i] = 3*sendSize;
-              displs3[i] = 3*i*pointsPerLayer*layersPerRank;
-            }
+            int first[3], points[3];
+            decomposition.block_extent(r, first, points);
+            if (points[0] == 0) continue;
+
+            int subsizes[3] = { points[2], points[1], points[0] };
+            int starts[3] = { first[2], first[1], first[0] };
+            blockTypes.push_back(MPI_Datatype());
+            (MPI_Type_create_subarray(3, sizes, subsizes, starts, MPI_ORDER_C, MPI_FLOAT, &blockTypes.back()));
+            (MPI_Type_commit(&blockTypes.back()));
+
+            requests.push_back(MPI_Request());
+            (MPI_Isend(send_data, 1, blockTypes.back(), r, 0, MPI_COMM_WORLD, &requests.back()));
           }
         }
-       
-        point_data_local.resize(sendSize);
-        (MPI_Scatterv(thrust::raw_pointer_cast(&*point_data_vector.begin()), sendCounts, displs, MPI_FLOAT, 
-                               thrust::raw_pointer_cast(&*point_data_local.begin()), sendSize, MPI_FLOAT, 0, MPI_COMM_WORLD));    
+
+        (MPI_Waitall(requests.size(), requests.empty() ? 0 : &requests[0], MPI_STATUSES_IGNORE));
+        for (unsigned int i=0; i<blockTypes.size(); i++) (MPI_Type_free(&blockTypes[i]));
+
         point_data_device = point_data_local;
 
         if (includeGrid)
         {
-          grid_coord_local.resize(sendSize);
-          (MPI_Scatterv(thrust::raw_pointer_cast(&*grid_coord_host.begin()), sendCounts3, displs3, MPI_FLOAT, 
-                                 thrust::raw_pointer_cast(&*grid_coord_local.begin()), 3*sendSize, MPI_FLOAT, 0, MPI_COMM_WORLD));    
-          grid_coord_device = grid_coord_local;
+          grid_coord_device.resize(decomposition.local_points());
+          thrust::transform(thrust::counting_iterator<int>(0), thrust::counting_iterator<int>(0)+decomposition.local_points(),
+                            grid_coord_device.begin(),
+                            block_decomposition::local_coordinates_functor(decomposition.local_dims, decomposition.begin,
+                                                                           make_float3(0.0f, 0.0f, 0.0f), make_float3(1.0f, 1.0f, 1.0f)));
         }
 
-        NCells_local = (dim0-1)*(dim1-1)*layersPerRank;
-
-        if (commRank == 0) { delete sendCounts; delete displs; if (includeGrid) { delete sendCounts3; delete displs3; } }
+        NCells_local = decomposition.local_cells();
     }
 #endif
 
@@ -193,6 +374,24 @@ struct image3d
 #endif
 };
 
+/* Data sets knowing the value range of blocks of their cells specialize
+ * cell_culling, so filters can classify the cells of a block whose range
+ * misses the values they look for without reading their point data, see
+ * compressed_image3d. By default every cell has to be looked at. */
+template <typename DataSet>
+struct cell_culling
+{
+    cell_culling(const DataSet &) {}
+
+    // false if no vertex of the cell (i, j, k) can have a value in
+    // [min_value, max_value]
+    template <typename CellIndex>
+    __host__ __device__
+    bool operator()(CellIndex, CellIndex, CellIndex, float, float) const {
+	return true;
+    }
+};
+
 } // namepsace piston
 
 #endif /* IMAGE3D_H_ */
@@ -54,23 +54,13 @@ public:
 	const int dim0;
 	const int dim1;
 	const int dim2;
-	const int points_per_layer;
-
-	int i[8];
+	const int cells_per_layer;
+	const typename InputDataSet::LayoutType layout;
 
 	index2index(InputDataSet &input) :
 	    dim0(input.dim0), dim1(input.dim1), dim2(input.dim2),
-	    points_per_layer(dim0*dim1) {
-	    i[0] = 0;
-	    i[1] = 1;
-	    i[2] = 1 + dim0;
-	    i[3] = dim0;
-
-	    i[4] = i[0] + points_per_layer;
-	    i[5] = i[1] + points_per_layer;
-	    i[6] = i[2] + points_per_layer;
-	    i[7] = i[3] + points_per_layer;
-	}
+	    cells_per_layer((dim0 - 1)*(dim1 - 1)),
+	    layout(input.layout) {}
 
 	// TODO: this has to be instantiated for every point in the tetrahedrons.
 	__host__ __device__
@@ -88,7 +78,13 @@ public:
 		0, 5, 4, 6,
 	    };
 	    const int cubeid = pointid/VerticesPerVoxel;
-	    return i[vertices_for_tetra[pointid%VerticesPerVoxel]] + cubeid;
+	    const int x = cubeid % (dim0 - 1);
+	    const int y = (cubeid / (dim0 - 1)) % (dim1 - 1);
+	    const int z = cubeid / cells_per_layer;
+
+	    int i[8];
+	    layout.cell_vertices(x, y, z, i);
+	    return i[vertices_for_tetra[pointid%VerticesPerVoxel]];
 	}
     };
 
@@ -0,0 +1,163 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef IMAGE_COMPOSITOR_H_
+#define IMAGE_COMPOSITOR_H_
+
+#include <thrust/host_vector.h>
+
+#include <piston/piston_math.h>
+
+#include <piston/dthrust.h>
+
+namespace piston {
+
+/* Sort-last compositing of the frames rendered by piston::render on every
+ * rank from its local geometry. The color and depth buffers are combined
+ * with binary-swap: in every round the ranks exchange half of the region
+ * they are responsible for with their partner and keep the closer pixels
+ * (larger depth, as in render) of the other half, so every rank sends
+ * width*height/2 + width*height/4 + ... pixels in total, independent of the
+ * number of triangles. A rank count which is not a power of two is folded
+ * onto the lower ranks first. The complete image is gathered on rank 0 in
+ * frame; the other ranks only keep their composited region. */
+class image_compositor
+{
+public:
+    int width, height, pixelSize;
+    thrust::host_vector<char> frame;
+    thrust::host_vector<float> depth;
+
+    image_compositor(int width, int height, int pixelSize = 4) : width(width), height(height), pixelSize(pixelSize) {}
+
+    // collective, the iterators point to width*height pixels of pixelSize chars and depths
+    template <typename FrameIterator, typename DepthIterator>
+    void operator()(FrameIterator frame_begin, DepthIterator depth_begin)
+    {
+      int commSize;  MPI_CHECK(MPI_Comm_size(MPI_COMM_WORLD, &commSize));
+      int commRank;  MPI_CHECK(MPI_Comm_rank(MPI_COMM_WORLD, &commRank));
+
+      const int numPixels = width*height;
+      frame.assign(frame_begin, frame_begin+numPixels*pixelSize);
+      depth.assign(depth_begin, depth_begin+numPixels);
+
+      int swapRanks = 1;
+      while (2*swapRanks <= commSize) swapRanks *= 2;
+
+      // the ranks beyond the largest power of two hand their whole frame to a partner and sit out the swap
+      if (commRank >= swapRanks)
+      {
+        MPI_CHECK(MPI_Send(&frame[0], numPixels*pixelSize, MPI_CHAR, commRank-swapRanks, 0, MPI_COMM_WORLD));
+        MPI_CHECK(MPI_Send(&depth[0], numPixels, MPI_FLOAT, commRank-swapRanks, 1, MPI_COMM_WORLD));
+      }
+      else if (commRank+swapRanks < commSize)
+      {
+        receiveFrame.resize(numPixels*pixelSize);  receiveDepth.resize(numPixels);
+        MPI_CHECK(MPI_Recv(&receiveFrame[0], numPixels*pixelSize, MPI_CHAR, commRank+swapRanks, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+        MPI_CHECK(MPI_Recv(&receiveDepth[0], numPixels, MPI_FLOAT, commRank+swapRanks, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+        composite(0, numPixels);
+      }
+
+      int first = 0, last = numPixels;
+      if (commRank < swapRanks)
+      {
+        receiveFrame.resize((numPixels/2+1)*pixelSize);  receiveDepth.resize(numPixels/2+1);
+        for (int bit=1; bit<swapRanks; bit*=2)
+        {
+          int partner = commRank ^ bit;
+          int middle = first + (last-first)/2;
+          int keepFirst = first, keepLast = middle, sendFirst = middle, sendLast = last;
+          if (commRank & bit) { keepFirst = middle;  keepLast = last;  sendFirst = first;  sendLast = middle; }
+
+          const int keepPixels = keepLast-keepFirst, sendPixels = sendLast-sendFirst;
+          MPI_CHECK(MPI_Sendrecv(&frame[0] + sendFirst*pixelSize, sendPixels*pixelSize, MPI_CHAR, partner, 2,
+                                 &receiveFrame[0], keepPixels*pixelSize, MPI_CHAR, partner, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+          MPI_CHECK(MPI_Sendrecv(&depth[0] + sendFirst, sendPixels, MPI_FLOAT, partner, 3,
+                                 &receiveDepth[0], keepPixels, MPI_FLOAT, partner, 3, MPI_COMM_WORLD, MPI_STATUS_IGNORE));
+          composite(keepFirst, keepLast);
+          first = keepFirst;  last = keepLast;
+        }
+      }
+      else first = last = 0;
+
+      // every swapping rank owns a distinct part of the image now, collect them on rank 0
+      std::vector<int> counts, displs;
+      if (commRank == 0)
+      {
+        counts.resize(commSize, 0);  displs.resize(commSize, 0);
+        for (int r=0; r<swapRanks; r++)
+        {
+          int regionFirst, regionLast;
+          swap_region(r, swapRanks, numPixels, regionFirst, regionLast);
+          counts[r] = (regionLast-regionFirst)*pixelSize;  displs[r] = regionFirst*pixelSize;
+        }
+        MPI_CHECK(MPI_Gatherv(MPI_IN_PLACE, 0, MPI_CHAR, &frame[0], &counts[0], &displs[0], MPI_CHAR, 0, MPI_COMM_WORLD));
+      }
+      else
+      {
+        MPI_CHECK(MPI_Gatherv(&frame[0] + first*pixelSize, (last-first)*pixelSize, MPI_CHAR, 0, 0, 0, MPI_CHAR, 0, MPI_COMM_WORLD));
+      }
+    }
+
+    template <typename Renderer>
+    void operator()(Renderer &renderer)
+    {
+      (*this)(renderer.frame_begin(), renderer.depth_begin());
+    }
+
+    thrust::host_vector<char>::iterator frame_begin() { return frame.begin(); }
+    thrust::host_vector<char>::iterator frame_end() { return frame.end(); }
+
+private:
+    thrust::host_vector<char> receiveFrame;
+    thrust::host_vector<float> receiveDepth;
+
+    // the pixels [first, last) the received buffers cover are merged into frame and depth
+    void composite(int first, int last)
+    {
+      for (int i=first; i<last; i++)
+      {
+        if (receiveDepth[i-first] > depth[i])
+        {
+          depth[i] = receiveDepth[i-first];
+          for (int c=0; c<pixelSize; c++) frame[i*pixelSize+c] = receiveFrame[(i-first)*pixelSize+c];
+        }
+      }
+    }
+
+    // the region a rank is left with after the binary-swap rounds
+    static void swap_region(int rank, int swapRanks, int numPixels, int &first, int &last)
+    {
+      first = 0;  last = numPixels;
+      for (int bit=1; bit<swapRanks; bit*=2)
+      {
+        int middle = first + (last-first)/2;
+        if (rank & bit) first = middle; else last = middle;
+      }
+    }
+};
+
+} // namespace piston
+
+#endif /* IMAGE_COMPOSITOR_H_ */
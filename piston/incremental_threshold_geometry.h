@@ -0,0 +1,621 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef INCREMENTAL_THRESHOLD_GEOMETRY_H_
+#define INCREMENTAL_THRESHOLD_GEOMETRY_H_
+
+#include <thrust/scan.h>
+#include <thrust/sort.h>
+#include <thrust/unique.h>
+#include <thrust/remove.h>
+#include <thrust/count.h>
+#include <thrust/sequence.h>
+#include <thrust/fill.h>
+#include <thrust/binary_search.h>
+#include <thrust/transform_reduce.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/iterator/permutation_iterator.h>
+
+#include <piston/image3d.h>
+#include <piston/piston_math.h>
+#include <piston/choose_container.h>
+#include <piston/threshold_geometry.h>
+
+namespace piston
+{
+
+/* Threshold filter for interactively changing threshold ranges.
+ *
+ * Generates the same boundary faces as threshold_geometry with
+ * boundaryFacesOnly set, but keeps its state between calls:
+ * 	- the cells are sorted once by the minimum and by the maximum value of
+ * 	  their vertices. When the range changes from [lo0, hi0] to [lo1, hi1],
+ * 	  only cells with their minimum between lo0 and lo1 or their maximum
+ * 	  between hi0 and hi1 can change validity, they are found by binary
+ * 	  search and only their flag words are re-evaluated.
+ * 	- the output is segmented into bricks of consecutive cells. Each brick
+ * 	  owns a slot of quads with some slack, unused quads are degenerate.
+ * 	  Only bricks containing changed cells or their neighbors are
+ * 	  regenerated. When a brick outgrows its slot, all bricks are laid out
+ * 	  again.
+ *
+ * num_total_vertices includes the degenerate quads of unused brick slots,
+ * num_boundary_faces is the number of real quads. */
+template <typename InputDataSet>
+struct incremental_threshold_geometry
+{
+    typedef threshold_geometry<InputDataSet> Threshold;
+
+    typedef typename InputDataSet::PointDataIterator InputPointDataIterator;
+    typedef typename InputDataSet::PhysicalCoordinatesIterator InputGridCoordinatesIterator;
+
+    typedef typename thrust::iterator_space<InputPointDataIterator>::type	space_type;
+    typedef typename thrust::iterator_value<InputPointDataIterator>::type	value_type;
+
+    typedef typename Threshold::IndexType	IndexType;
+
+    typedef typename thrust::counting_iterator<IndexType, space_type>	CountingIterator;
+
+    typedef typename Threshold::FlagWord		FlagWord;
+    typedef typename Threshold::IndicesContainer	IndicesContainer;
+    typedef typename Threshold::ValidFlagsContainer	ValidFlagsContainer;
+    typedef typename Threshold::NormalsContainer	NormalsContainer;
+    typedef typename Threshold::VerticesIterator	VerticesIterator;
+    typedef typename Threshold::NormalsIterator		NormalsIterator;
+    typedef typename Threshold::ScalarsIterator		ScalarsIterator;
+    typedef typename IndicesContainer::iterator		IndicesIterator;
+
+    typedef typename detail::choose_container<InputPointDataIterator, float>::type ValuesContainer;
+
+    static const int BitsPerWord   = Threshold::BitsPerWord;
+    static const int WordsPerBrick = 128;
+
+    InputDataSet &input;
+    float min_value;
+    float max_value;
+
+    bool  initialized;
+    float last_min_value;
+    float last_max_value;
+
+    IndicesContainer	cells_by_min;		// cell ids sorted by the minimum of their vertices
+    IndicesContainer	cells_by_max;		// cell ids sorted by the maximum of their vertices
+    ValidFlagsContainer	valid_cell_flags;	// one bit per cell, see threshold_geometry
+
+    IndicesContainer	word_face_counts;	// number of boundary faces of the cells of each flag word
+    IndicesContainer	brick_face_counts;	// number of boundary faces in each brick
+    IndicesContainer	brick_capacity;		// number of quads reserved for each brick
+    IndicesContainer	brick_offsets;		// first quad of each brick
+
+    IndicesContainer	changed_cells;		// cells that may have changed validity
+    IndicesContainer	dirty_words;		// flag words that have to be re-evaluated
+    IndicesContainer	dirty_brick_flags;	// set for bricks that have to be regenerated
+    IndicesContainer	dirty_bricks;
+    IndicesContainer	brick_words;		// flag words of the bricks being regenerated
+    IndicesContainer	brick_word_offsets;	// first quad of each of these words
+
+    IndicesContainer	vertices_indices;
+    NormalsContainer	normals;
+
+    typename InputDataSet::IndexType num_total_vertices;
+    typename InputDataSet::IndexType num_boundary_faces;
+
+    incremental_threshold_geometry(InputDataSet &input, float min_value, float max_value) :
+	input(input), min_value(min_value), max_value(max_value), initialized(false),
+	num_total_vertices(0), num_boundary_faces(0) {}
+
+    void freeMemory(bool includeInput=true)
+    {
+	if (includeInput) {
+	    cells_by_min.clear();  cells_by_max.clear();
+	    valid_cell_flags.clear();  word_face_counts.clear();
+	    initialized = false;
+	}
+	brick_face_counts.clear();  brick_capacity.clear();  brick_offsets.clear();
+	changed_cells.clear();  dirty_words.clear();  dirty_brick_flags.clear();  dirty_bricks.clear();
+	brick_words.clear();  brick_word_offsets.clear();
+	vertices_indices.clear();  normals.clear();
+    }
+
+    IndexType num_words() const {
+	return (input.NCells + BitsPerWord - 1) / BitsPerWord;
+    }
+    IndexType num_bricks() const {
+	return (num_words() + WordsPerBrick - 1) / WordsPerBrick;
+    }
+
+    void operator()() {
+	if (!initialized) {
+	    presort();
+	    update_all_flags();
+	    layout();
+	    initialized = true;
+	} else if ((min_value != last_min_value) || (max_value != last_max_value)) {
+	    update();
+	}
+
+	last_min_value = min_value;
+	last_max_value = max_value;
+    }
+
+    // sort the cells by the minimum and the maximum of their vertices, this
+    // only has to be done once per dataset.
+    void presort() {
+	const IndexType NCells = input.NCells;
+
+	ValuesContainer keys(NCells);
+
+	cells_by_min.resize(NCells);
+	thrust::sequence(cells_by_min.begin(), cells_by_min.end());
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NCells, keys.begin(),
+	                  cell_extreme(input, false));
+	thrust::sort_by_key(keys.begin(), keys.end(), cells_by_min.begin());
+
+	cells_by_max.resize(NCells);
+	thrust::sequence(cells_by_max.begin(), cells_by_max.end());
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NCells, keys.begin(),
+	                  cell_extreme(input, true));
+	thrust::sort_by_key(keys.begin(), keys.end(), cells_by_max.begin());
+    }
+
+    // re-evaluate the flags of every cell
+    void update_all_flags() {
+	const IndexType NWords = num_words();
+
+	valid_cell_flags.resize(NWords);
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NWords,
+	                  valid_cell_flags.begin(),
+	                  typename Threshold::threshold_cell(input, min_value, max_value));
+
+	word_face_counts.resize(NWords);
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NWords,
+	                  word_face_counts.begin(),
+	                  count_word_faces(input, thrust::raw_pointer_cast(&*valid_cell_flags.begin())));
+    }
+
+    // reserve a slot for each brick and generate all of them
+    void layout() {
+	const IndexType NBricks = num_bricks();
+
+	brick_face_counts.resize(NBricks);
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NBricks,
+	                  brick_face_counts.begin(),
+	                  count_brick_faces(num_words(), thrust::raw_pointer_cast(&*word_face_counts.begin())));
+
+	brick_capacity.resize(NBricks);
+	thrust::transform(brick_face_counts.begin(), brick_face_counts.end(),
+	                  brick_capacity.begin(), brick_slack());
+
+	brick_offsets.resize(NBricks);
+	thrust::exclusive_scan(brick_capacity.begin(), brick_capacity.end(), brick_offsets.begin());
+
+	const IndexType num_quads = brick_offsets.back() + brick_capacity.back();
+	num_total_vertices = num_quads*4;
+	vertices_indices.resize(num_total_vertices);
+	normals.resize(num_total_vertices);
+
+	dirty_bricks.resize(NBricks);
+	thrust::sequence(dirty_bricks.begin(), dirty_bricks.end());
+	generate_bricks();
+    }
+
+    // flip the cells between the old and the new range and regenerate the
+    // bricks around them.
+    void update() {
+	const IndexType NCells = input.NCells;
+
+	// candidates are found by binary search in the presorted cells, the
+	// extremes of the cells are recomputed from the vertices on the fly.
+	const float lo0 = (min_value < last_min_value) ? min_value : last_min_value;
+	const float lo1 = (min_value < last_min_value) ? last_min_value : min_value;
+	const float hi0 = (max_value < last_max_value) ? max_value : last_max_value;
+	const float hi1 = (max_value < last_max_value) ? last_max_value : max_value;
+
+	const IndexType min_first = thrust::lower_bound(cell_min_begin(), cell_min_begin()+NCells, lo0) - cell_min_begin();
+	const IndexType min_last  = thrust::upper_bound(cell_min_begin(), cell_min_begin()+NCells, lo1) - cell_min_begin();
+	const IndexType max_first = thrust::lower_bound(cell_max_begin(), cell_max_begin()+NCells, hi0) - cell_max_begin();
+	const IndexType max_last  = thrust::upper_bound(cell_max_begin(), cell_max_begin()+NCells, hi1) - cell_max_begin();
+
+	const IndexType num_changed = (min_last - min_first) + (max_last - max_first);
+
+	// too many candidates, rebuilding everything is cheaper
+	if (num_changed > NCells/4) {
+	    update_all_flags();
+	    layout();
+	    return;
+	}
+	if (num_changed == 0)
+	    return;
+
+	changed_cells.resize(num_changed);
+	thrust::copy(cells_by_min.begin()+min_first, cells_by_min.begin()+min_last, changed_cells.begin());
+	thrust::copy(cells_by_max.begin()+max_first, cells_by_max.begin()+max_last,
+	             changed_cells.begin()+(min_last - min_first));
+
+	// re-evaluate the flag words of the candidates
+	dirty_words.resize(num_changed);
+	thrust::transform(changed_cells.begin(), changed_cells.end(), dirty_words.begin(), word_of_cell());
+	thrust::sort(dirty_words.begin(), dirty_words.end());
+	dirty_words.erase(thrust::unique(dirty_words.begin(), dirty_words.end()), dirty_words.end());
+	thrust::transform(dirty_words.begin(), dirty_words.end(),
+	                  thrust::make_permutation_iterator(valid_cell_flags.begin(), dirty_words.begin()),
+	                  typename Threshold::threshold_cell(input, min_value, max_value));
+
+	// bricks of the candidates and of their neighbors have to be regenerated
+	const IndexType NBricks = num_bricks();
+	dirty_brick_flags.resize(NBricks);
+	thrust::fill(dirty_brick_flags.begin(), dirty_brick_flags.end(), 0);
+	thrust::for_each(changed_cells.begin(), changed_cells.end(),
+	                 mark_dirty_bricks(input, thrust::raw_pointer_cast(&*dirty_brick_flags.begin())));
+
+	const IndexType num_dirty = thrust::reduce(dirty_brick_flags.begin(), dirty_brick_flags.end());
+	dirty_bricks.resize(num_dirty);
+	thrust::copy_if(CountingIterator(0), CountingIterator(0)+NBricks,
+	                dirty_brick_flags.begin(), dirty_bricks.begin(), is_dirty());
+
+	// recount the faces of the words in the dirty bricks
+	gather_brick_words();
+	thrust::transform(brick_words.begin(), brick_words.end(),
+	                  thrust::make_permutation_iterator(word_face_counts.begin(), brick_words.begin()),
+	                  count_word_faces(input, thrust::raw_pointer_cast(&*valid_cell_flags.begin())));
+
+	thrust::transform(dirty_bricks.begin(), dirty_bricks.end(),
+	                  thrust::make_permutation_iterator(brick_face_counts.begin(), dirty_bricks.begin()),
+	                  count_brick_faces(num_words(), thrust::raw_pointer_cast(&*word_face_counts.begin())));
+
+	// lay out everything again if a brick outgrew its slot
+	const IndexType num_overflows =
+	    thrust::count_if(thrust::make_zip_iterator(thrust::make_tuple(thrust::make_permutation_iterator(brick_face_counts.begin(), dirty_bricks.begin()),
+	                                                                  thrust::make_permutation_iterator(brick_capacity.begin(), dirty_bricks.begin()))),
+	                     thrust::make_zip_iterator(thrust::make_tuple(thrust::make_permutation_iterator(brick_face_counts.begin(), dirty_bricks.end()),
+	                                                                  thrust::make_permutation_iterator(brick_capacity.begin(), dirty_bricks.end()))),
+	                     overflows());
+	if (num_overflows > 0) {
+	    layout();
+	    return;
+	}
+
+	generate_bricks();
+    }
+
+    // list the flag words of the dirty bricks, words past the end of the
+    // data set are listed as -1.
+    void gather_brick_words() {
+	brick_words.resize(dirty_bricks.size()*WordsPerBrick);
+	thrust::transform(CountingIterator(0), CountingIterator(0)+brick_words.size(),
+	                  brick_words.begin(),
+	                  word_of_brick(num_words(), thrust::raw_pointer_cast(&*dirty_bricks.begin())));
+	brick_words.erase(thrust::remove(brick_words.begin(), brick_words.end(), IndexType(-1)), brick_words.end());
+    }
+
+    // regenerate the quads of the dirty bricks in their slots
+    void generate_bricks() {
+	gather_brick_words();
+
+	// enumerate the faces of each word within its brick
+	brick_word_offsets.resize(brick_words.size());
+	thrust::exclusive_scan_by_key(thrust::make_transform_iterator(brick_words.begin(), brick_of_word()),
+	                              thrust::make_transform_iterator(brick_words.end(),   brick_of_word()),
+	                              thrust::make_permutation_iterator(word_face_counts.begin(), brick_words.begin()),
+	                              brick_word_offsets.begin());
+	thrust::transform(brick_word_offsets.begin(), brick_word_offsets.end(),
+	                  thrust::make_permutation_iterator(brick_offsets.begin(),
+	                                                    thrust::make_transform_iterator(brick_words.begin(), brick_of_word())),
+	                  brick_word_offsets.begin(),
+	                  thrust::plus<IndexType>());
+
+	thrust::for_each(thrust::make_zip_iterator(thrust::make_tuple(brick_words.begin(), brick_word_offsets.begin())),
+	                 thrust::make_zip_iterator(thrust::make_tuple(brick_words.end(),   brick_word_offsets.end())),
+	                 generate_word_quads(input, thrust::raw_pointer_cast(&*valid_cell_flags.begin()),
+	                                     thrust::raw_pointer_cast(&*vertices_indices.begin()),
+	                                     thrust::raw_pointer_cast(&*normals.begin())));
+
+	// fill the unused part of the slots with degenerate quads
+	thrust::for_each(dirty_bricks.begin(), dirty_bricks.end(),
+	                 clear_brick_slack(thrust::raw_pointer_cast(&*brick_face_counts.begin()),
+	                                   thrust::raw_pointer_cast(&*brick_capacity.begin()),
+	                                   thrust::raw_pointer_cast(&*brick_offsets.begin()),
+	                                   thrust::raw_pointer_cast(&*vertices_indices.begin()),
+	                                   thrust::raw_pointer_cast(&*normals.begin())));
+
+	num_boundary_faces = thrust::reduce(brick_face_counts.begin(), brick_face_counts.end());
+    }
+
+    // FixME: change float to value_type
+    // return the minimum or the maximum value of the vertices of a cell
+    struct cell_extreme : public thrust::unary_function<IndexType, float>
+    {
+	// FixME: constant iterator and/or iterator to const problem.
+	InputPointDataIterator point_data;
+	const bool use_max;
+	const typename InputDataSet::LayoutType layout;
+
+	const IndexType xdim;
+	const IndexType ydim;
+	const IndexType cells_per_layer;
+
+	cell_extreme(InputDataSet &input, bool use_max) :
+	    point_data(input.point_data_begin()), use_max(use_max),
+	    layout(input.layout),
+	    xdim(input.dim0), ydim(input.dim1),
+	    cells_per_layer((xdim - 1) * (ydim - 1)) {}
+
+	__host__ __device__
+	float operator() (IndexType cell_id) const {
+	    const IndexType x = cell_id % (xdim - 1);
+	    const IndexType y = (cell_id / (xdim - 1)) % (ydim -1);
+	    const IndexType z = cell_id / cells_per_layer;
+
+	    IndexType i[8];
+	    layout.cell_vertices(x, y, z, i);
+
+	    float result = *(point_data + i[0]);
+	    for (int v = 1; v < 8; v++) {
+		const float f = *(point_data + i[v]);
+		result = use_max ? ((f > result) ? f : result) : ((f < result) ? f : result);
+	    }
+	    return result;
+	}
+    };
+
+    typedef thrust::transform_iterator<cell_extreme, IndicesIterator> CellExtremeIterator;
+
+    CellExtremeIterator cell_min_begin() {
+	return thrust::make_transform_iterator(cells_by_min.begin(), cell_extreme(input, false));
+    }
+    CellExtremeIterator cell_max_begin() {
+	return thrust::make_transform_iterator(cells_by_max.begin(), cell_extreme(input, true));
+    }
+
+    // return the number of boundary faces of the 32 cells of a flag word
+    struct count_word_faces : public thrust::unary_function<IndexType, IndexType>
+    {
+	typename Threshold::valid_cell_neighbors neighbors_of;
+
+	count_word_faces(InputDataSet &input, const FlagWord *valid_cell_flags) :
+	    neighbors_of(input, valid_cell_flags) {}
+
+	__host__ __device__
+	IndexType operator() (IndexType word_id) const {
+	    const FlagWord valid = neighbors_of.valid_cell_flags[word_id];
+	    if (valid == 0)
+		return 0;
+
+	    FlagWord neighbors[6];
+	    neighbors_of(word_id, neighbors);
+
+	    IndexType faces = 0;
+	    for (int f = 0; f < 6; f++)
+		faces += popcount(valid & ~neighbors[f]);
+	    return faces;
+	}
+    };
+
+    // generate the boundary face quads of the cells of a flag word
+    struct generate_word_quads : public thrust::unary_function<thrust::tuple<IndexType, IndexType>, void>
+    {
+	typename Threshold::valid_cell_neighbors neighbors_of;
+	typename Threshold::generate_quads generate;
+
+	generate_word_quads(InputDataSet &input, const FlagWord *valid_cell_flags,
+	                    IndexType * const vertices_indices, float3 * const normals) :
+	    neighbors_of(input, valid_cell_flags),
+	    generate(input, vertices_indices, normals) {}
+
+	__host__ __device__
+	void operator() (const thrust::tuple<IndexType, IndexType>& word_tuple) const {
+	    const IndexType word_id = thrust::get<0>(word_tuple);
+	    IndexType face = thrust::get<1>(word_tuple);
+
+	    const FlagWord valid = neighbors_of.valid_cell_flags[word_id];
+	    if (valid == 0)
+		return;
+
+	    FlagWord neighbors[6];
+	    neighbors_of(word_id, neighbors);
+
+	    FlagWord exterior = valid & ~(neighbors[0] & neighbors[1] & neighbors[2] &
+	                                  neighbors[3] & neighbors[4] & neighbors[5]);
+	    while (exterior) {
+		const int bit = lowest_bit(exterior);
+		int face_mask = 0;
+		for (int f = 0; f < 6; f++)
+		    face_mask |= ((~neighbors[f] >> bit) & 1) << f;
+
+		generate(thrust::make_tuple(word_id * BitsPerWord + bit, face, face_mask));
+		face += popcount(face_mask);
+		exterior &= exterior - 1;
+	    }
+	}
+    };
+
+    // return the number of boundary faces in a brick
+    struct count_brick_faces : public thrust::unary_function<IndexType, IndexType>
+    {
+	const IndexType nwords;
+	const IndexType *word_face_counts;
+
+	count_brick_faces(IndexType nwords, const IndexType *word_face_counts) :
+	    nwords(nwords), word_face_counts(word_face_counts) {}
+
+	__host__ __device__
+	IndexType operator() (IndexType brick_id) const {
+	    const IndexType first = brick_id * WordsPerBrick;
+	    const IndexType last  = (first + WordsPerBrick < nwords) ? first + WordsPerBrick : nwords;
+
+	    IndexType faces = 0;
+	    for (IndexType w = first; w < last; w++)
+		faces += word_face_counts[w];
+	    return faces;
+	}
+    };
+
+    // reserve some room for the brick to grow in before a new layout is needed
+    struct brick_slack : public thrust::unary_function<IndexType, IndexType>
+    {
+	__host__ __device__
+	IndexType operator() (IndexType faces) const {
+	    return faces + faces/4 + 16;
+	}
+    };
+
+    struct word_of_cell : public thrust::unary_function<IndexType, IndexType>
+    {
+	__host__ __device__
+	IndexType operator() (IndexType cell_id) const {
+	    return cell_id / BitsPerWord;
+	}
+    };
+
+    struct brick_of_word : public thrust::unary_function<IndexType, IndexType>
+    {
+	__host__ __device__
+	IndexType operator() (IndexType word_id) const {
+	    return word_id / WordsPerBrick;
+	}
+    };
+
+    // the i-th word of the dirty bricks, -1 past the end of the dataset
+    struct word_of_brick : public thrust::unary_function<IndexType, IndexType>
+    {
+	const IndexType nwords;
+	const IndexType *bricks;
+
+	word_of_brick(IndexType nwords, const IndexType *bricks) :
+	    nwords(nwords), bricks(bricks) {}
+
+	__host__ __device__
+	IndexType operator() (IndexType i) const {
+	    const IndexType word_id = bricks[i / WordsPerBrick] * WordsPerBrick + i % WordsPerBrick;
+	    return (word_id < nwords) ? word_id : -1;
+	}
+    };
+
+    // mark the bricks of a cell and of its six neighbors, all threads write
+    // the same value so concurrent writes are harmless.
+    struct mark_dirty_bricks : public thrust::unary_function<IndexType, void>
+    {
+	const IndexType ncells;
+	const IndexType row;
+	const IndexType cells_per_layer;
+	IndexType * const dirty_brick_flags;
+
+	mark_dirty_bricks(InputDataSet &input, IndexType * const dirty_brick_flags) :
+	    ncells(input.NCells), row(input.dim0 - 1),
+	    cells_per_layer((input.dim0 - 1) * (input.dim1 - 1)),
+	    dirty_brick_flags(dirty_brick_flags) {}
+
+	__host__ __device__
+	void mark(IndexType cell_id) const {
+	    if ((cell_id >= 0) && (cell_id < ncells))
+		dirty_brick_flags[cell_id / (BitsPerWord * WordsPerBrick)] = 1;
+	}
+
+	__host__ __device__
+	void operator() (IndexType cell_id) const {
+	    mark(cell_id);
+	    mark(cell_id - 1);
+	    mark(cell_id + 1);
+	    mark(cell_id - row);
+	    mark(cell_id + row);
+	    mark(cell_id - cells_per_layer);
+	    mark(cell_id + cells_per_layer);
+	}
+    };
+
+    struct is_dirty : public thrust::unary_function<IndexType, bool>
+    {
+	__host__ __device__
+	bool operator() (IndexType flag) const {
+	    return flag != 0;
+	}
+    };
+
+    struct overflows : public thrust::unary_function<thrust::tuple<IndexType, IndexType>, bool>
+    {
+	__host__ __device__
+	bool operator() (const thrust::tuple<IndexType, IndexType>& counts) const {
+	    return thrust::get<0>(counts) > thrust::get<1>(counts);
+	}
+    };
+
+    // collapse the unused quads of a brick slot to its first vertex
+    struct clear_brick_slack : public thrust::unary_function<IndexType, void>
+    {
+	const IndexType *brick_face_counts;
+	const IndexType *brick_capacity;
+	const IndexType *brick_offsets;
+	IndexType * const vertices_indices;
+	float3 * const normals;
+
+	clear_brick_slack(const IndexType *brick_face_counts, const IndexType *brick_capacity, const IndexType *brick_offsets,
+	                  IndexType * const vertices_indices, float3 * const normals) :
+	    brick_face_counts(brick_face_counts), brick_capacity(brick_capacity), brick_offsets(brick_offsets),
+	    vertices_indices(vertices_indices), normals(normals) {}
+
+	__host__ __device__
+	void operator() (IndexType brick_id) const {
+	    const IndexType first = (brick_offsets[brick_id] + brick_face_counts[brick_id])*4;
+	    const IndexType last  = (brick_offsets[brick_id] + brick_capacity[brick_id])*4;
+	    for (IndexType v = first; v < last; v++) {
+		vertices_indices[v] = 0;
+		normals[v] = make_float3(0.0f, 0.0f, 1.0f);
+	    }
+	}
+    };
+
+    // FixME: better name!!!
+    VerticesIterator vertices_begin() {
+	return thrust::make_permutation_iterator(thrust::make_transform_iterator(input.physical_coordinates_begin(),
+	                                                                         tuple2float4()),
+	                                         vertices_indices.begin());
+    }
+    VerticesIterator vertices_end() {
+	return vertices_begin() + vertices_indices.size();
+    }
+
+    NormalsIterator normals_begin() {
+	return normals.begin();
+    }
+    NormalsIterator normals_end() {
+	return normals.end();
+    }
+
+    ScalarsIterator scalars_begin() {
+	return thrust::make_permutation_iterator(input.point_data_begin(), vertices_indices.begin());
+    }
+    ScalarsIterator scalars_end() {
+	return scalars_begin() + vertices_indices.size();
+    }
+
+    // Set threshold rangle, the next operator() only updates what changed
+    void set_threshold_range(float minVal, float maxVal) {
+	min_value = minVal; max_value = maxVal;
+    }
+};
+
+}
+
+#endif /* INCREMENTAL_THRESHOLD_GEOMETRY_H_ */
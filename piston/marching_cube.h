@@ -32,6 +32,8 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #include <thrust/iterator/constant_iterator.h>
 #include <thrust/iterator/zip_iterator.h>
 
+#include <iostream>
+
 #include <piston/image3d.h>
 #include <piston/piston_math.h>
 #include <piston/choose_container.h>
@@ -41,7 +43,11 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 
 namespace piston {
 
-template <typename InputDataSet1, typename InputDataSet2>
+// the default normals of marching_cube, the cross products of the triangle
+// edges, the other normal source is a gradient_filter over the input
+struct triangle_normals {};
+
+template <typename InputDataSet1, typename InputDataSet2, typename NormalSource = triangle_normals>
 class marching_cube
 {
 public:
@@ -54,10 +60,15 @@ public:
     typedef typename thrust::iterator_space<InputPointDataIterator>::type	space_type;
     typedef typename thrust::iterator_value<InputPointDataIterator>::type	value_type;
 
-    typedef typename thrust::counting_iterator<int, space_type>	CountingIterator;
+    // cell ids and vertex enumerations are signed versions of the index
+    // type of the data set, 64 bit data sets get 64 bit ids.
+    typedef typename detail::signed_index<typename InputDataSet1::IndexType>::type IndexType;
+
+    typedef typename thrust::counting_iterator<IndexType, space_type>	CountingIterator;
 
     typedef typename detail::choose_container<InputPointDataIterator, int>::type  TableContainer;
-    typedef typename detail::choose_container<InputPointDataIterator, int>::type  IndicesContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, int>::type  CasesContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, IndexType>::type  IndicesContainer;
 
     typedef typename detail::choose_container<InputPointDataIterator, float4>::type 	VerticesContainer;
     typedef typename detail::choose_container<InputPointDataIterator, float3>::type	NormalsContainer;
@@ -82,8 +93,8 @@ public:
     TableContainer	triTable;	// a copy of triangle edge indices table in host|device_vector
     TableContainer	numVertsTable;	// a copy of number of vertices per cell table in host|device_vector
 
-    IndicesContainer	case_index;	// classification of cells as indices into triTable and numVertsTable
-    IndicesContainer	num_vertices;	// number of vertices will be generated by the cell
+    CasesContainer	case_index;	// classification of cells as indices into triTable and numVertsTable
+    CasesContainer	num_vertices;	// number of vertices will be generated by the cell
 
     IndicesContainer 	valid_cell_enum;	// enumeration of valid cells
     IndicesContainer	valid_cell_indices;	// a sequence of indices to valid cells
@@ -105,7 +116,15 @@ public:
     NormalsContainer	normals;	// surface normal computed by cross product of triangle edges
     ScalarContainer	scalars;	// interpolated scalar output
 
-    unsigned int num_total_vertices;
+    typename InputDataSet1::IndexType num_total_vertices;
+
+    // optional per point gradients of input used as normals instead of the
+    // cross products of the triangle edges, see set_gradient_normals. The
+    // filter is brought up to date by every run, which refreshes the pointers.
+    const float *gradient_x;
+    const float *gradient_y;
+    const float *gradient_z;
+    NormalSource *gradient;
 
     marching_cube(InputDataSet1 &input, InputDataSet2 &source,
                   value_type isovalue = value_type()) :
@@ -116,6 +135,7 @@ public:
 #ifdef USE_INTEROP
     , colorFlip(false), vboSize(0)
 #endif
+    , gradient_x(0), gradient_y(0), gradient_z(0), gradient(0)
 	{}
 
     void freeMemory(bool includeInput=true)
@@ -134,7 +154,7 @@ public:
 
     void operator()()
     {
-	const int NCells = input.NCells;
+	const IndexType NCells = input.NCells;
 
 	case_index.resize(NCells);
 	num_vertices.resize(NCells);
@@ -151,9 +171,9 @@ public:
 	thrust::transform_inclusive_scan(num_vertices.begin(), num_vertices.end(),
 	                                 valid_cell_enum.begin(),
 	                                 is_valid_cell(),
-	                                 thrust::plus<int>());
+	                                 thrust::plus<IndexType>());
 	// the total number of valid cells is the last element of the enumeration.
-	unsigned int num_valid_cells = valid_cell_enum.back();
+	IndexType num_valid_cells = valid_cell_enum.back();
 
 	// no valid cells at all, return with empty vectors.
 	if (num_valid_cells == 0) {
@@ -175,7 +195,8 @@ public:
 	output_vertices_enum.resize(num_valid_cells);
 	thrust::exclusive_scan(thrust::make_permutation_iterator(num_vertices.begin(), valid_cell_indices.begin()),
 	                       thrust::make_permutation_iterator(num_vertices.begin(), valid_cell_indices.begin()) + num_valid_cells,
-	                       output_vertices_enum.begin());
+	                       output_vertices_enum.begin(),
+	                       IndexType(0), thrust::plus<IndexType>());
 
 	// get the total number of vertices,
 	num_total_vertices = num_vertices[valid_cell_indices.back()] + output_vertices_enum.back();
@@ -217,6 +238,10 @@ public:
 	}
 	scalars.resize(num_total_vertices);
 
+	// the gradients may be stale or freed since the last run
+	if (gradient)
+	    update_gradient(gradient);
+
 	// do edge interpolation for each valid cell
 	if (useInterop) {
 #if USE_INTEROP
@@ -230,7 +255,8 @@ public:
 	                                        triTable.begin(),
 	                                        vertexBufferData,
 	                                        normalBufferData,
-	                                        thrust::raw_pointer_cast(&*scalars.begin())));
+	                                        thrust::raw_pointer_cast(&*scalars.begin()),
+	                                        gradient_x, gradient_y, gradient_z));
 	    if (vboResources[1])
 		thrust::transform(scalars.begin(), scalars.end(),
 		                  thrust::device_ptr<float4>(colorBufferData),
@@ -249,23 +275,25 @@ public:
 	                                        triTable.begin(),
 	                                        thrust::raw_pointer_cast(&*vertices.begin()),
 	                                        thrust::raw_pointer_cast(&*normals.begin()),
-	                                        thrust::raw_pointer_cast(&*scalars.begin())));
+	                                        thrust::raw_pointer_cast(&*scalars.begin()),
+	                                        gradient_x, gradient_y, gradient_z));
 	}
     }
 
-    struct classify_cell : public thrust::unary_function<int, thrust::tuple<int, int> >
+    struct classify_cell : public thrust::unary_function<IndexType, thrust::tuple<int, int> >
     {
 	// FixME: constant iterator and/or iterator to const problem.
 	InputPointDataIterator	point_data;
 	const float		isovalue;
 	const bool 		discardMinVals;
 	TableIterator		numVertsTable;
+	const typename InputDataSet1::LayoutType layout;
+	const cell_culling<InputDataSet1> culling;
 
 	const int xdim;
 	const int ydim;
 	const int zdim;
 	const int cells_per_layer;
-	const int points_per_layer;
 
 	classify_cell(InputDataSet1 &input,
 	              float isovalue, bool discardMinVals,
@@ -274,41 +302,39 @@ public:
 	        	  isovalue(isovalue),
 	        	  discardMinVals(discardMinVals),
 	        	  numVertsTable(numVertsTable),
+	        	  layout(input.layout),
+	        	  culling(input),
 	        	  xdim(input.dim0), ydim(input.dim1), zdim(input.dim2),
-	        	  cells_per_layer((xdim - 1) * (ydim - 1)),
-	        	  points_per_layer (xdim*ydim) {}
+	        	  cells_per_layer((xdim - 1) * (ydim - 1)) {}
 
 	__host__ __device__
-	thrust::tuple<int, int> operator() (int cell_id) const {
+	thrust::tuple<int, int> operator() (IndexType cell_id) const {
 	    // FIXME: this integer division/modulus is repeated at every
 	    // instance of the input iterator when the scalars are computed
 	    // on the fly.
-	    const int x = cell_id % (xdim - 1);
-	    const int y = (cell_id / (xdim - 1)) % (ydim -1);
-	    const int z = cell_id / cells_per_layer;
+	    const IndexType x = cell_id % (xdim - 1);
+	    const IndexType y = (cell_id / (xdim - 1)) % (ydim -1);
+	    const IndexType z = cell_id / cells_per_layer;
 
-	    // indices to the eight vertices of the voxel
-	    const int i0 = x    + y*xdim + z * points_per_layer;
-	    const int i1 = i0   + 1;
-	    const int i2 = i0   + 1	+ xdim;
-	    const int i3 = i0   + xdim;
+	    // cells known not to contain the isovalue generate nothing
+	    if (!culling(x, y, z, isovalue, isovalue))
+		return thrust::make_tuple(0, 0);
 
-	    const int i4 = i0   + points_per_layer;
-	    const int i5 = i1   + points_per_layer;
-	    const int i6 = i2   + points_per_layer;
-	    const int i7 = i3   + points_per_layer;
+	    // indices to the eight vertices of the voxel
+	    IndexType i[8];
+	    layout.cell_vertices(x, y, z, i);
 
 	    // FIXME: there is too much redundant computation to get
 	    // triple (col, row, layer) in the input iterator when data
 	    // is calculated on the fly
-	    const float f0 = *(point_data + i0);
-	    const float f1 = *(point_data + i1);
-	    const float f2 = *(point_data + i2);
-	    const float f3 = *(point_data + i3);
-	    const float f4 = *(point_data + i4);
-	    const float f5 = *(point_data + i5);
-	    const float f6 = *(point_data + i6);
-	    const float f7 = *(point_data + i7);
+	    const float f0 = *(point_data + i[0]);
+	    const float f1 = *(point_data + i[1]);
+	    const float f2 = *(point_data + i[2]);
+	    const float f3 = *(point_data + i[3]);
+	    const float f4 = *(point_data + i[4]);
+	    const float f5 = *(point_data + i[5]);
+	    const float f6 = *(point_data + i[6]);
+	    const float f7 = *(point_data + i[7]);
 
 	    unsigned int cubeindex = (f0 > isovalue);
 	    cubeindex += (f1 > isovalue)*2;
@@ -334,7 +360,7 @@ public:
 	}
     };
 
-    struct isosurface_functor : public thrust::unary_function<thrust::tuple<int, int, int, int>, void>
+    struct isosurface_functor : public thrust::unary_function<thrust::tuple<IndexType, IndexType, int, int>, void>
     {
 	// FixME: constant iterator and/or iterator to const problem.
 	InputPointDataIterator	point_data;
@@ -348,6 +374,11 @@ public:
 	float4 *vertices_output;
 	float3 *normals_output;
 	float  *scalars_output;
+	const float *gradient_x;
+	const float *gradient_y;
+	const float *gradient_z;
+
+	const typename InputDataSet1::LayoutType layout;
 
 	const int xdim;
 	const int ydim;
@@ -361,13 +392,18 @@ public:
 	                   TableIterator triangle_table,
 	                   float4 *vertices,
 	                   float3 *normals,
-	                   float  *scalars)
+	                   float  *scalars,
+	                   const float *gradient_x = 0,
+	                   const float *gradient_y = 0,
+	                   const float *gradient_z = 0)
 	    : point_data(input.point_data_begin()),
 	      physical_coord(input.physical_coordinates_begin()),
 	      scalar_source(source.point_data_begin()),
 	      isovalue(isovalue),
 	      triangle_table(triangle_table),
 	      vertices_output(vertices), normals_output(normals), scalars_output(scalars),
+	      gradient_x(gradient_x), gradient_y(gradient_y), gradient_z(gradient_z),
+	      layout(input.layout),
 	      xdim(input.dim0), ydim(input.dim1), zdim(input.dim2),
 	      cells_per_layer((xdim - 1) * (ydim - 1)) {}
 
@@ -391,9 +427,9 @@ public:
 
 
 	__host__ __device__
-	void operator()(thrust::tuple<int, int, int, int> indices_tuple) {
-	    const int cell_id  = thrust::get<0>(indices_tuple);
-	    const int outputVertId = thrust::get<1>(indices_tuple);
+	void operator()(thrust::tuple<IndexType, IndexType, int, int> indices_tuple) {
+	    const IndexType cell_id      = thrust::get<0>(indices_tuple);
+	    const IndexType outputVertId = thrust::get<1>(indices_tuple);
 	    const int cubeindex    = thrust::get<2>(indices_tuple);
 	    const int numVertices  = thrust::get<3>(indices_tuple);
 
@@ -401,21 +437,13 @@ public:
 	                                    4, 5, 5, 6, 7, 6, 4, 7,
 	                                    0, 4, 1, 5, 2, 6, 3, 7 };
 
-	    const int x = cell_id % (xdim - 1);
-	    const int y = (cell_id / (xdim - 1)) % (ydim -1);
-	    const int z = cell_id / cells_per_layer;
+	    const IndexType x = cell_id % (xdim - 1);
+	    const IndexType y = (cell_id / (xdim - 1)) % (ydim -1);
+	    const IndexType z = cell_id / cells_per_layer;
 
 	    // indices to the eight vertices of the voxel
-	    int i[8];
-	    i[0] = x      + y*xdim + z * xdim * ydim;
-	    i[1] = i[0]   + 1;
-	    i[2] = i[0]   + 1	+ xdim;
-	    i[3] = i[0]   + xdim;
-
-	    i[4] = i[0]   + xdim * ydim;
-	    i[5] = i[1]   + xdim * ydim;
-	    i[6] = i[2]   + xdim * ydim;
-	    i[7] = i[3]   + xdim * ydim;
+	    IndexType i[8];
+	    layout.cell_vertices(x, y, z, i);
 
 	    float f[8];
 	    f[0] = *(point_data + i[0]);
@@ -458,6 +486,21 @@ public:
 		*(scalars_output  + outputVertId + v) = scalar_interp(s[v0], s[v1], t);
 	    }
 
+	    // interpolate the gradients at the vertices if there are any, they
+	    // point towards higher values as the cross products do.
+	    if (gradient_x) {
+		for (int v = 0; v < numVertices; v++) {
+		    const int edge = triangle_table[cubeindex*16 + v];
+		    const int v0   = verticesForEdge[2*edge];
+		    const int v1   = verticesForEdge[2*edge + 1];
+		    const float t  = (isovalue - f[v0]) / (f[v1] - f[v0]);
+		    const float3 g0 = make_float3(gradient_x[i[v0]], gradient_y[i[v0]], gradient_z[i[v0]]);
+		    const float3 g1 = make_float3(gradient_x[i[v1]], gradient_y[i[v1]], gradient_z[i[v1]]);
+		    *(normals_output + outputVertId + v) = normalize(lerp(g0, g1, t));
+		}
+		return;
+	    }
+
 	    // generate normal vectors by cross product of triangle edges
 	    for (int v = 0; v < numVertices; v += 3) {
 		const float4 *vertex = (vertices_output + outputVertId + v);
@@ -495,10 +538,35 @@ public:
     void set_isovalue(value_type val) {
 	isovalue = val;
     }
+
+    // use the gradients computed by the gradient_filter given as the
+    // NormalSource of the contour as the normals, e.g.
+    // marching_cube<Field, Field, gradient_filter<Field> >. The filter has to
+    // be over the input of the contour and outlive it, it only recomputes
+    // when the input changed, see image3d::modified().
+    bool set_gradient_normals(NormalSource &filter) {
+	if (&filter.input != &input) {
+	    std::cout << "gradient_filter is not over the input of the contour" << std::endl;
+	    return false;
+	}
+	gradient = &filter;
+	update_gradient(gradient);
+	return true;
+    }
+
+    void update_gradient(triangle_normals *) {}
+
+    template <typename GradientFilter>
+    void update_gradient(GradientFilter *filter) {
+	(*filter)();
+	gradient_x = thrust::raw_pointer_cast(&*filter->gradient_x.begin());
+	gradient_y = thrust::raw_pointer_cast(&*filter->gradient_y.begin());
+	gradient_z = thrust::raw_pointer_cast(&*filter->gradient_z.begin());
+    }
 };
 
-template <typename InputDataSet1, typename InputDataSet2>
-const int marching_cube<InputDataSet1, InputDataSet2>::triTable_array[256][16] =
+template <typename InputDataSet1, typename InputDataSet2, typename NormalSource>
+const int marching_cube<InputDataSet1, InputDataSet2, NormalSource>::triTable_array[256][16] =
 {
 #define X -1
      {X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X},
@@ -760,8 +828,8 @@ const int marching_cube<InputDataSet1, InputDataSet2>::triTable_array[256][16] =
 #undef X
 };
 
-template <typename InputDataSet1, typename InputDataSet2>
-const int marching_cube<InputDataSet1, InputDataSet2>::numVerticesTable_array[256] = {
+template <typename InputDataSet1, typename InputDataSet2, typename NormalSource>
+const int marching_cube<InputDataSet1, InputDataSet2, NormalSource>::numVerticesTable_array[256] = {
     0,
     3,
     3,
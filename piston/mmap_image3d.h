@@ -0,0 +1,424 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MMAP_IMAGE3D_H_
+#define MMAP_IMAGE3D_H_
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <thrust/iterator/permutation_iterator.h>
+#include <piston/image3d.h>
+#include <piston/quantized_data.h>
+
+namespace piston {
+
+/* On disk layout of a volume for mmap_image3d, the header is followed by the
+ * point data at data_offset (the writer aligns it to a page). Integer data is
+ * decoded as offset + scale * value, see quantized_data.h.
+ *
+ * With brick_size == 0 the point data is stored x fastest, then y, then z.
+ * Otherwise it is split into bricks of brick_size^3 points, the bricks are
+ * stored x fastest, then y, then z, as are the points inside of each brick.
+ * Bricks at the upper borders are padded to the full brick size.
+ *
+ * The header is 72 bytes, version 2. Version 1 files have the 64 bytes up to
+ * data_offset only and always hold float data, they are still read. */
+struct mmap_image3d_header
+{
+    enum { Float32 = 0, Uint8 = 1, Uint16 = 2, Float16 = 3, Int8 = 4, Int16 = 5 };
+
+    char magic[8];
+    unsigned int version;
+    unsigned int type;
+    unsigned int dims[3];
+    unsigned int brick_size;
+    float origin[3];
+    float spacing[3];
+    unsigned long long data_offset;
+    float scale;
+    float offset;
+};
+
+static const char mmap_image3d_magic[8] = "PSTNVOL";
+static const unsigned int mmap_image3d_version = 2;
+
+namespace detail {
+
+// type field of the header for each storage type
+template <typename StorageType> struct mmap_storage_type;
+template <> struct mmap_storage_type<float>          { static const unsigned int value = mmap_image3d_header::Float32; };
+template <> struct mmap_storage_type<unsigned char>  { static const unsigned int value = mmap_image3d_header::Uint8; };
+template <> struct mmap_storage_type<unsigned short> { static const unsigned int value = mmap_image3d_header::Uint16; };
+template <> struct mmap_storage_type<half>           { static const unsigned int value = mmap_image3d_header::Float16; };
+template <> struct mmap_storage_type<signed char>    { static const unsigned int value = mmap_image3d_header::Int8; };
+template <> struct mmap_storage_type<short>          { static const unsigned int value = mmap_image3d_header::Int16; };
+
+inline size_t mmap_type_size(unsigned int type) {
+    switch (type) {
+    case mmap_image3d_header::Float32: return 4;
+    case mmap_image3d_header::Uint16:
+    case mmap_image3d_header::Float16:
+    case mmap_image3d_header::Int16:   return 2;
+    default:                           return 1;
+    }
+}
+
+// raw pointer to the mapped data that can be used in the given memory space,
+// mapped files are not accessible by the CUDA backend.
+template <typename MemorySpace, typename StorageType> struct mapped_pointer;
+
+template <typename StorageType>
+struct mapped_pointer<thrust::host_space_tag, StorageType>
+{
+    typedef StorageType *type;
+    static type make(void *p) { return (StorageType *) p; }
+};
+
+#if THRUST_DEVICE_BACKEND != THRUST_DEVICE_BACKEND_CUDA
+template <typename StorageType>
+struct mapped_pointer<thrust::detail::default_device_space_tag, StorageType>
+{
+    typedef thrust::device_ptr<StorageType> type;
+    static type make(void *p) { return thrust::device_ptr<StorageType>((StorageType *) p); }
+};
+#endif
+
+// the mapping of the volume file, this is a base class of mmap_image3d so
+// the header is read before image3d is constructed with the dimensions.
+struct mapped_volume
+{
+    mmap_image3d_header header;
+    void *mapping;
+    size_t mapping_size;
+    void *data;
+    float empty_value;
+
+    mapped_volume(const char *filename, unsigned int type) :
+	mapping(MAP_FAILED), mapping_size(0), data(&empty_value), empty_value(0.0f)
+    {
+	// an unreadable file results in a single point volume
+	std::memset(&header, 0, sizeof(header));
+	header.type = type;
+	header.dims[0] = header.dims[1] = header.dims[2] = 1;
+	header.spacing[0] = header.spacing[1] = header.spacing[2] = 1.0f;
+	header.scale = 1.0f;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) { std::cout << "File: " << filename << " cannot be opened \n"; return; }
+
+	struct stat st;
+	mmap_image3d_header h;
+	if ((fstat(fd, &st) != 0) ||
+	    (pread(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h)) ||
+	    (std::memcmp(h.magic, mmap_image3d_magic, sizeof(h.magic)) != 0)) {
+	    std::cout << "File: " << filename << " is not a PISTON volume \n";
+	    close(fd);
+	    return;
+	}
+	if ((h.version == 0) || (h.version > mmap_image3d_version)) {
+	    std::cout << "File: " << filename << " has an unknown version " << h.version << " \n";
+	    close(fd);
+	    return;
+	}
+	if (h.version == 1) {
+	    // no scale and offset yet
+	    h.scale = 1.0f;
+	    h.offset = 0.0f;
+	}
+	if (h.type != type) {
+	    std::cout << "File: " << filename << " does not have the requested data type \n";
+	    close(fd);
+	    return;
+	}
+	if ((size_t) st.st_size < h.data_offset + data_size(h)) {
+	    std::cout << "File: " << filename << " is truncated \n";
+	    close(fd);
+	    return;
+	}
+
+	// the mapping is private so the point data can be handed out as a non
+	// const iterator, pages are only read from the file when touched. No
+	// swap is reserved for it, volumes larger than the memory can be mapped.
+	mapping_size = st.st_size;
+	mapping = mmap(0, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+	    std::cout << "File: " << filename << " cannot be mapped \n";
+	    return;
+	}
+
+	header = h;
+	data = (char *) mapping + h.data_offset;
+    }
+
+    ~mapped_volume() {
+	if (mapping != MAP_FAILED)
+	    munmap(mapping, mapping_size);
+    }
+
+    // number of points stored in the file, including the padding of bricks
+    static size_t stored_points(const mmap_image3d_header &h) {
+	if (h.brick_size == 0)
+	    return (size_t) h.dims[0] * h.dims[1] * h.dims[2];
+
+	const size_t b = h.brick_size;
+	return ((h.dims[0] + b - 1) / b) * ((h.dims[1] + b - 1) / b) * ((h.dims[2] + b - 1) / b) * b*b*b;
+    }
+    static size_t data_size(const mmap_image3d_header &h) {
+	return stored_points(h) * mmap_type_size(h.type);
+    }
+
+private:
+    mapped_volume(const mapped_volume&);
+    mapped_volume& operator=(const mapped_volume&);
+};
+
+} // namespace detail
+
+/* image3d backed by a memory mapped volume file, the point data is read in
+ * place without copying it. Only the pages touched by the filters are ever
+ * loaded, for the host and the OpenMP backends. StorageType has to match the
+ * type of the file.
+ *
+ * Layout is the order of the point ids seen by the filters, independent of
+ * the order in the file. The default 32 bit ids limit the volume to 2^32
+ * points, e.g. a 2048^3 volume needs
+ * 	mmap_image3d<Space, float, linear_layout<unsigned long long> >. */
+template <typename MemorySpace =  thrust::detail::default_device_space_tag, typename StorageType = float,
+          typename Layout = linear_layout<> >
+struct mmap_image3d : private detail::mapped_volume, public piston::image3d<MemorySpace, Layout>
+{
+    typedef piston::image3d<MemorySpace, Layout> Parent;
+    typedef typename Parent::IndexType IndexType;
+
+    //TODO: move this to parent class?
+    typedef typename thrust::iterator_traits<typename Parent::GridCoordinatesIterator>::value_type
+	    GridCoordinatesType;
+
+    // transfrom grid_coordinates (i, j, k) generated by image3d to shifted and
+    // scaled physical_coordinates (x, y, z)
+    struct physical_coordinates_functor : public thrust::unary_function<GridCoordinatesType,
+								        thrust::tuple<float, float, float> >
+    {
+        const float xmin, ymin, zmin;
+        const float deltax, deltay, deltaz;
+
+        physical_coordinates_functor(float xmin   = 0.0f, float ymin   = 0.0f, float zmin   = 0.0f,
+                                     float deltax = 1.0f, float deltay = 1.0f, float deltaz = 1.0f) :
+            xmin(xmin), ymin(ymin), zmin(zmin),
+            deltax(deltax), deltay(deltay), deltaz(deltaz) {}
+
+        __host__ __device__
+        thrust::tuple<float, float, float> operator()(const GridCoordinatesType& grid_coord) const {
+            const float x = xmin + deltax * thrust::get<0>(grid_coord);
+            const float y = ymin + deltay * thrust::get<1>(grid_coord);
+            const float z = zmin + deltaz * thrust::get<2>(grid_coord);
+
+            return thrust::make_tuple(x, y, z);
+        }
+    };
+
+    // transform a point id into the offset of its value in the file, the
+    // identity for unbricked files read with a linear_layout.
+    struct point_offset_functor : public thrust::unary_function<IndexType, size_t>
+    {
+	const Layout layout;
+	const size_t dim0, dim1;
+	const size_t brick_size;
+	const size_t bricks_x, bricks_y;
+
+	point_offset_functor(const Layout &layout, size_t brick_size) :
+	    layout(layout), dim0(layout.dim0), dim1(layout.dim1), brick_size(brick_size),
+	    bricks_x(brick_size ? (dim0 + brick_size - 1) / brick_size : 0),
+	    bricks_y(brick_size ? (dim1 + brick_size - 1) / brick_size : 0) {}
+
+	__host__ __device__
+	size_t operator()(IndexType point_id) const {
+	    if ((brick_size == 0) && detail::is_linear_layout<Layout>::value)
+		return point_id;
+
+	    const thrust::tuple<IndexType, IndexType, IndexType> ijk = layout.coordinates(point_id);
+	    const size_t i = thrust::get<0>(ijk);
+	    const size_t j = thrust::get<1>(ijk);
+	    const size_t k = thrust::get<2>(ijk);
+	    if (brick_size == 0)
+		return (k*dim1 + j)*dim0 + i;
+
+	    const size_t brick = ((k / brick_size)*bricks_y + j / brick_size)*bricks_x + i / brick_size;
+	    const size_t local = ((k % brick_size)*brick_size + j % brick_size)*brick_size + i % brick_size;
+	    return brick*brick_size*brick_size*brick_size + local;
+	}
+    };
+
+    typedef typename thrust::transform_iterator<physical_coordinates_functor,
+	    typename Parent::GridCoordinatesIterator> PhysicalCoordinatesIterator;
+    PhysicalCoordinatesIterator phys_coordinates_iterator;
+
+    typedef typename detail::mapped_pointer<MemorySpace, StorageType>::type MappedPointer;
+    typedef thrust::transform_iterator<point_offset_functor, typename Parent::CountingIterator> PointOffsetIterator;
+    typedef thrust::permutation_iterator<MappedPointer, PointOffsetIterator> StoredDataIterator;
+    typedef decoded_iterator<StoredDataIterator> DecodedIterator;
+    typedef typename DecodedIterator::type PointDataIterator;
+
+    mmap_image3d(const char *filename, bool sequential = true) :
+	detail::mapped_volume(filename, detail::mmap_storage_type<StorageType>::value),
+	Parent(header.dims[0], header.dims[1], header.dims[2]),
+	phys_coordinates_iterator(Parent::grid_coordinates_iterator,
+	                          physical_coordinates_functor(header.origin[0], header.origin[1], header.origin[2],
+	                                                       header.spacing[0], header.spacing[1], header.spacing[2]))
+    {
+	// filters walk the point data in z slabs
+	if (sequential)
+	    advise(0, this->dim2, MADV_SEQUENTIAL);
+    }
+
+    bool is_open() const {
+	return mapping != MAP_FAILED;
+    }
+
+    const mmap_image3d_header &file_header() const {
+	return header;
+    }
+
+    // hint that the z layers [first, last) will be needed soon, or are not
+    // needed anymore, e.g. when streaming slabs through a filter.
+    void prefetch_layers(IndexType first, IndexType last) {
+	advise(first, last, MADV_WILLNEED);
+    }
+    void release_layers(IndexType first, IndexType last) {
+	advise(first, last, MADV_DONTNEED);
+    }
+
+    // FixME: const correctness, should we change it to cbegin()/cend()?
+    PhysicalCoordinatesIterator physical_coordinates_begin() {
+ 	return phys_coordinates_iterator;
+    }
+    PhysicalCoordinatesIterator physical_coordinates_end() {
+	return phys_coordinates_iterator+this->NPoints;
+    }
+
+    PointDataIterator point_data_begin() {
+	return DecodedIterator::make(
+	    thrust::make_permutation_iterator(detail::mapped_pointer<MemorySpace, StorageType>::make(data),
+	                                      thrust::make_transform_iterator(typename Parent::CountingIterator(0),
+	                                                                      point_offset_functor(this->layout, header.brick_size))),
+	    header.scale, header.offset);
+    }
+    PointDataIterator point_data_end() {
+	return point_data_begin() + this->NPoints;
+    }
+
+private:
+    // apply madvise to the pages holding the z layers [first, last)
+    void advise(IndexType first, IndexType last, int advice) {
+	if (!is_open() || first >= last)
+	    return;
+
+	size_t begin, end;
+	if (header.brick_size == 0) {
+	    const size_t layer = (size_t) this->dim0 * this->dim1 * sizeof(StorageType);
+	    begin = first * layer;
+	    end   = last * layer;
+	} else {
+	    // whole layers of bricks
+	    const size_t b = header.brick_size;
+	    const size_t layer = ((this->dim0 + b - 1) / b) * ((this->dim1 + b - 1) / b) * b*b*b * sizeof(StorageType);
+	    begin = (first / b) * layer;
+	    end   = ((last + b - 1) / b) * layer;
+	}
+
+	// madvise wants a page aligned address
+	const size_t page = sysconf(_SC_PAGESIZE);
+	begin += header.data_offset;
+	end   += header.data_offset;
+	begin -= begin % page;
+	if (end > mapping_size)
+	    end = mapping_size;
+	madvise((char *) mapping + begin, end - begin, advice);
+    }
+};
+
+// write a volume file for mmap_image3d, with brick_size == 0 the data is
+// stored as is, otherwise it is reordered into bricks. scale and offset
+// decode integer data.
+template <typename StorageType>
+bool write_mmap_image3d(const char *filename, const unsigned int dims[3],
+                        const float origin[3], const float spacing[3],
+                        const StorageType *data, unsigned int brick_size = 0,
+                        float scale = 1.0f, float offset = 0.0f)
+{
+    mmap_image3d_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, mmap_image3d_magic, sizeof(h.magic));
+    h.version = mmap_image3d_version;
+    h.type = detail::mmap_storage_type<StorageType>::value;
+    h.scale = scale;
+    h.offset = offset;
+    h.brick_size = brick_size;
+    for (int d = 0; d < 3; d++) {
+	h.dims[d] = dims[d];
+	h.origin[d] = origin[d];
+	h.spacing[d] = spacing[d];
+    }
+    h.data_offset = sysconf(_SC_PAGESIZE);
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) { std::cout << "File: " << filename << " cannot be opened \n"; return false; }
+
+    bool ok = (fwrite(&h, sizeof(h), 1, file) == 1) && (fseek(file, h.data_offset, SEEK_SET) == 0);
+    if (ok && brick_size == 0) {
+	const size_t n = (size_t) dims[0] * dims[1] * dims[2];
+	ok = (fwrite(data, sizeof(StorageType), n, file) == n);
+    } else if (ok) {
+	// one brick at a time, padding with the first value
+	const size_t b = brick_size;
+	StorageType *brick = new StorageType[b*b*b];
+	for (size_t bk = 0; ok && bk < dims[2]; bk += b)
+	    for (size_t bj = 0; ok && bj < dims[1]; bj += b)
+		for (size_t bi = 0; ok && bi < dims[0]; bi += b) {
+		    for (size_t k = 0; k < b; k++)
+			for (size_t j = 0; j < b; j++)
+			    for (size_t i = 0; i < b; i++) {
+				const bool inside = (bi+i < dims[0]) && (bj+j < dims[1]) && (bk+k < dims[2]);
+				brick[(k*b + j)*b + i] = inside ?
+				    data[((bk+k)*dims[1] + bj+j)*dims[0] + bi+i] : data[0];
+			    }
+		    ok = (fwrite(brick, sizeof(StorageType), b*b*b, file) == b*b*b);
+		}
+	delete [] brick;
+    }
+
+    if (fclose(file) != 0) ok = false;
+    if (!ok) std::cout << "File: " << filename << " cannot be written \n";
+    return ok;
+}
+
+}
+#endif /* MMAP_IMAGE3D_H_ */
@@ -0,0 +1,383 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef MULTI_THRESHOLD_GEOMETRY_H_
+#define MULTI_THRESHOLD_GEOMETRY_H_
+
+#include <vector>
+
+#include <thrust/count.h>
+#include <thrust/copy.h>
+#include <thrust/sort.h>
+#include <thrust/binary_search.h>
+#include <thrust/transform_scan.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/zip_iterator.h>
+#include <thrust/iterator/permutation_iterator.h>
+
+#include <piston/image3d.h>
+#include <piston/piston_math.h>
+#include <piston/choose_container.h>
+#include <piston/threshold_geometry.h>
+
+namespace piston
+{
+
+/* Threshold a dataset against several materials in one pass.
+ *
+ * A material is either a value range [min_values[k], max_values[k]] or,
+ * in material id mode, an integer id k in [0, num_materials) stored as
+ * the point scalar. Every cell is classified into at most one material:
+ * 	Range mode : the first range that contains all eight vertices
+ * 	Id mode    : the id shared by all eight vertices
+ *
+ * Boundary faces are faces between cells of different materials, or
+ * between a cell with a material and a cell without one or the border of
+ * the dataset. A face between two materials is generated only once, by
+ * the cell with the lower material id.
+ *
+ * The output quads are grouped by material, the quads of material k are
+ * vertices [material_vertex_offsets[k], material_vertex_offsets[k+1]). */
+template <typename InputDataSet>
+struct multi_threshold_geometry
+{
+    typedef typename InputDataSet::PointDataIterator InputPointDataIterator;
+    typedef typename InputDataSet::PhysicalCoordinatesIterator InputGridCoordinatesIterator;
+
+    typedef typename thrust::iterator_space<InputPointDataIterator>::type	space_type;
+    typedef typename thrust::iterator_value<InputPointDataIterator>::type	value_type;
+
+    // cell and vertex ids follow threshold_geometry
+    typedef typename threshold_geometry<InputDataSet>::IndexType IndexType;
+
+    typedef typename thrust::counting_iterator<IndexType, space_type>	CountingIterator;
+
+    // at most 255 materials, the largest value marks cells without material
+    typedef unsigned char MaterialType;
+    static const int NoMaterial = 255;
+
+    typedef typename detail::choose_container<InputPointDataIterator, IndexType>::type IndicesContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, float>::type	  RangesContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, MaterialType>::type MaterialsContainer;
+
+    typedef typename IndicesContainer::iterator IndicesIterator;
+    typedef thrust::permutation_iterator<typename thrust::transform_iterator<tuple2float4, InputGridCoordinatesIterator>, IndicesIterator> VerticesIterator;
+
+    typedef typename detail::choose_container<InputPointDataIterator, float3>::type	NormalsContainer;
+    typedef typename NormalsContainer::iterator  NormalsIterator;
+    typedef thrust::permutation_iterator<InputPointDataIterator, IndicesIterator> ScalarsIterator;
+
+    // quads are generated the same way as threshold_geometry's boundary faces
+    typedef typename threshold_geometry<InputDataSet>::generate_quads generate_quads;
+
+    InputDataSet &input;
+    int num_materials;
+    bool useMaterialIds;
+
+    RangesContainer	min_values;
+    RangesContainer	max_values;
+
+    MaterialsContainer	cell_materials;		// material of each cell, NoMaterial if none
+    MaterialsContainer	cell_face_masks;	// bit f set if face f of the cell is generated
+    IndicesContainer	exterior_cell_indices;	// cells with at least one face, grouped by material
+    MaterialsContainer	exterior_cell_materials;
+    IndicesContainer	exterior_face_enum;	// enumeration of faces of exterior cells
+    IndicesContainer	vertices_indices;
+    NormalsContainer	normals;
+
+    std::vector<IndexType> material_vertex_offsets; // num_materials+1 offsets into the vertices
+
+    typename InputDataSet::IndexType num_total_vertices;
+
+    // one material for each range [min_values[k], max_values[k]]
+    multi_threshold_geometry(InputDataSet &input,
+                             const std::vector<float> &min_values,
+                             const std::vector<float> &max_values) :
+	input(input), num_materials(0), useMaterialIds(false), num_total_vertices(0)
+    {
+	set_threshold_ranges(min_values, max_values);
+    }
+
+    // the point scalars are material ids in [0, num_materials)
+    multi_threshold_geometry(InputDataSet &input, int num_materials) :
+	input(input), num_materials(0), useMaterialIds(true), num_total_vertices(0)
+    {
+	set_material_ids(num_materials);
+    }
+
+    void freeMemory(bool includeInput=true)
+    {
+	cell_materials.clear();  cell_face_masks.clear();
+	exterior_cell_indices.clear();  exterior_cell_materials.clear();  exterior_face_enum.clear();
+	vertices_indices.clear();  normals.clear();
+    }
+
+    void operator()() {
+	const IndexType NCells = input.NCells;
+
+	material_vertex_offsets.assign(num_materials+1, 0);
+
+	// classify every cell into one material in a single pass
+	cell_materials.resize(NCells);
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NCells,
+	                  cell_materials.begin(),
+	                  classify_cell(input, useMaterialIds, num_materials,
+	                                thrust::raw_pointer_cast(&*min_values.begin()),
+	                                thrust::raw_pointer_cast(&*max_values.begin())));
+
+	// find the faces each cell generates
+	cell_face_masks.resize(NCells);
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NCells,
+	                  cell_face_masks.begin(),
+	                  material_boundary_faces(input, thrust::raw_pointer_cast(&*cell_materials.begin())));
+
+	const IndexType num_exterior_cells = thrust::count_if(cell_face_masks.begin(), cell_face_masks.end(),
+	                                                has_faces());
+
+	// no boundary faces at all, return with empty vertices vector.
+	if (num_exterior_cells == 0) {
+	    num_total_vertices = 0;
+	    vertices_indices.clear();
+	    normals.clear();
+	    return;
+	}
+
+	exterior_cell_indices.resize(num_exterior_cells);
+	thrust::copy_if(CountingIterator(0), CountingIterator(0)+NCells,
+	                cell_face_masks.begin(),
+	                exterior_cell_indices.begin(),
+	                has_faces());
+
+	// group the exterior cells by material, the sort is stable so cells
+	// stay in memory order within a material.
+	exterior_cell_materials.resize(num_exterior_cells);
+	thrust::copy(thrust::make_permutation_iterator(cell_materials.begin(), exterior_cell_indices.begin()),
+	             thrust::make_permutation_iterator(cell_materials.begin(), exterior_cell_indices.end()),
+	             exterior_cell_materials.begin());
+	thrust::stable_sort_by_key(exterior_cell_materials.begin(), exterior_cell_materials.end(),
+	                           exterior_cell_indices.begin());
+
+	// enumerate faces of the exterior cells
+	exterior_face_enum.resize(num_exterior_cells);
+	thrust::transform_exclusive_scan(thrust::make_permutation_iterator(cell_face_masks.begin(), exterior_cell_indices.begin()),
+	                                 thrust::make_permutation_iterator(cell_face_masks.begin(), exterior_cell_indices.end()),
+	                                 exterior_face_enum.begin(),
+	                                 count_faces(), IndexType(0), thrust::plus<IndexType>());
+
+	const IndexType num_faces = exterior_face_enum.back() + popcount(cell_face_masks[exterior_cell_indices.back()]);
+	num_total_vertices = num_faces*4;
+
+	// per material offsets, first exterior cell of each material
+	IndicesContainer material_cell_offsets(num_materials);
+	thrust::lower_bound(exterior_cell_materials.begin(), exterior_cell_materials.end(),
+	                    CountingIterator(0), CountingIterator(0)+num_materials,
+	                    material_cell_offsets.begin());
+	thrust::host_vector<IndexType> cell_offsets(material_cell_offsets.begin(), material_cell_offsets.end());
+	for (int m = 0; m < num_materials; m++) {
+	    material_vertex_offsets[m] = (cell_offsets[m] < num_exterior_cells) ?
+	                                 4*exterior_face_enum[cell_offsets[m]] : num_total_vertices;
+	}
+	material_vertex_offsets[num_materials] = num_total_vertices;
+
+	vertices_indices.resize(num_total_vertices);
+	normals.resize(num_total_vertices);
+	thrust::for_each(thrust::make_zip_iterator(thrust::make_tuple(exterior_cell_indices.begin(),
+	                                                              exterior_face_enum.begin(),
+	                                                              thrust::make_permutation_iterator(cell_face_masks.begin(), exterior_cell_indices.begin()))),
+	                 thrust::make_zip_iterator(thrust::make_tuple(exterior_cell_indices.end(),
+	                                                              exterior_face_enum.end(),
+	                                                              thrust::make_permutation_iterator(cell_face_masks.begin(), exterior_cell_indices.end()))),
+	                 generate_quads(input, thrust::raw_pointer_cast(&*vertices_indices.begin()), thrust::raw_pointer_cast(&*normals.begin())));
+    }
+
+    // FixME: change float to value_type
+    // return the material of a cell, NoMaterial if it has none
+    struct classify_cell : public thrust::unary_function<IndexType, MaterialType>
+    {
+	// FixME: constant iterator and/or iterator to const problem.
+	InputPointDataIterator point_data;
+	const bool useMaterialIds;
+	const int num_materials;
+	const float *min_values;
+	const float *max_values;
+	const typename InputDataSet::LayoutType layout;
+
+	const int xdim;
+	const int ydim;
+	const int zdim;
+	const int cells_per_layer;
+
+	classify_cell(InputDataSet &input, bool useMaterialIds, int num_materials,
+	              const float *min_values, const float *max_values) :
+	    point_data(input.point_data_begin()),
+	    useMaterialIds(useMaterialIds), num_materials(num_materials),
+	    min_values(min_values), max_values(max_values),
+	    layout(input.layout),
+	    xdim(input.dim0), ydim(input.dim1), zdim(input.dim2),
+	    cells_per_layer((xdim - 1) * (ydim - 1)) {}
+
+	__host__ __device__
+	MaterialType operator() (IndexType cell_id) const {
+	    const IndexType x = cell_id % (xdim - 1);
+	    const IndexType y = (cell_id / (xdim - 1)) % (ydim -1);
+	    const IndexType z = cell_id / cells_per_layer;
+
+	    // indices to the eight vertices of the voxel
+	    IndexType i[8];
+	    layout.cell_vertices(x, y, z, i);
+
+	    float f[8];
+	    f[0] = *(point_data + i[0]);
+	    f[1] = *(point_data + i[1]);
+	    f[2] = *(point_data + i[2]);
+	    f[3] = *(point_data + i[3]);
+	    f[4] = *(point_data + i[4]);
+	    f[5] = *(point_data + i[5]);
+	    f[6] = *(point_data + i[6]);
+	    f[7] = *(point_data + i[7]);
+
+	    // a range contains the cell if it contains the extremes of its vertices
+	    float fmin = f[0], fmax = f[0];
+	    for (int v = 1; v < 8; v++) {
+		fmin = (f[v] < fmin) ? f[v] : fmin;
+		fmax = (f[v] > fmax) ? f[v] : fmax;
+	    }
+
+	    if (useMaterialIds) {
+		const int id = (int) fmin;
+		const bool valid = (fmin == fmax) && (fmin == (float) id) &&
+		                   (id >= 0) && (id < num_materials);
+		return valid ? id : NoMaterial;
+	    }
+
+	    for (int m = 0; m < num_materials; m++) {
+		if ((min_values[m] <= fmin) && (fmax <= max_values[m]))
+		    return m;
+	    }
+	    return NoMaterial;
+	}
+    };
+
+    // return a mask of the faces a cell generates, face numbering follows
+    // threshold_geometry::generate_quads.
+    struct material_boundary_faces : public thrust::unary_function<IndexType, MaterialType>
+    {
+	const int xdim;
+	const int ydim;
+	const int zdim;
+	const int cells_per_layer;
+
+	const MaterialType *cell_materials;
+
+	material_boundary_faces(InputDataSet &input, const MaterialType *cell_materials) :
+	    xdim(input.dim0), ydim(input.dim1), zdim(input.dim2),
+	    cells_per_layer((xdim - 1) * (ydim - 1)),
+	    cell_materials(cell_materials) {}
+
+	__host__ __device__
+	MaterialType operator() (IndexType cell_id) const {
+	    const int m = cell_materials[cell_id];
+	    if (m == NoMaterial)
+		return 0;
+
+	    const int x = cell_id % (xdim - 1);
+	    const int y = (cell_id / (xdim - 1)) % (ydim -1);
+	    const IndexType z = cell_id / cells_per_layer;
+
+	    // a face is generated if the neighbor is outside of the dataset or
+	    // has a higher material id, NoMaterial is higher than any material,
+	    // so faces between two materials are generated once.
+	    MaterialType faces = 0;
+	    if ((y == 0)          || (cell_materials[cell_id - (xdim - 1)] > m))     faces |= 1;
+	    if ((x == (xdim - 2)) || (cell_materials[cell_id + 1] > m))              faces |= 2;
+	    if ((y == (ydim - 2)) || (cell_materials[cell_id + (xdim - 1)] > m))     faces |= 4;
+	    if ((x == 0)          || (cell_materials[cell_id - 1] > m))              faces |= 8;
+	    if ((z == 0)          || (cell_materials[cell_id - cells_per_layer] > m)) faces |= 16;
+	    if ((z == (zdim - 2)) || (cell_materials[cell_id + cells_per_layer] > m)) faces |= 32;
+
+	    return faces;
+	}
+    };
+
+    struct has_faces : public thrust::unary_function<MaterialType, bool>
+    {
+	__host__ __device__
+	bool operator() (MaterialType faces) const {
+	    return faces != 0;
+	}
+    };
+
+    struct count_faces : public thrust::unary_function<MaterialType, IndexType>
+    {
+	__host__ __device__
+	IndexType operator() (MaterialType faces) const {
+	    return popcount(faces);
+	}
+    };
+
+    // FixME: better name!!!
+    VerticesIterator vertices_begin() {
+	return thrust::make_permutation_iterator(thrust::make_transform_iterator(input.physical_coordinates_begin(),
+	                                                                         tuple2float4()),
+	                                         vertices_indices.begin());
+    }
+    VerticesIterator vertices_end() {
+	return vertices_begin() + vertices_indices.size();
+    }
+
+    NormalsIterator normals_begin() {
+	return normals.begin();
+    }
+    NormalsIterator normals_end() {
+	return normals.end();
+    }
+
+    ScalarsIterator scalars_begin() {
+	return thrust::make_permutation_iterator(input.point_data_begin(), vertices_indices.begin());
+    }
+    ScalarsIterator scalars_end() {
+	return scalars_begin() + vertices_indices.size();
+    }
+
+    void set_threshold_ranges(const std::vector<float> &minVals, const std::vector<float> &maxVals) {
+	useMaterialIds = false;
+	num_materials = minVals.size() < maxVals.size() ? minVals.size() : maxVals.size();
+	if (num_materials > NoMaterial) num_materials = NoMaterial;
+	min_values.assign(minVals.begin(), minVals.begin() + num_materials);
+	max_values.assign(maxVals.begin(), maxVals.begin() + num_materials);
+	// keep the device pointers valid for the classifier
+	if (num_materials == 0) { min_values.resize(1); max_values.resize(1); }
+    }
+
+    void set_material_ids(int numMaterials) {
+	useMaterialIds = true;
+	num_materials = (numMaterials > NoMaterial) ? (int) NoMaterial : numMaterials;
+	min_values.resize(1);
+	max_values.resize(1);
+    }
+};
+
+}
+
+#endif /* MULTI_THRESHOLD_GEOMETRY_H_ */
@@ -148,6 +148,46 @@ inline __host__ __device__ float cosAngle(float3& a_vector0, float3 a_vector1)
 }
 
 
+// number of bits set in a 32-bit word
+inline __host__ __device__ int popcount(unsigned int v)
+{
+#ifdef __CUDA_ARCH__
+    return __popc(v);
+#else
+    return __builtin_popcount(v);
+#endif
+}
+
+
+// position of the lowest bit set in a 32-bit word, v must not be zero
+inline __host__ __device__ int lowest_bit(unsigned int v)
+{
+#ifdef __CUDA_ARCH__
+    return __ffs(v) - 1;
+#else
+    return __builtin_ctz(v);
+#endif
+}
+
+
+// atomically raise *address to value if value is larger, returns the previous value
+inline __host__ __device__ unsigned long long atomic_max(unsigned long long* address, unsigned long long value)
+{
+    unsigned long long old = *address;
+    while (old < value)
+    {
+#ifdef __CUDA_ARCH__
+        unsigned long long seen = atomicCAS(address, old, value);
+#else
+        unsigned long long seen = __sync_val_compare_and_swap(address, old, value);
+#endif
+        if (seen == old) break;
+        old = seen;
+    }
+    return old;
+}
+
+
 inline __host__ __device__ float4 matrixMul(float* r, float4 v)
 {
     return make_float4(r[0]*v.x + r[1]*v.y + r[2]*v.z + r[3]*v.w, r[4]*v.x + r[5]*v.y + r[6]*v.z +r[7]*v.w, r[8]*v.x + r[9]*v.y + r[10]*v.z + r[11]*v.w, r[12]*v.x + r[13]*v.y + r[14]*v.z + r[15]*v.w);
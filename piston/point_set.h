@@ -0,0 +1,86 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef POINT_SET_H_
+#define POINT_SET_H_
+
+#include <thrust/tuple.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/zip_iterator.h>
+#include <piston/choose_container.h>
+
+namespace piston
+{
+
+// unstructured set of points (e.g. particles) with one scalar per point,
+// coordinates are stored as separate x, y, z arrays.
+template <typename MemorySpace =  thrust::detail::default_device_space_tag>
+struct point_set
+{
+    typedef unsigned IndexType;
+
+    IndexType NPoints;
+
+    typedef typename thrust::counting_iterator<IndexType, MemorySpace> CountingIterator;
+    typedef typename detail::choose_container<CountingIterator, float>::type PointDataContainer;
+    typedef typename PointDataContainer::iterator PointDataIterator;
+
+    typedef thrust::zip_iterator<thrust::tuple<PointDataIterator, PointDataIterator, PointDataIterator> > PhysicalCoordinatesIterator;
+
+    PointDataContainer x;
+    PointDataContainer y;
+    PointDataContainer z;
+    PointDataContainer point_data_vector;
+
+    point_set(IndexType n) :
+	NPoints(n), x(n), y(n), z(n), point_data_vector(n) {}
+
+    template <typename InputIterator>
+    point_set(InputIterator x_first, InputIterator x_last,
+              InputIterator y_first, InputIterator z_first,
+              InputIterator data_first) :
+	NPoints(x_last - x_first),
+	x(x_first, x_last),
+	y(y_first, y_first + (x_last - x_first)),
+	z(z_first, z_first + (x_last - x_first)),
+	point_data_vector(data_first, data_first + (x_last - x_first)) {}
+
+    PhysicalCoordinatesIterator physical_coordinates_begin() {
+	return thrust::make_zip_iterator(thrust::make_tuple(x.begin(), y.begin(), z.begin()));
+    }
+    PhysicalCoordinatesIterator physical_coordinates_end() {
+	return thrust::make_zip_iterator(thrust::make_tuple(x.end(), y.end(), z.end()));
+    }
+
+    PointDataIterator point_data_begin() {
+	return point_data_vector.begin();
+    }
+    PointDataIterator point_data_end() {
+	return point_data_vector.end();
+    }
+};
+
+} // namespace piston
+
+#endif /* POINT_SET_H_ */
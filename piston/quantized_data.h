@@ -0,0 +1,264 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef QUANTIZED_DATA_H_
+#define QUANTIZED_DATA_H_
+
+#include <thrust/transform.h>
+#include <thrust/extrema.h>
+#include <thrust/iterator/transform_iterator.h>
+
+namespace piston
+{
+
+/* Point data stored in fewer bits than float. The filters always see float
+ * values, the storage types are decoded inside of the point data iterator:
+ * 	- 8 and 16 bit integers: value = offset + scale * code
+ * 	- half: IEEE 754 binary16, converted in software
+ * float storage is passed through untouched. */
+
+// IEEE 754 half precision float, only used for storage
+struct half
+{
+    unsigned short bits;
+};
+
+inline __host__ __device__
+float half2float(half h)
+{
+    const unsigned int sign = ((unsigned int) (h.bits & 0x8000)) << 16;
+    int exponent = (h.bits >> 10) & 0x1f;
+    unsigned int mantissa = h.bits & 0x3ff;
+
+    union { unsigned int u; float f; } result;
+    if (exponent == 0) {
+	if (mantissa == 0) {
+	    result.u = sign;
+	} else {
+	    // subnormal, normalize it
+	    exponent = 1;
+	    while (!(mantissa & 0x400)) {
+		mantissa <<= 1;
+		exponent--;
+	    }
+	    result.u = sign | ((exponent + 127 - 15) << 23) | ((mantissa & 0x3ff) << 13);
+	}
+    } else if (exponent == 31) {
+	result.u = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+	result.u = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+    return result.f;
+}
+
+// round to nearest even, overflows to infinity
+inline __host__ __device__
+half float2half(float f)
+{
+    union { float f; unsigned int u; } value;
+    value.f = f;
+    const unsigned int x = value.u;
+
+    half h;
+    const unsigned short sign = (x >> 16) & 0x8000;
+    const int exponent = (int) ((x >> 23) & 0xff) - 127 + 15;
+    unsigned int mantissa = x & 0x7fffff;
+
+    if ((x & 0x7fffffff) > 0x7f800000) {
+	h.bits = sign | 0x7e00;
+	return h;
+    }
+    if (exponent >= 31) {
+	h.bits = sign | 0x7c00;
+	return h;
+    }
+    if (exponent <= 0) {
+	// subnormal or zero
+	if (exponent < -10) {
+	    h.bits = sign;
+	    return h;
+	}
+	mantissa |= 0x800000;
+	const int shift = 14 - exponent;
+	unsigned int bits = mantissa >> shift;
+	const unsigned int rest = mantissa & ((1u << shift) - 1);
+	const unsigned int halfway = 1u << (shift - 1);
+	if ((rest > halfway) || ((rest == halfway) && (bits & 1)))
+	    bits++;
+	h.bits = sign | bits;
+	return h;
+    }
+
+    unsigned int bits = (exponent << 10) | (mantissa >> 13);
+    const unsigned int rest = mantissa & 0x1fff;
+    if ((rest > 0x1000) || ((rest == 0x1000) && (bits & 1)))
+	bits++;
+    h.bits = sign | bits;
+    return h;
+}
+
+// range of the codes of a storage type, floating point types are not
+// quantized.
+template <typename StorageType> struct storage_traits
+{
+    static const bool quantized = true;
+};
+template <> struct storage_traits<unsigned char>  { static const bool quantized = true;  static float lowest() { return 0.0f; }      static float highest() { return 255.0f; } };
+template <> struct storage_traits<signed char>    { static const bool quantized = true;  static float lowest() { return -128.0f; }   static float highest() { return 127.0f; } };
+template <> struct storage_traits<unsigned short> { static const bool quantized = true;  static float lowest() { return 0.0f; }      static float highest() { return 65535.0f; } };
+template <> struct storage_traits<short>          { static const bool quantized = true;  static float lowest() { return -32768.0f; } static float highest() { return 32767.0f; } };
+template <> struct storage_traits<half>           { static const bool quantized = false; };
+template <> struct storage_traits<float>          { static const bool quantized = false; };
+
+template <typename StorageType>
+struct decode_value : public thrust::unary_function<StorageType, float>
+{
+    const float scale;
+    const float offset;
+
+    decode_value(float scale = 1.0f, float offset = 0.0f) : scale(scale), offset(offset) {}
+
+    __host__ __device__
+    float operator()(StorageType code) const {
+	return offset + scale * (float) code;
+    }
+};
+
+template <>
+struct decode_value<half> : public thrust::unary_function<half, float>
+{
+    decode_value(float = 1.0f, float = 0.0f) {}
+
+    __host__ __device__
+    float operator()(half h) const {
+	return half2float(h);
+    }
+};
+
+template <typename StorageType>
+struct encode_value : public thrust::unary_function<float, StorageType>
+{
+    const float scale;
+    const float offset;
+    const float lowest;
+    const float highest;
+
+    encode_value(float scale, float offset) :
+	scale(scale), offset(offset),
+	lowest(storage_traits<StorageType>::lowest()), highest(storage_traits<StorageType>::highest()) {}
+
+    __host__ __device__
+    StorageType operator()(float value) const {
+	float code = floorf((value - offset) / scale + 0.5f);
+	code = (code < lowest)  ? lowest  : code;
+	code = (code > highest) ? highest : code;
+	return (StorageType) code;
+    }
+};
+
+template <>
+struct encode_value<half> : public thrust::unary_function<float, half>
+{
+    encode_value(float, float) {}
+
+    __host__ __device__
+    half operator()(float value) const {
+	return float2half(value);
+    }
+};
+
+template <>
+struct encode_value<float> : public thrust::identity<float>
+{
+    encode_value(float, float) {}
+};
+
+// iterator returning the decoded float values of an iterator over stored
+// codes, float storage is returned as is.
+template <typename Iterator,
+          typename StorageType = typename thrust::iterator_value<Iterator>::type>
+struct decoded_iterator
+{
+    typedef thrust::transform_iterator<decode_value<StorageType>, Iterator> type;
+
+    static type make(Iterator codes, float scale, float offset) {
+	return thrust::make_transform_iterator(codes, decode_value<StorageType>(scale, offset));
+    }
+};
+
+template <typename Iterator>
+struct decoded_iterator<Iterator, float>
+{
+    typedef Iterator type;
+
+    static type make(Iterator values, float, float) {
+	return values;
+    }
+};
+
+namespace detail {
+
+template <bool Quantized> struct choose_quantization
+{
+    // map the range of the values onto the full range of the codes
+    template <typename StorageType, typename InputIterator>
+    static void range(InputIterator first, InputIterator last, float &scale, float &offset) {
+	const float lowest  = storage_traits<StorageType>::lowest();
+	const float highest = storage_traits<StorageType>::highest();
+
+	const float min_value = *thrust::min_element(first, last);
+	const float max_value = *thrust::max_element(first, last);
+
+	scale  = (max_value > min_value) ? (max_value - min_value) / (highest - lowest) : 1.0f;
+	offset = min_value - lowest * scale;
+    }
+};
+
+template <> struct choose_quantization<false>
+{
+    template <typename StorageType, typename InputIterator>
+    static void range(InputIterator, InputIterator, float &scale, float &offset) {
+	scale = 1.0f;
+	offset = 0.0f;
+    }
+};
+
+} // namespace detail
+
+// encode float values into a container of codes, the scale and offset to
+// decode them are returned.
+template <typename InputIterator, typename Container>
+void quantize(InputIterator first, InputIterator last, Container &codes, float &scale, float &offset)
+{
+    typedef typename Container::value_type StorageType;
+
+    detail::choose_quantization<storage_traits<StorageType>::quantized>::template range<StorageType>(first, last, scale, offset);
+
+    codes.resize(last - first);
+    thrust::transform(first, last, codes.begin(), encode_value<StorageType>(scale, offset));
+}
+
+} // namespace piston
+
+#endif /* QUANTIZED_DATA_H_ */
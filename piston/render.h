@@ -50,6 +50,22 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 
 namespace piston {
 
+// maps a depth to an unsigned key with the same ordering, so depths can be compared as integers
+inline __host__ __device__ unsigned int depth_key(float z)
+{
+    union { float f; unsigned int u; } bits;  bits.f = z;
+    return (bits.u & 0x80000000) ? ~bits.u : (bits.u | 0x80000000);
+}
+
+
+inline __host__ __device__ float key_depth(unsigned int key)
+{
+    union { float f; unsigned int u; } bits;
+    bits.u = (key & 0x80000000) ? (key & 0x7fffffff) : ~key;
+    return bits.f;
+}
+
+
 class DisplayInfo
 {
 public:
@@ -255,6 +271,9 @@ public:
     int nVertices, width, height, pixelSize;
     thrust::device_vector<float4> transformedVertices;
     thrust::device_vector<char> frame;
+    thrust::device_vector<float> depth;
+    // depth key in the high and triangle id in the low 32 bits of the closest triangle at each pixel
+    thrust::device_vector<unsigned long long> pixelWords;
     thrust::device_vector<float> P;
     thrust::device_vector<float> M;
     float* M1;
@@ -268,6 +287,7 @@ public:
 	   inputNormals(inputNormals), inputColors(inputColors), nVertices(nVertices), width(width), height(height), pixelSize(4)
     {
       frame.resize(width*height*pixelSize);
+      depth.resize(width*height);
 
       P.resize(16);  M.resize(16);  cameraRot.resize(16);  M1 = new float[16];  M2 = new float[16];
       for (unsigned int i=0; i<4; i++) for (unsigned int j=0; j<4; j++) { P[i*4+j] = (i == j) ? 1.0f : 0.0f;  M[i*4+j] = (i == j) ? 1.0f : 0.0f; }
@@ -380,6 +400,7 @@ public:
     void operator()()
     {
       thrust::fill(frame.begin(), frame.end(), 255);
+      thrust::fill(depth.begin(), depth.end(), -FLT_MAX);
       thrust::transform(inputVertices, inputVertices+nVertices, inputVertices, vertexTransformModelview(thrust::raw_pointer_cast(&*M.begin())));
       thrust::transform(inputNormals,  inputNormals+nVertices,  inputNormals,  normalTransformModelview(thrust::raw_pointer_cast(&*M.begin())));
 
@@ -401,13 +422,20 @@ public:
 #ifdef SCANLINE
       transformedVertices.resize(nVertices);
       thrust::transform(inputVertices, inputVertices+nVertices, transformedVertices.begin(), vertexTransformProjection(width, height, thrust::raw_pointer_cast(&*P.begin())));
-      thrust::for_each(CountingIterator(0), CountingIterator(0)+nVertices/3, scanline(inputVertices, transformedVertices.begin(), inputNormals, inputColors, nVertices, width, height,
-                                                                                      pixelSize, displayInfo, thrust::raw_pointer_cast(&*frame.begin())));
+      // triangles overlap on pixels, so the first pass only resolves the closest one with an atomic max
+      // and the second pass lets that triangle alone write the color
+      pixelWords.resize(width*height);
+      thrust::fill(pixelWords.begin(), pixelWords.end(), 0);
+      for (int colorPass = 0; colorPass < 2; colorPass++)
+        thrust::for_each(CountingIterator(0), CountingIterator(0)+nVertices/3, scanline(inputVertices, transformedVertices.begin(), inputNormals, inputColors, nVertices, width, height,
+                                                                                        pixelSize, displayInfo, thrust::raw_pointer_cast(&*frame.begin()),
+                                                                                        thrust::raw_pointer_cast(&*pixelWords.begin()), colorPass));
+      thrust::transform(pixelWords.begin(), pixelWords.end(), depth.begin(), word_depth());
 #else
       thrust::for_each(CountingIterator(0), CountingIterator(0)+width*height, raycast(inputVertices, inputNormals, inputColors, nVertices, width,
                                          height, pixelSize, displayInfo, cameraPos, thrust::raw_pointer_cast(&*cameraRot.begin()),
                                          thrust::raw_pointer_cast(&*(kdtree->tree.begin())), thrust::raw_pointer_cast(&*(kdtree->S.begin())), kdtree->levels,
-                                         thrust::raw_pointer_cast(&*frame.begin())));
+                                         thrust::raw_pointer_cast(&*frame.begin()), thrust::raw_pointer_cast(&*depth.begin())));
 #endif
     }
 
@@ -418,13 +446,27 @@ public:
       InputNormals inputNormals;
       InputColors inputColors;
       char* frame;
+      unsigned long long* pixelWords;
+      bool colorPass;
       DisplayInfo displayInfo;
       int nVertices, width, height, pixelSize;
 
       __host__ __device__
       scanline(InputVertices inputVertices, thrust::device_vector<float4>::iterator transformedVertices, InputNormals inputNormals, InputColors inputColors, int nVertices,
-               int width, int height, int pixelSize, DisplayInfo displayInfo, char* frame) : inputVertices(inputVertices), transformedVertices(transformedVertices),
-               inputNormals(inputNormals),  inputColors(inputColors), nVertices(nVertices), width(width), height(height), pixelSize(pixelSize), displayInfo(displayInfo), frame(frame) {};
+               int width, int height, int pixelSize, DisplayInfo displayInfo, char* frame, unsigned long long* pixelWords, bool colorPass) : inputVertices(inputVertices),
+               transformedVertices(transformedVertices), inputNormals(inputNormals),  inputColors(inputColors), nVertices(nVertices), width(width), height(height),
+               pixelSize(pixelSize), displayInfo(displayInfo), frame(frame), pixelWords(pixelWords), colorPass(colorPass) {};
+
+      // only the closest triangle colors a pixel, ties go to the larger triangle id
+      __host__ __device__
+      void plot(int pixel, unsigned long long word, int b, int g, int r) const
+      {
+        if (!colorPass) { atomic_max(pixelWords + pixel, word);  return; }
+        if (pixelWords[pixel] != word) return;
+        frame[pixel*pixelSize + 0] = b;
+        frame[pixel*pixelSize + 1] = g;
+        frame[pixel*pixelSize + 2] = r;
+      }
 
       __host__ __device__
       void operator() (int id) const
@@ -461,13 +503,16 @@ public:
         int g = curColor.y*255;
         int r = curColor.x*255;
 
+        // the eye space depth of the whole triangle, larger is closer as in raycast
+        float z = 0.0f;
+        for (unsigned int v=0; v<3; v++) z += (*(inputVertices + 3*id + v)).z / 3.0f;
+        unsigned long long word = ((unsigned long long)depth_key(z) << 32) | (unsigned int)id;
+
         for (unsigned int v=0; v<3; v++)
         {
           float3 vertex = make_float3(*(transformedVertices + 3*id + v));
           int i = (int)(vertex.y);   int j = (int)(vertex.x);
-          frame[i*height*pixelSize + j*pixelSize + 0] = b;
-          frame[i*height*pixelSize + j*pixelSize + 1] = g;
-          frame[i*height*pixelSize + j*pixelSize + 2] = r;
+          plot(i*height + j, word, b, g, r);
           if (i < minY) minY = i;  if (i > maxY) maxY = i;
         }
 
@@ -514,17 +559,21 @@ public:
 
           if ((sb >= 0) && (sb < width) && (ss >= 0) && (ss < width))
           {
-            for (unsigned int f=sb; f<=ss; f++)
-            {
-              frame[s*height*pixelSize + f*pixelSize + 0] = b;
-              frame[s*height*pixelSize + f*pixelSize + 1] = g;
-              frame[s*height*pixelSize + f*pixelSize + 2] = r;
-            }
+            for (unsigned int f=sb; f<=ss; f++) plot(s*height + f, word, b, g, r);
           }
         }
       }
     };
 
+    struct word_depth : public thrust::unary_function<unsigned long long, float>
+    {
+      __host__ __device__
+      float operator() (unsigned long long word) const
+      {
+        return (word == 0) ? -FLT_MAX : key_depth((unsigned int)(word >> 32));
+      }
+    };
+
     struct vertexTransformModelview : public thrust::unary_function<float4, float4>
     {
     	float* M;
@@ -583,6 +632,7 @@ public:
       InputNormals inputNormals;
       InputColors inputColors;
       char* frame;
+      float* depth;
       int nVertices, width, height, pixelSize;
       float3 cameraPos;
       float* cameraRot;
@@ -593,10 +643,10 @@ public:
 
       __host__ __device__
       raycast(InputVertices inputVertices, InputNormals inputNormals, InputColors inputColors, int nVertices,
-              int width, int height, int pixelSize, DisplayInfo displayInfo, float3 cameraPos, float* cameraRot, TreeNode* tree, int* treeTris, int numLevels, char* frame) :
+              int width, int height, int pixelSize, DisplayInfo displayInfo, float3 cameraPos, float* cameraRot, TreeNode* tree, int* treeTris, int numLevels, char* frame, float* depth) :
               inputVertices(inputVertices), inputNormals(inputNormals), inputColors(inputColors), nVertices(nVertices), width(width),
               height(height), pixelSize(pixelSize), displayInfo(displayInfo), cameraPos(cameraPos), cameraRot(cameraRot), tree(tree), treeTris(treeTris), numLevels(numLevels),
-              frame(frame) {};
+              frame(frame), depth(depth) {};
 
       __host__ __device__
       bool intersectionSegmentTriangle(float3& a_segmentPointA, float3& a_segmentPointB, float3& a_triangleVertex0, float3& a_triangleVertex1, float3& a_triangleVertex2,
@@ -704,6 +754,7 @@ public:
           frame[y*height*pixelSize + x*pixelSize + 0] = b;
 	  frame[y*height*pixelSize + x*pixelSize + 1] = g;
 	  frame[y*height*pixelSize + x*pixelSize + 2] = r;
+	  depth[y*height + x] = ipt.z;
 	  maxZ = ipt.z;
         }
         return isect;
@@ -768,6 +819,10 @@ public:
 
     thrust::device_vector<char>::iterator frame_begin() { return frame.begin(); }
     thrust::device_vector<char>::iterator frame_end() { return frame.end(); }
+
+    // eye space depth of every pixel of the frame, -FLT_MAX where nothing was hit
+    thrust::device_vector<float>::iterator depth_begin() { return depth.begin(); }
+    thrust::device_vector<float>::iterator depth_end() { return depth.end(); }
 };
 
 }
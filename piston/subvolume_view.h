@@ -0,0 +1,139 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SUBVOLUME_VIEW_H_
+#define SUBVOLUME_VIEW_H_
+
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/iterator/permutation_iterator.h>
+
+#include <piston/image3d.h>
+
+namespace piston {
+
+/* A sub-block (volume of interest) of a structured dataset, without copying
+ * its point data. The extent is given as in VTK, { imin, imax, jmin, jmax,
+ * kmin, kmax } with inclusive bounds in points of the parent, and is clamped
+ * to the parent. An optional sample rate takes every n-th point along an
+ * axis.
+ *
+ * The view is a dataset with linear layout, its point data and physical
+ * coordinates read the parent's through a permutation, so marching_cube,
+ * threshold_geometry etc. work on it unchanged and their output is placed
+ * where the sub-block is in the parent. Views of views work as well. */
+template <typename DataSet>
+struct subvolume_view : public piston::image3d<typename thrust::iterator_space<typename DataSet::PointDataIterator>::type,
+                                               linear_layout<typename DataSet::IndexType> >
+{
+    typedef piston::image3d<typename thrust::iterator_space<typename DataSet::PointDataIterator>::type,
+                            linear_layout<typename DataSet::IndexType> > Parent;
+    typedef typename Parent::IndexType IndexType;
+
+    // return the parent point of a point of the view
+    struct parent_point_functor : public thrust::unary_function<IndexType, IndexType>
+    {
+	linear_layout<IndexType> view;
+	typename DataSet::LayoutType parent_layout;
+	IndexType first[3];
+	IndexType stride[3];
+
+	parent_point_functor(const linear_layout<IndexType> &view, const typename DataSet::LayoutType &parent_layout,
+	                     const int extent[6], const int sample_rate[3]) :
+	    view(view), parent_layout(parent_layout) {
+	    for (int d = 0; d < 3; d++) {
+		first[d]  = extent[2*d];
+		stride[d] = sample_rate[d];
+	    }
+	}
+
+	__host__ __device__
+	IndexType operator()(IndexType point_id) const {
+	    const thrust::tuple<IndexType, IndexType, IndexType> ijk = view.coordinates(point_id);
+	    return parent_layout.index(first[0] + thrust::get<0>(ijk)*stride[0],
+	                               first[1] + thrust::get<1>(ijk)*stride[1],
+	                               first[2] + thrust::get<2>(ijk)*stride[2]);
+	}
+    };
+
+    typedef thrust::transform_iterator<parent_point_functor, typename Parent::CountingIterator> ParentPointIterator;
+
+    typedef thrust::permutation_iterator<typename DataSet::PointDataIterator, ParentPointIterator> PointDataIterator;
+    typedef thrust::permutation_iterator<typename DataSet::PhysicalCoordinatesIterator, ParentPointIterator> PhysicalCoordinatesIterator;
+
+    DataSet &parent;
+    int extent[6];
+    int sample_rate[3];
+
+    subvolume_view(DataSet &parent, const int voi[6], const int rate[3] = 0) :
+	Parent(view_dim(parent.dim0, voi[0], voi[1], rate ? rate[0] : 1),
+	       view_dim(parent.dim1, voi[2], voi[3], rate ? rate[1] : 1),
+	       view_dim(parent.dim2, voi[4], voi[5], rate ? rate[2] : 1)),
+	parent(parent)
+    {
+	const int dims[3] = { (int) parent.dim0, (int) parent.dim1, (int) parent.dim2 };
+	for (int d = 0; d < 3; d++) {
+	    extent[2*d]     = clamp(voi[2*d],     dims[d]);
+	    extent[2*d + 1] = clamp(voi[2*d + 1], dims[d]);
+	    sample_rate[d]  = (rate && rate[d] > 1) ? rate[d] : 1;
+	}
+    }
+
+    PointDataIterator point_data_begin() {
+	return thrust::make_permutation_iterator(parent.point_data_begin(), parent_points_begin());
+    }
+    PointDataIterator point_data_end() {
+	return point_data_begin() + this->NPoints;
+    }
+
+    PhysicalCoordinatesIterator physical_coordinates_begin() {
+	return thrust::make_permutation_iterator(parent.physical_coordinates_begin(), parent_points_begin());
+    }
+    PhysicalCoordinatesIterator physical_coordinates_end() {
+	return physical_coordinates_begin() + this->NPoints;
+    }
+
+    // parent point ids of the points of the view
+    ParentPointIterator parent_points_begin() {
+	return thrust::make_transform_iterator(typename Parent::CountingIterator(0),
+	                                       parent_point_functor(this->layout, parent.layout, extent, sample_rate));
+    }
+
+private:
+    static int clamp(int i, int dim) {
+	return (i < 0) ? 0 : ((i > dim - 1) ? dim - 1 : i);
+    }
+
+    // number of points of the view along an axis, at least one
+    static IndexType view_dim(int dim, int lo, int hi, int rate) {
+	lo = clamp(lo, dim);
+	hi = clamp(hi, dim);
+	rate = (rate > 1) ? rate : 1;
+	return (hi > lo) ? (hi - lo) / rate + 1 : 1;
+    }
+};
+
+}
+
+#endif /* SUBVOLUME_VIEW_H_ */
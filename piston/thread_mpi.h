@@ -0,0 +1,1488 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef THREAD_MPI_H_
+#define THREAD_MPI_H_
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <map>
+#include <vector>
+
+/* Shared memory backend for DISTRIBUTED_PISTON. With PISTON_THREAD_MPI
+ * defined, dthrust.h and image3d.h include this header instead of mpi.h,
+ * and the MPI calls of the distributed code (dthrust, dmarching_cube,
+ * block_decomposition, the distributed readers and writers) go to the ranks
+ * of one process, one thread per rank, started by thread_mpi::run.
+ *
+ * Collectives publish their send buffers and every rank copies what it
+ * needs directly out of the buffers of the other ranks between two
+ * barriers, reductions are combined in rank order by every rank. Isend and
+ * Irecv are matched when the receive is waited for and copy once from the
+ * send buffer into the receive buffer, only the blocking MPI_Send copies
+ * into a temporary buffer so it returns right away. The nonblocking
+ * collectives copy their send data and return without waiting for the
+ * other ranks, the result is combined when the request is waited for.
+ *
+ * Only the subset of MPI used by piston is provided, for MPI_COMM_WORLD.
+ * Code outside thread_mpi::run sees a single rank.
+ *
+ * With PISTON_THREAD_MPI_HYBRID defined, or mpi.h included before this
+ * header, the thread ranks sit on top of real MPI for runs over several
+ * nodes: every MPI process started by mpirun runs the same number of
+ * threads, and thread t of process p is rank p*threads + t of
+ * MPI_COMM_WORLD. The ranks of a process still share their buffers, and
+ * for the parts of a collective in other processes thread 0 of every
+ * process exchanges the data of all its threads with the other processes
+ * over MPI, in a single message per pair of processes. A message to a rank
+ * in another process is copied and sent with MPI right away, and the
+ * threads waiting for messages take the ones that arrived into the
+ * mailboxes of their process. The MPI names of mpi.h are taken over by the
+ * thread ranks, the MPI between the processes is only called through
+ * thread_mpi::process, one thread at a time, so MPI_THREAD_SERIALIZED is
+ * enough. */
+
+#if defined(MPI_VERSION) && !defined(PISTON_THREAD_MPI_HYBRID)
+#define PISTON_THREAD_MPI_HYBRID
+#endif
+
+#ifdef PISTON_THREAD_MPI_HYBRID
+#include <mpi.h>
+
+namespace piston {
+namespace thread_mpi {
+
+/* The MPI between the processes, defined before the thread ranks take
+ * over the MPI names below. Collectives go over their own communicator and
+ * the messages between ranks over another one, every call holds the mutex. */
+namespace process {
+
+struct pending_send
+{
+    MPI_Request request;
+    std::vector<char> data;
+};
+
+struct context
+{
+    pthread_mutex_t mutex;
+    MPI_Comm collectives, messages;
+    std::list<pending_send*> sends;
+
+    context() { pthread_mutex_init(&mutex, 0); }
+};
+
+inline context& get()
+{
+    static context c;
+    return c;
+}
+
+inline void finalize_at_exit() { MPI_Finalize(); }
+
+// starts MPI unless the program did, then it is finalized at exit, every process has to run the same number of threads
+inline bool init(int *argc, char ***argv, int threads, int &processes, int &process)
+{
+    context &c = get();
+    int initialized, provided;
+    MPI_Initialized(&initialized);
+    if (!initialized) { MPI_Init_thread(argc, argv, MPI_THREAD_SERIALIZED, &provided);  std::atexit(finalize_at_exit); }
+    else MPI_Query_thread(&provided);
+
+    MPI_Comm_size(MPI_COMM_WORLD, &processes);  MPI_Comm_rank(MPI_COMM_WORLD, &process);
+    int fewest, most;
+    MPI_Allreduce(&threads, &fewest, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(&threads, &most, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    if ((provided < MPI_THREAD_SERIALIZED) || (fewest != most))
+    {
+      if (process == 0)
+      {
+        if (provided < MPI_THREAD_SERIALIZED) std::cout << "MPI does not support MPI_THREAD_SERIALIZED" << std::endl;
+        else std::cout << "Every process has to run the same number of ranks" << std::endl;
+      }
+      return false;
+    }
+    MPI_Comm_dup(MPI_COMM_WORLD, &c.collectives);  MPI_Comm_dup(MPI_COMM_WORLD, &c.messages);
+    return true;
+}
+
+// completes the sends still under way
+inline void finalize()
+{
+    context &c = get();
+    for (std::list<pending_send*>::iterator i=c.sends.begin(); i!=c.sends.end(); i++)
+    {
+      MPI_Wait(&(*i)->request, MPI_STATUS_IGNORE);
+      delete *i;
+    }
+    c.sends.clear();
+    MPI_Barrier(c.collectives);
+    MPI_Comm_free(&c.collectives);  MPI_Comm_free(&c.messages);
+}
+
+inline void barrier()
+{
+    context &c = get();
+    pthread_mutex_lock(&c.mutex);
+    MPI_Barrier(c.collectives);
+    pthread_mutex_unlock(&c.mutex);
+}
+
+// sends send[q] to every process q and receives what each process sent here
+inline void alltoall(const std::vector<std::vector<char> > &send, std::vector<std::vector<char> > &received)
+{
+    context &c = get();
+    const int processes = send.size();
+    std::vector<int> sendCounts(processes), sendDispls(processes, 0), recvCounts(processes), recvDispls(processes, 0);
+    std::vector<char> sendBuffer;
+    for (int q=0; q<processes; q++)
+    {
+      sendCounts[q] = send[q].size();  sendDispls[q] = sendBuffer.size();
+      sendBuffer.insert(sendBuffer.end(), send[q].begin(), send[q].end());
+    }
+    pthread_mutex_lock(&c.mutex);
+    MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &recvCounts[0], 1, MPI_INT, c.collectives);
+    for (int q=1; q<processes; q++) recvDispls[q] = recvDispls[q-1] + recvCounts[q-1];
+    std::vector<char> recvBuffer(recvDispls[processes-1] + recvCounts[processes-1]);
+    MPI_Alltoallv(sendBuffer.empty() ? 0 : &sendBuffer[0], &sendCounts[0], &sendDispls[0], MPI_BYTE,
+                  recvBuffer.empty() ? 0 : &recvBuffer[0], &recvCounts[0], &recvDispls[0], MPI_BYTE, c.collectives);
+    pthread_mutex_unlock(&c.mutex);
+
+    received.resize(processes);
+    for (int q=0; q<processes; q++) received[q].assign(recvBuffer.begin() + recvDispls[q], recvBuffer.begin() + recvDispls[q] + recvCounts[q]);
+}
+
+// gathers bytes from every process into all without waiting, completed by test
+inline void* start_allgather(const void *data, int bytes, void *all)
+{
+    context &c = get();
+    MPI_Request *request = new MPI_Request();
+    pthread_mutex_lock(&c.mutex);
+    MPI_Iallgather((void *) data, bytes, MPI_BYTE, all, bytes, MPI_BYTE, c.collectives, request);
+    pthread_mutex_unlock(&c.mutex);
+    return request;
+}
+
+// whether the allgather is done, the handle is reset once it is
+inline bool test(void *&handle)
+{
+    context &c = get();
+    int done;
+    pthread_mutex_lock(&c.mutex);
+    MPI_Test((MPI_Request *) handle, &done, MPI_STATUS_IGNORE);
+    pthread_mutex_unlock(&c.mutex);
+    if (done) { delete (MPI_Request *) handle;  handle = 0; }
+    return done;
+}
+
+// sends the message to a process, the data is taken over and kept until the send completes
+inline void send(std::vector<char> &data, int process)
+{
+    context &c = get();
+    pending_send *p = new pending_send();
+    p->data.swap(data);
+    pthread_mutex_lock(&c.mutex);
+    MPI_Isend(p->data.empty() ? 0 : &p->data[0], p->data.size(), MPI_BYTE, process, 0, c.messages, &p->request);
+    c.sends.push_back(p);
+    pthread_mutex_unlock(&c.mutex);
+}
+
+// retires the completed sends and receives the messages that arrived
+inline void progress(std::vector<std::vector<char> > &arrived)
+{
+    context &c = get();
+    pthread_mutex_lock(&c.mutex);
+    for (std::list<pending_send*>::iterator i=c.sends.begin(); i!=c.sends.end(); )
+    {
+      int done;
+      MPI_Test(&(*i)->request, &done, MPI_STATUS_IGNORE);
+      if (done) { delete *i;  i = c.sends.erase(i); }
+      else i++;
+    }
+    for (;;)
+    {
+      int found, bytes;
+      MPI_Status status;
+      MPI_Iprobe(MPI_ANY_SOURCE, 0, c.messages, &found, &status);
+      if (!found) break;
+      MPI_Get_count(&status, MPI_BYTE, &bytes);
+      arrived.push_back(std::vector<char>(bytes));
+      MPI_Recv(arrived.back().empty() ? 0 : &arrived.back()[0], bytes, MPI_BYTE, status.MPI_SOURCE, 0, c.messages, MPI_STATUS_IGNORE);
+    }
+    pthread_mutex_unlock(&c.mutex);
+}
+
+inline void abort(int errorcode) { MPI_Abort(MPI_COMM_WORLD, errorcode); }
+
+} // namespace process
+} // namespace thread_mpi
+} // namespace piston
+
+// from here on the MPI names are the ones of the thread ranks
+#undef MPI_SUCCESS
+#undef MPI_ERR_OTHER
+#undef MPI_ERR_FILE
+#undef MPI_COMM_WORLD
+#undef MPI_PROC_NULL
+#undef MPI_ANY_SOURCE
+#undef MPI_ANY_TAG
+#undef MPI_IN_PLACE
+#undef MPI_STATUS_IGNORE
+#undef MPI_STATUSES_IGNORE
+#undef MPI_REQUEST_NULL
+#undef MPI_INFO_NULL
+#undef MPI_ORDER_C
+#undef MPI_ORDER_FORTRAN
+#undef MPI_MODE_CREATE
+#undef MPI_MODE_RDONLY
+#undef MPI_MODE_WRONLY
+#undef MPI_MODE_RDWR
+#undef MPI_DATATYPE_NULL
+#undef MPI_CHAR
+#undef MPI_BYTE
+#undef MPI_INT
+#undef MPI_UNSIGNED
+#undef MPI_LONG
+#undef MPI_LONG_LONG
+#undef MPI_FLOAT
+#undef MPI_DOUBLE
+#undef MPI_OP_NULL
+#undef MPI_SUM
+#undef MPI_PROD
+#undef MPI_MAX
+#undef MPI_MIN
+
+#define MPI_Comm		thread_MPI_Comm
+#define MPI_Datatype		thread_MPI_Datatype
+#define MPI_Op			thread_MPI_Op
+#define MPI_Info		thread_MPI_Info
+#define MPI_Aint		thread_MPI_Aint
+#define MPI_Offset		thread_MPI_Offset
+#define MPI_Request		thread_MPI_Request
+#define MPI_File		thread_MPI_File
+#define MPI_Status		thread_MPI_Status
+#define MPI_User_function	thread_MPI_User_function
+
+#define MPI_Init		thread_MPI_Init
+#define MPI_Finalize		thread_MPI_Finalize
+#define MPI_Comm_rank		thread_MPI_Comm_rank
+#define MPI_Comm_size		thread_MPI_Comm_size
+#define MPI_Abort		thread_MPI_Abort
+#define MPI_Barrier		thread_MPI_Barrier
+#define MPI_Type_contiguous	thread_MPI_Type_contiguous
+#define MPI_Type_create_subarray thread_MPI_Type_create_subarray
+#define MPI_Type_commit		thread_MPI_Type_commit
+#define MPI_Type_free		thread_MPI_Type_free
+#define MPI_Type_size		thread_MPI_Type_size
+#define MPI_Op_create		thread_MPI_Op_create
+#define MPI_Op_free		thread_MPI_Op_free
+#define MPI_Dims_create		thread_MPI_Dims_create
+#define MPI_Isend		thread_MPI_Isend
+#define MPI_Irecv		thread_MPI_Irecv
+#define MPI_Wait		thread_MPI_Wait
+#define MPI_Waitall		thread_MPI_Waitall
+#define MPI_Send		thread_MPI_Send
+#define MPI_Recv		thread_MPI_Recv
+#define MPI_Sendrecv		thread_MPI_Sendrecv
+#define MPI_Allreduce		thread_MPI_Allreduce
+#define MPI_Exscan		thread_MPI_Exscan
+#define MPI_Reduce		thread_MPI_Reduce
+#define MPI_Bcast		thread_MPI_Bcast
+#define MPI_Iallreduce		thread_MPI_Iallreduce
+#define MPI_Iexscan		thread_MPI_Iexscan
+#define MPI_Gatherv		thread_MPI_Gatherv
+#define MPI_Gather		thread_MPI_Gather
+#define MPI_Scatter		thread_MPI_Scatter
+#define MPI_Allgatherv		thread_MPI_Allgatherv
+#define MPI_Allgather		thread_MPI_Allgather
+#define MPI_Alltoallv		thread_MPI_Alltoallv
+#define MPI_Alltoall		thread_MPI_Alltoall
+#define MPI_File_open		thread_MPI_File_open
+#define MPI_File_close		thread_MPI_File_close
+#define MPI_File_get_size	thread_MPI_File_get_size
+#define MPI_File_set_size	thread_MPI_File_set_size
+#define MPI_File_set_view	thread_MPI_File_set_view
+#define MPI_File_read_all	thread_MPI_File_read_all
+#define MPI_File_write_at	thread_MPI_File_write_at
+#define MPI_File_write_at_all	thread_MPI_File_write_at_all
+#define MPI_File_read_at_all	thread_MPI_File_read_at_all
+
+#else
+
+namespace piston {
+namespace thread_mpi {
+
+// a single process, without MPI
+namespace process {
+
+inline bool init(int*, char***, int, int &processes, int &process) { processes = 1;  process = 0;  return true; }
+inline void finalize() {}
+inline void barrier() {}
+inline void alltoall(const std::vector<std::vector<char> > &send, std::vector<std::vector<char> > &received) { received = send; }
+inline void* start_allgather(const void*, int, void*) { return 0; }
+inline bool test(void *&handle) { handle = 0;  return true; }
+inline void send(std::vector<char>&, int) {}
+inline void progress(std::vector<std::vector<char> >&) {}
+inline void abort(int errorcode) { std::exit(errorcode); }
+
+} // namespace process
+} // namespace thread_mpi
+} // namespace piston
+
+#endif
+
+#define PISTON_THREAD_LOCAL __thread
+
+namespace piston { namespace thread_mpi { struct request; struct file; } }
+
+typedef int MPI_Comm;
+typedef int MPI_Datatype;
+typedef int MPI_Op;
+typedef int MPI_Info;
+typedef long MPI_Aint;
+typedef long long MPI_Offset;
+typedef piston::thread_mpi::request* MPI_Request;
+typedef piston::thread_mpi::file* MPI_File;
+typedef struct { int MPI_SOURCE, MPI_TAG, MPI_ERROR; } MPI_Status;
+typedef void (MPI_User_function)(void*, void*, int*, MPI_Datatype*);
+
+#define MPI_SUCCESS		0
+#define MPI_ERR_OTHER		15
+#define MPI_ERR_FILE		27
+
+#define MPI_COMM_WORLD		0
+#define MPI_PROC_NULL		(-2)
+#define MPI_ANY_SOURCE		(-1)
+#define MPI_ANY_TAG		(-1)
+#define MPI_IN_PLACE		((void *) 1)
+#define MPI_STATUS_IGNORE	((MPI_Status *) 0)
+#define MPI_STATUSES_IGNORE	((MPI_Status *) 0)
+#define MPI_REQUEST_NULL	((MPI_Request) 0)
+#define MPI_INFO_NULL		0
+
+#define MPI_ORDER_C		56
+#define MPI_ORDER_FORTRAN	57
+
+#define MPI_MODE_CREATE		1
+#define MPI_MODE_RDONLY		2
+#define MPI_MODE_WRONLY		4
+#define MPI_MODE_RDWR		8
+
+#define MPI_DATATYPE_NULL	(-1)
+#define MPI_CHAR		0
+#define MPI_BYTE		1
+#define MPI_INT			2
+#define MPI_UNSIGNED		3
+#define MPI_LONG		4
+#define MPI_LONG_LONG		5
+#define MPI_FLOAT		6
+#define MPI_DOUBLE		7
+
+#define MPI_OP_NULL		0
+#define MPI_SUM			1
+#define MPI_PROD		2
+#define MPI_MAX			3
+#define MPI_MIN			4
+
+namespace piston {
+namespace thread_mpi {
+
+// a list of (offset, bytes) blocks repeated every extent bytes
+struct datatype
+{
+    long size, extent;
+    int basic;		// the predefined type the blocks consist of
+    bool used;
+    std::vector<std::pair<long, long> > blocks;
+
+    bool contiguous() const { return (blocks.size() == 1) && (blocks[0].first == 0) && (blocks[0].second == extent); }
+};
+
+// a send waiting for its receive
+struct message
+{
+    const void *buf;
+    int count;
+    MPI_Datatype type;
+    int source, tag;
+    bool done;
+    bool detached;		// a blocking send, the receiver deletes the message
+    std::vector<char> copy;	// its data
+};
+
+// the send data of a started nonblocking collective, one copy per rank of this process
+struct pending_collective
+{
+    int started, completed;
+    std::vector<std::vector<char> > data;
+    bool posted;		// the totals of the processes are being gathered
+    void *exchange;		// the gather while it is under way
+    std::vector<char> total, totals;	// the data of this process and of all processes combined
+};
+
+struct request
+{
+    message *send;
+    pending_collective *collective;
+    long sequence;
+    MPI_Op op;
+    bool prefix;		// an exscan, else an allreduce
+    void *buf;
+    int count;
+    MPI_Datatype type;
+    int source, tag;
+};
+
+struct file
+{
+    int fd;
+    MPI_Offset disp, position;
+    MPI_Datatype etype, filetype;
+};
+
+// the send side of a collective as seen by the other ranks
+struct collective_slot
+{
+    const void *buf;
+    int count;
+    MPI_Datatype type;
+    const int *counts, *displs;
+};
+
+struct state
+{
+    int size;			// the ranks of this process
+    int processes, process;
+    pthread_mutex_t mutex;
+    pthread_cond_t barrierCond, messageCond;
+    int barrierCount, barrierGeneration;
+    std::vector<datatype*> types;
+    std::vector<MPI_User_function*> ops;
+    std::vector<collective_slot> slots;
+    std::vector<std::list<message*> > mailboxes;
+    std::vector<long> collectivesStarted;	// the nonblocking collectives started by each rank
+    std::map<long, pending_collective*> collectives;
+    std::vector<std::vector<char> > received;	// what the other processes sent for the current collective
+
+    state() : size(1), processes(1), process(0), barrierCount(0), barrierGeneration(0), slots(1), mailboxes(1), collectivesStarted(1, 0)
+    {
+      pthread_mutex_init(&mutex, 0);
+      pthread_cond_init(&barrierCond, 0);  pthread_cond_init(&messageCond, 0);
+      const long sizes[] = { sizeof(char), 1, sizeof(int), sizeof(unsigned int), sizeof(long), sizeof(long long), sizeof(float), sizeof(double) };
+      for (int t=0; t<8; t++)
+      {
+        datatype *d = new datatype();
+        d->size = d->extent = sizes[t];  d->basic = t;  d->used = true;
+        d->blocks.push_back(std::make_pair(0L, sizes[t]));
+        types.push_back(d);
+      }
+      ops.resize(MPI_MIN+1, 0);
+    }
+};
+
+inline state& shared()
+{
+    static state s;
+    return s;
+}
+
+inline int& rank()
+{
+    static __thread int r = 0;
+    return r;
+}
+
+inline void barrier()
+{
+    state &s = shared();
+    if (s.size == 1) return;
+    pthread_mutex_lock(&s.mutex);
+    int generation = s.barrierGeneration;
+    if (++s.barrierCount == s.size)
+    {
+      s.barrierCount = 0;  s.barrierGeneration++;
+      pthread_cond_broadcast(&s.barrierCond);
+    }
+    else while (generation == s.barrierGeneration) pthread_cond_wait(&s.barrierCond, &s.mutex);
+    pthread_mutex_unlock(&s.mutex);
+}
+
+inline int world_rank() { return shared().process*shared().size + rank(); }
+
+inline int world_size() { return shared().processes*shared().size; }
+
+inline void world_barrier()
+{
+    barrier();
+    if (shared().processes == 1) return;
+    if (rank() == 0) process::barrier();
+    barrier();
+}
+
+inline const datatype& type(MPI_Datatype t)
+{
+    state &s = shared();
+    pthread_mutex_lock(&s.mutex);
+    const datatype *d = s.types[t];
+    pthread_mutex_unlock(&s.mutex);
+    return *d;
+}
+
+inline MPI_Datatype add_type(datatype *d)
+{
+    state &s = shared();
+    pthread_mutex_lock(&s.mutex);
+    MPI_Datatype t = s.types.size();
+    for (unsigned int i=MPI_DOUBLE+1; i<s.types.size(); i++) if (!s.types[i]->used) { delete s.types[i];  t = i;  break; }
+    if (t == (MPI_Datatype) s.types.size()) s.types.push_back(d); else s.types[t] = d;
+    pthread_mutex_unlock(&s.mutex);
+    return t;
+}
+
+// walks the bytes of count elements of a datatype as contiguous runs of offsets
+struct cursor
+{
+    const std::vector<std::pair<long, long> > *blocks;
+    std::vector<std::pair<long, long> > whole;
+    long extent, element, inBlock, remaining;
+    unsigned int block;
+
+    cursor(const datatype &t, long count, long skip = 0) : element(0), inBlock(0), remaining(count*t.size - skip), block(0)
+    {
+      extent = t.extent;  blocks = &t.blocks;
+      if (t.contiguous()) { whole.push_back(std::make_pair(0L, count*t.size));  blocks = &whole;  inBlock = skip; }
+      else if (t.size > 0)
+      {
+        element = skip / t.size;  skip -= element*t.size;
+        while ((*blocks)[block].second <= skip) skip -= (*blocks)[block++].second;
+        inBlock = skip;
+      }
+    }
+
+    long offset() const { return element*extent + (*blocks)[block].first + inBlock; }
+    long available() const { return std::min(remaining, (*blocks)[block].second - inBlock); }
+
+    void advance(long n)
+    {
+      inBlock += n;  remaining -= n;
+      while ((remaining > 0) && (inBlock == (*blocks)[block].second))
+      {
+        inBlock = 0;
+        if (++block == blocks->size()) { block = 0;  element++; }
+      }
+    }
+};
+
+// copies the data of the source elements into the destination elements, as far as both go
+inline void copy(const void *src, int srcCount, MPI_Datatype srcType, void *dst, int dstCount, MPI_Datatype dstType)
+{
+    cursor s(type(srcType), srcCount), d(type(dstType), dstCount);
+    while ((s.remaining > 0) && (d.remaining > 0))
+    {
+      long n = std::min(s.available(), d.available());
+      std::memcpy((char *) dst + d.offset(), (const char *) src + s.offset(), n);
+      s.advance(n);  d.advance(n);
+    }
+}
+
+template <typename T>
+void apply_op(MPI_Op op, const T *in, T *inout, long n)
+{
+    for (long i=0; i<n; i++)
+    {
+      switch (op)
+      {
+        case MPI_SUM: inout[i] = in[i] + inout[i];  break;
+        case MPI_PROD: inout[i] = in[i] * inout[i];  break;
+        case MPI_MAX: inout[i] = std::max(in[i], inout[i]);  break;
+        case MPI_MIN: inout[i] = std::min(in[i], inout[i]);  break;
+      }
+    }
+}
+
+// inout = in op inout for count contiguous elements
+inline void apply_op(MPI_Op op, const void *in, void *inout, int count, MPI_Datatype t)
+{
+    state &s = shared();
+    if (op > MPI_MIN)
+    {
+      pthread_mutex_lock(&s.mutex);
+      MPI_User_function *function = s.ops[op];
+      pthread_mutex_unlock(&s.mutex);
+      function((void *) in, inout, &count, &t);
+      return;
+    }
+    const datatype &d = type(t);
+    const long n = count*d.size / type(d.basic).size;
+    switch (d.basic)
+    {
+      case MPI_CHAR: case MPI_BYTE: apply_op(op, (const signed char *) in, (signed char *) inout, n);  break;
+      case MPI_INT: apply_op(op, (const int *) in, (int *) inout, n);  break;
+      case MPI_UNSIGNED: apply_op(op, (const unsigned int *) in, (unsigned int *) inout, n);  break;
+      case MPI_LONG: apply_op(op, (const long *) in, (long *) inout, n);  break;
+      case MPI_LONG_LONG: apply_op(op, (const long long *) in, (long long *) inout, n);  break;
+      case MPI_FLOAT: apply_op(op, (const float *) in, (float *) inout, n);  break;
+      case MPI_DOUBLE: apply_op(op, (const double *) in, (double *) inout, n);  break;
+    }
+}
+
+// makes the send side of this rank visible to the others, followed by the reads of a collective and finish()
+inline void publish(const void *buf, int count, MPI_Datatype t, const int *counts = 0, const int *displs = 0)
+{
+    collective_slot &slot = shared().slots[rank()];
+    slot.buf = buf;  slot.count = count;  slot.type = t;  slot.counts = counts;  slot.displs = displs;
+    barrier();
+}
+
+inline void finish() { barrier(); }
+
+inline const collective_slot& slot(int r) { return shared().slots[r]; }
+
+inline const char* element(const void *buf, long index, MPI_Datatype t) { return (const char *) buf + index*type(t).extent; }
+
+// the buffers of ranks 0 .. buffers.size()-1 combined in rank order
+inline void combine(const std::vector<const void*> &buffers, int count, MPI_Datatype t, MPI_Op op, std::vector<char> &result)
+{
+    const long bytes = count*type(t).extent;
+    result.assign((const char *) buffers[0], (const char *) buffers[0] + bytes);
+    std::vector<char> operand;
+    for (unsigned int r=1; r<buffers.size(); r++)
+    {
+      if (op <= MPI_MIN) { apply_op(op, buffers[r], &result[0], count, t);  continue; }
+      operand.assign((const char *) buffers[r], (const char *) buffers[r] + bytes);
+      apply_op(op, &result[0], &operand[0], count, t);
+      result.swap(operand);
+    }
+}
+
+// the published buffers of ranks 0 .. last-1 combined in rank order
+inline void combine(int last, int count, MPI_Datatype t, MPI_Op op, std::vector<char> &result)
+{
+    std::vector<const void*> buffers(last);
+    for (int r=0; r<last; r++) buffers[r] = slot(r).buf;
+    combine(buffers, count, t, op, result);
+}
+
+inline const char* data(const std::vector<char> &bytes) { return bytes.empty() ? 0 : &bytes[0]; }
+
+// appends the data of count elements as contiguous bytes
+inline void pack(const void *buf, int count, MPI_Datatype t, std::vector<char> &bytes)
+{
+    const long start = bytes.size(), n = count*type(t).size;
+    bytes.resize(start + n);
+    if (n > 0) copy(buf, count, t, &bytes[start], n, MPI_BYTE);
+}
+
+// thread 0 sends send[q] to every other process q, all ranks read what arrived in received after
+inline void exchange_processes(const std::vector<std::vector<char> > &send)
+{
+    state &s = shared();
+    if (s.processes == 1) return;
+    if (rank() == 0) process::alltoall(send, s.received);
+    barrier();
+}
+
+// the published buffers of all ranks of this process combined, sent to the other processes
+inline void exchange_totals(int count, MPI_Datatype t, MPI_Op op)
+{
+    state &s = shared();
+    if (s.processes == 1) return;
+    std::vector<std::vector<char> > send(s.processes);
+    if ((rank() == 0) && (count > 0))
+    {
+      std::vector<char> total;
+      combine(s.size, count, t, op, total);
+      for (int q=0; q<s.processes; q++) if (q != s.process) send[q] = total;
+    }
+    exchange_processes(send);
+}
+
+/* The buffers of the ranks before last in rank order, the ranks of this
+ * process with their own buffers and the other processes, which are either
+ * wholly before last or not at all, with the totals of all their ranks. */
+inline std::vector<const void*> world_buffers(int last, const std::vector<const void*> &local, const std::vector<const void*> &totals)
+{
+    state &s = shared();
+    std::vector<const void*> buffers;
+    for (int q=0; q<s.processes; q++)
+    {
+      if (q != s.process) { if ((q+1)*s.size <= last) buffers.push_back(totals[q]);  continue; }
+      for (int r=0; (r < s.size) && (q*s.size + r < last); r++) buffers.push_back(local[r]);
+    }
+    return buffers;
+}
+
+// the published buffers of the ranks before last combined in rank order, after exchange_totals
+inline void combine_world(int last, int count, MPI_Datatype t, MPI_Op op, std::vector<char> &result)
+{
+    state &s = shared();
+    std::vector<const void*> local(s.size), totals(s.processes);
+    for (int r=0; r<s.size; r++) local[r] = slot(r).buf;
+    for (int q=0; q<s.processes; q++) totals[q] = (q == s.process) ? 0 : data(s.received[q]);
+    std::vector<const void*> buffers = world_buffers(last, local, totals);
+    if ((count > 0) && !buffers.empty()) combine(buffers, count, t, op, result);
+}
+
+// the messages from ranks in other processes go into the mailboxes of their ranks here
+inline void receive_messages()
+{
+    std::vector<std::vector<char> > arrived;
+    process::progress(arrived);
+    if (arrived.empty()) return;
+    state &s = shared();
+    pthread_mutex_lock(&s.mutex);
+    for (unsigned int i=0; i<arrived.size(); i++)
+    {
+      int envelope[3];		// source, tag and rank in this process
+      std::memcpy(envelope, &arrived[i][0], sizeof(envelope));
+      message *m = new message();
+      m->copy.assign(arrived[i].begin() + sizeof(envelope), arrived[i].end());
+      m->buf = data(m->copy);  m->count = m->copy.size();  m->type = MPI_BYTE;
+      m->source = envelope[0];  m->tag = envelope[1];  m->done = false;  m->detached = true;
+      s.mailboxes[envelope[2]].push_back(m);
+    }
+    pthread_cond_broadcast(&s.messageCond);
+    pthread_mutex_unlock(&s.mutex);
+}
+
+// waits for the other ranks with the mutex held, with several processes it also polls for their messages
+inline void idle(state &s)
+{
+    if (s.processes == 1) { pthread_cond_wait(&s.messageCond, &s.mutex);  return; }
+    pthread_mutex_unlock(&s.mutex);
+    receive_messages();
+    pthread_mutex_lock(&s.mutex);
+    timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += 100000;
+    if (until.tv_nsec >= 1000000000) { until.tv_sec++;  until.tv_nsec -= 1000000000; }
+    pthread_cond_timedwait(&s.messageCond, &s.mutex, &until);
+}
+
+/* Starts an allreduce, or an exscan if prefix, without waiting for the
+ * other ranks. The n-th nonblocking collective of every rank belongs to
+ * the same operation, its send data is copied so the ranks that complete
+ * it later read a buffer that stays valid. The last rank of a process to
+ * start it gathers the combined data of the process from all processes. */
+inline request* start_collective(const void *buf, int count, MPI_Datatype t, MPI_Op op, bool prefix, void *recvbuf)
+{
+    state &s = shared();
+    const long bytes = count*type(t).extent;
+    request *r = new request();
+    r->op = op;  r->prefix = prefix;  r->buf = recvbuf;  r->count = count;  r->type = t;
+    pthread_mutex_lock(&s.mutex);
+    r->sequence = s.collectivesStarted[rank()]++;
+    pending_collective *&c = s.collectives[r->sequence];
+    if (!c) { c = new pending_collective();  c->started = c->completed = 0;  c->data.resize(s.size);  c->posted = false;  c->exchange = 0; }
+    c->data[rank()].assign((const char *) buf, (const char *) buf + bytes);
+    const bool last = (++c->started == s.size);
+    r->collective = c;
+    pthread_cond_broadcast(&s.messageCond);
+    pthread_mutex_unlock(&s.mutex);
+
+    // the data of all ranks here stays as it is, and the next collective can not be posted before this one
+    if (last && (s.processes > 1))
+    {
+      std::vector<const void*> buffers(s.size);
+      for (int i=0; i<s.size; i++) buffers[i] = data(c->data[i]);
+      if (count > 0) combine(buffers, count, t, op, c->total);
+      c->total.resize(bytes);  c->totals.resize(bytes*s.processes);
+      void *exchange = process::start_allgather(data(c->total), bytes, c->totals.empty() ? 0 : &c->totals[0]);
+      pthread_mutex_lock(&s.mutex);
+      c->exchange = exchange;  c->posted = true;
+      pthread_cond_broadcast(&s.messageCond);
+      pthread_mutex_unlock(&s.mutex);
+    }
+    return r;
+}
+
+// waits for the send data of all ranks and combines it into the receive buffer
+inline void complete_collective(request *r)
+{
+    state &s = shared();
+    pending_collective *c = r->collective;
+    pthread_mutex_lock(&s.mutex);
+    while ((c->started < s.size) || ((s.processes > 1) && (!c->posted || (c->exchange && !process::test(c->exchange))))) idle(s);
+    pthread_mutex_unlock(&s.mutex);
+
+    // the result of an exscan is undefined on rank 0, it is left untouched
+    const int last = r->prefix ? world_rank() : world_size();
+    const long bytes = r->count*type(r->type).extent;
+    std::vector<const void*> local(s.size), totals(s.processes, (const void *) 0);
+    for (int i=0; i<s.size; i++) local[i] = data(c->data[i]);
+    if (s.processes > 1) for (int q=0; q<s.processes; q++) totals[q] = data(c->totals) + q*bytes;
+    std::vector<const void*> buffers = world_buffers(last, local, totals);
+    if (!buffers.empty())
+    {
+      std::vector<char> result;
+      if (r->count > 0) combine(buffers, r->count, r->type, r->op, result);
+      if (!result.empty()) std::memcpy(r->buf, &result[0], result.size());
+    }
+
+    pthread_mutex_lock(&s.mutex);
+    if (++c->completed == s.size) { s.collectives.erase(r->sequence);  delete c; }
+    pthread_mutex_unlock(&s.mutex);
+}
+
+inline int wait(MPI_Request *req, MPI_Status *status)
+{
+    request *r = *req;
+    if (r == 0) return MPI_SUCCESS;
+    state &s = shared();
+    if (r->collective) complete_collective(r);
+    else if (r->send)
+    {
+      pthread_mutex_lock(&s.mutex);
+      while (!r->send->done) idle(s);
+      pthread_mutex_unlock(&s.mutex);
+      delete r->send;
+    }
+    else
+    {
+      std::list<message*> &mailbox = s.mailboxes[rank()];
+      message *m = 0;
+      pthread_mutex_lock(&s.mutex);
+      while (!m)
+      {
+        for (std::list<message*>::iterator i=mailbox.begin(); i!=mailbox.end(); i++)
+        {
+          if (((r->source == MPI_ANY_SOURCE) || (r->source == (*i)->source)) && ((r->tag == MPI_ANY_TAG) || (r->tag == (*i)->tag)))
+          {
+            m = *i;  mailbox.erase(i);  break;
+          }
+        }
+        if (!m) idle(s);
+      }
+      pthread_mutex_unlock(&s.mutex);
+
+      copy(m->buf, m->count, m->type, r->buf, r->count, r->type);
+      if (status) { status->MPI_SOURCE = m->source;  status->MPI_TAG = m->tag;  status->MPI_ERROR = MPI_SUCCESS; }
+
+      if (m->detached) delete m;
+      else
+      {
+        pthread_mutex_lock(&s.mutex);
+        m->done = true;
+        pthread_cond_broadcast(&s.messageCond);
+        pthread_mutex_unlock(&s.mutex);
+      }
+    }
+    delete r;
+    *req = MPI_REQUEST_NULL;
+    return MPI_SUCCESS;
+}
+
+// sends to a rank of another process, the data is copied so the send is complete
+inline void post_remote(const void *buf, int count, MPI_Datatype t, int dest, int tag)
+{
+    state &s = shared();
+    const int envelope[3] = { world_rank(), tag, dest % s.size };
+    std::vector<char> bytes((const char *) envelope, (const char *) envelope + sizeof(envelope));
+    pack(buf, count, t, bytes);
+    process::send(bytes, dest / s.size);
+}
+
+// dest is a rank of this process, counted in MPI_COMM_WORLD
+inline message* post(const void *buf, int count, MPI_Datatype t, int dest, int tag, bool detached = false)
+{
+    state &s = shared();
+    message *m = new message();
+    if (detached)
+    {
+      // the data is copied so the sender can go on
+      m->copy.resize(count*type(t).size);
+      if (!m->copy.empty()) copy(buf, count, t, &m->copy[0], m->copy.size(), MPI_BYTE);
+      buf = m->copy.empty() ? 0 : &m->copy[0];  count = m->copy.size();  t = MPI_BYTE;
+    }
+    m->buf = buf;  m->count = count;  m->type = t;  m->source = world_rank();  m->tag = tag;  m->done = false;  m->detached = detached;
+    pthread_mutex_lock(&s.mutex);
+    s.mailboxes[dest - s.process*s.size].push_back(m);
+    pthread_cond_broadcast(&s.messageCond);
+    pthread_mutex_unlock(&s.mutex);
+    return m;
+}
+
+// moves through the view of a file, offset counted in bytes of data
+inline int transfer(file *f, MPI_Offset offset, void *buf, int count, MPI_Datatype t, bool write)
+{
+    const datatype &view = type(f->filetype);
+    cursor memory(type(t), count), disk(view, (offset + count*type(t).size) / std::max(view.size, 1L) + 1, offset);
+    while ((memory.remaining > 0) && (disk.remaining > 0))
+    {
+      long n = std::min(memory.available(), disk.available());
+      char *p = (char *) buf + memory.offset();
+      off_t position = f->disp + disk.offset();
+      for (long done = 0; done < n; )
+      {
+        ssize_t r = write ? pwrite(f->fd, p + done, n - done, position + done) : pread(f->fd, p + done, n - done, position + done);
+        if (r <= 0) return MPI_ERR_FILE;
+        done += r;
+      }
+      memory.advance(n);  disk.advance(n);
+    }
+    return MPI_SUCCESS;
+}
+
+struct rank_arguments
+{
+    int rank;
+    int (*rank_main)(int, char**);
+    int argc;
+    char **argv;
+    int result;
+};
+
+inline void* rank_thread(void *a)
+{
+    rank_arguments *arguments = (rank_arguments *) a;
+    rank() = arguments->rank;
+    arguments->result = arguments->rank_main(arguments->argc, arguments->argv);
+    return 0;
+}
+
+/* Runs rank_main(argc, argv) on numRanks threads as the ranks of
+ * MPI_COMM_WORLD and waits for them. Returns the first nonzero result, so
+ * a program written for MPI runs with thread_mpi::run(n, main_of_the_rank,
+ * argc, argv) from main. In a hybrid run every MPI process calls it with
+ * the same numRanks, and MPI is started unless the program did. */
+inline int run(int numRanks, int (*rank_main)(int, char**), int argc, char **argv)
+{
+    state &s = shared();
+    if (!process::init(&argc, &argv, numRanks, s.processes, s.process)) return 1;
+    s.size = numRanks;  s.slots.resize(numRanks);  s.mailboxes.resize(numRanks);  s.collectivesStarted.assign(numRanks, 0);
+
+    std::vector<rank_arguments> arguments(numRanks);
+    std::vector<pthread_t> threads(numRanks);
+    for (int r=0; r<numRanks; r++)
+    {
+      arguments[r].rank = r;  arguments[r].rank_main = rank_main;  arguments[r].argc = argc;  arguments[r].argv = argv;  arguments[r].result = 0;
+      pthread_create(&threads[r], 0, rank_thread, &arguments[r]);
+    }
+    int result = 0;
+    for (int r=0; r<numRanks; r++)
+    {
+      pthread_join(threads[r], 0);
+      if (!result) result = arguments[r].result;
+    }
+
+    process::finalize();
+    s.size = 1;  s.processes = 1;  s.process = 0;  s.slots.resize(1);  s.mailboxes.resize(1);  s.collectivesStarted.assign(1, 0);
+    return result;
+}
+
+} // namespace thread_mpi
+} // namespace piston
+
+
+inline int MPI_Init(int*, char***) { return MPI_SUCCESS; }
+inline int MPI_Finalize() { return MPI_SUCCESS; }
+inline int MPI_Comm_rank(MPI_Comm, int *rank) { *rank = piston::thread_mpi::world_rank();  return MPI_SUCCESS; }
+inline int MPI_Comm_size(MPI_Comm, int *size) { *size = piston::thread_mpi::world_size();  return MPI_SUCCESS; }
+
+inline int MPI_Abort(MPI_Comm, int errorcode)
+{
+    std::cerr << "MPI_Abort on rank " << piston::thread_mpi::world_rank() << std::endl;
+    piston::thread_mpi::process::abort(errorcode);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Barrier(MPI_Comm) { piston::thread_mpi::world_barrier();  return MPI_SUCCESS; }
+
+
+inline int MPI_Type_contiguous(int count, MPI_Datatype oldtype, MPI_Datatype *newtype)
+{
+    using namespace piston::thread_mpi;
+    const datatype &old = type(oldtype);
+    datatype *d = new datatype();
+    d->size = count*old.size;  d->extent = count*old.extent;  d->basic = old.basic;  d->used = true;
+    for (int i=0; i<count; i++)
+      for (unsigned int b=0; b<old.blocks.size(); b++)
+      {
+        std::pair<long, long> block(i*old.extent + old.blocks[b].first, old.blocks[b].second);
+        if (!d->blocks.empty() && (d->blocks.back().first + d->blocks.back().second == block.first)) d->blocks.back().second += block.second;
+        else d->blocks.push_back(block);
+      }
+    *newtype = add_type(d);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Type_create_subarray(int ndims, const int sizes[], const int subsizes[], const int starts[], int order,
+                                    MPI_Datatype oldtype, MPI_Datatype *newtype)
+{
+    using namespace piston::thread_mpi;
+    const datatype &old = type(oldtype);
+    std::vector<int> size(sizes, sizes+ndims), subsize(subsizes, subsizes+ndims), start(starts, starts+ndims);
+    if (order == MPI_ORDER_FORTRAN)
+    {
+      std::reverse(size.begin(), size.end());  std::reverse(subsize.begin(), subsize.end());  std::reverse(start.begin(), start.end());
+    }
+
+    datatype *d = new datatype();
+    d->basic = old.basic;  d->used = true;  d->size = old.size;  d->extent = old.extent;
+    for (int i=0; i<ndims; i++) { d->size *= subsize[i];  d->extent *= size[i]; }
+
+    // one block per row along the last, fastest dimension
+    const long rowBytes = subsize[ndims-1]*old.extent;
+    std::vector<int> index(ndims, 0);
+    if (d->size > 0)
+    {
+      for (;;)
+      {
+        long offset = 0;
+        for (int i=0; i<ndims; i++) offset = offset*size[i] + start[i] + index[i];
+        d->blocks.push_back(std::make_pair(offset*old.extent, rowBytes));
+        int i = ndims-2;
+        while ((i >= 0) && (++index[i] == subsize[i])) index[i--] = 0;
+        if (i < 0) break;
+      }
+    }
+    else d->blocks.push_back(std::make_pair(0L, 0L));
+    *newtype = add_type(d);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Type_commit(MPI_Datatype*) { return MPI_SUCCESS; }
+
+inline int MPI_Type_free(MPI_Datatype *t)
+{
+    using namespace piston::thread_mpi;
+    pthread_mutex_lock(&shared().mutex);
+    shared().types[*t]->used = false;
+    pthread_mutex_unlock(&shared().mutex);
+    *t = MPI_DATATYPE_NULL;
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Type_size(MPI_Datatype t, int *size) { *size = piston::thread_mpi::type(t).size;  return MPI_SUCCESS; }
+
+inline int MPI_Op_create(MPI_User_function *function, int, MPI_Op *op)
+{
+    using namespace piston::thread_mpi;
+    state &s = shared();
+    pthread_mutex_lock(&s.mutex);
+    *op = s.ops.size();
+    for (unsigned int i=MPI_MIN+1; i<s.ops.size(); i++) if (!s.ops[i]) { *op = i;  break; }
+    if (*op == (MPI_Op) s.ops.size()) s.ops.push_back(function); else s.ops[*op] = function;
+    pthread_mutex_unlock(&s.mutex);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Op_free(MPI_Op *op)
+{
+    using namespace piston::thread_mpi;
+    pthread_mutex_lock(&shared().mutex);
+    shared().ops[*op] = 0;
+    pthread_mutex_unlock(&shared().mutex);
+    *op = MPI_OP_NULL;
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Dims_create(int nnodes, int ndims, int dims[])
+{
+    // the prime factors, largest first, go to the free dimension with the smallest product
+    std::vector<int> free;
+    for (int i=0; i<ndims; i++) { if (dims[i] > 0) nnodes /= dims[i]; else { free.push_back(i);  dims[i] = 1; } }
+    if (free.empty()) return MPI_SUCCESS;
+    std::vector<int> primes;
+    for (int p=2; p*p<=nnodes; p++) while (nnodes % p == 0) { primes.push_back(p);  nnodes /= p; }
+    if (nnodes > 1) primes.push_back(nnodes);
+    std::vector<int> factors(free.size(), 1);
+    for (int i=primes.size()-1; i>=0; i--) *std::min_element(factors.begin(), factors.end()) *= primes[i];
+    std::sort(factors.begin(), factors.end(), std::greater<int>());
+    for (unsigned int i=0; i<free.size(); i++) dims[free[i]] = factors[i];
+    return MPI_SUCCESS;
+}
+
+
+inline int MPI_Isend(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm, MPI_Request *request)
+{
+    using namespace piston::thread_mpi;
+    *request = MPI_REQUEST_NULL;
+    if (dest == MPI_PROC_NULL) return MPI_SUCCESS;
+    if (dest / shared().size != shared().process) { post_remote(buf, count, datatype, dest, tag);  return MPI_SUCCESS; }
+    *request = new piston::thread_mpi::request();
+    (*request)->send = post(buf, count, datatype, dest, tag);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Irecv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm, MPI_Request *request)
+{
+    *request = MPI_REQUEST_NULL;
+    if (source == MPI_PROC_NULL) return MPI_SUCCESS;
+    *request = new piston::thread_mpi::request();
+    (*request)->send = 0;  (*request)->buf = buf;  (*request)->count = count;  (*request)->type = datatype;
+    (*request)->source = source;  (*request)->tag = tag;
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Wait(MPI_Request *request, MPI_Status *status) { return piston::thread_mpi::wait(request, status); }
+
+inline int MPI_Waitall(int count, MPI_Request requests[], MPI_Status statuses[])
+{
+    for (int i=0; i<count; i++) piston::thread_mpi::wait(&requests[i], statuses ? &statuses[i] : MPI_STATUS_IGNORE);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Send(const void *buf, int count, MPI_Datatype datatype, int dest, int tag, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    if (dest == MPI_PROC_NULL) return MPI_SUCCESS;
+    if (dest / shared().size != shared().process) post_remote(buf, count, datatype, dest, tag);
+    else post(buf, count, datatype, dest, tag, true);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Recv(void *buf, int count, MPI_Datatype datatype, int source, int tag, MPI_Comm comm, MPI_Status *status)
+{
+    MPI_Request request;
+    MPI_Irecv(buf, count, datatype, source, tag, comm, &request);
+    return MPI_Wait(&request, status);
+}
+
+inline int MPI_Sendrecv(const void *sendbuf, int sendcount, MPI_Datatype sendtype, int dest, int sendtag,
+                        void *recvbuf, int recvcount, MPI_Datatype recvtype, int source, int recvtag, MPI_Comm comm, MPI_Status *status)
+{
+    MPI_Request request;
+    MPI_Isend(sendbuf, sendcount, sendtype, dest, sendtag, comm, &request);
+    MPI_Recv(recvbuf, recvcount, recvtype, source, recvtag, comm, status);
+    return MPI_Wait(&request, MPI_STATUS_IGNORE);
+}
+
+
+inline int MPI_Allreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    publish((sendbuf == MPI_IN_PLACE) ? recvbuf : sendbuf, count, datatype);
+    exchange_totals(count, datatype, op);
+    std::vector<char> result;
+    combine_world(world_size(), count, datatype, op, result);
+    finish();
+    if (!result.empty()) std::memcpy(recvbuf, &result[0], result.size());
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Exscan(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    publish((sendbuf == MPI_IN_PLACE) ? recvbuf : sendbuf, count, datatype);
+    exchange_totals(count, datatype, op);
+    std::vector<char> result;
+    combine_world(world_rank(), count, datatype, op, result);
+    finish();
+    if (!result.empty()) std::memcpy(recvbuf, &result[0], result.size());
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Reduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, int root, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    publish((sendbuf == MPI_IN_PLACE) ? recvbuf : sendbuf, count, datatype);
+    exchange_totals(count, datatype, op);
+    std::vector<char> result;
+    if (world_rank() == root) combine_world(world_size(), count, datatype, op, result);
+    finish();
+    if (!result.empty()) std::memcpy(recvbuf, &result[0], result.size());
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Bcast(void *buffer, int count, MPI_Datatype datatype, int root, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    state &s = shared();
+    const int rootProcess = root / s.size;
+    publish(buffer, count, datatype);
+    std::vector<std::vector<char> > send(s.processes);
+    if ((rank() == 0) && (s.process == rootProcess))
+    {
+      pack(slot(root % s.size).buf, count, datatype, send[rootProcess]);
+      for (int q=0; q<s.processes; q++) if (q != rootProcess) send[q] = send[rootProcess];
+      send[rootProcess].clear();
+    }
+    exchange_processes(send);
+    if (world_rank() != root)
+    {
+      if (s.process == rootProcess) copy(slot(root % s.size).buf, count, datatype, buffer, count, datatype);
+      else copy(data(s.received[rootProcess]), s.received[rootProcess].size(), MPI_BYTE, buffer, count, datatype);
+    }
+    finish();
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Iallreduce(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm, MPI_Request *request)
+{
+    *request = piston::thread_mpi::start_collective((sendbuf == MPI_IN_PLACE) ? recvbuf : sendbuf, count, datatype, op, false, recvbuf);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Iexscan(const void *sendbuf, void *recvbuf, int count, MPI_Datatype datatype, MPI_Op op, MPI_Comm, MPI_Request *request)
+{
+    *request = piston::thread_mpi::start_collective((sendbuf == MPI_IN_PLACE) ? recvbuf : sendbuf, count, datatype, op, true, recvbuf);
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Gatherv(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                       void *recvbuf, const int recvcounts[], const int displs[], MPI_Datatype recvtype, int root, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    state &s = shared();
+    const int rootProcess = root / s.size;
+    publish(sendbuf, sendcount, sendtype);
+    std::vector<std::vector<char> > send(s.processes);
+    if ((rank() == 0) && (s.process != rootProcess))
+      for (int r=0; r<s.size; r++) pack(slot(r).buf, slot(r).count, slot(r).type, send[rootProcess]);
+    exchange_processes(send);
+    if (world_rank() == root)
+    {
+      // the data of another process holds its ranks one after the other
+      long offset = 0;
+      for (int w=0; w<world_size(); w++)
+      {
+        const int q = w / s.size, r = w % s.size;
+        char *out = (char *) recvbuf + displs[w]*type(recvtype).extent;
+        if (r == 0) offset = 0;
+        if (q == s.process) { if ((w != root) || (sendbuf != MPI_IN_PLACE)) copy(slot(r).buf, slot(r).count, slot(r).type, out, recvcounts[w], recvtype); }
+        else
+        {
+          const long bytes = recvcounts[w]*type(recvtype).size;
+          copy(data(s.received[q]) + offset, bytes, MPI_BYTE, out, recvcounts[w], recvtype);
+          offset += bytes;
+        }
+      }
+    }
+    finish();
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Gather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                      void *recvbuf, int recvcount, MPI_Datatype recvtype, int root, MPI_Comm comm)
+{
+    const int size = piston::thread_mpi::world_size();
+    std::vector<int> counts(size, recvcount), displs(size);
+    for (int r=0; r<size; r++) displs[r] = r*recvcount;
+    return MPI_Gatherv(sendbuf, sendcount, sendtype, recvbuf, &counts[0], &displs[0], recvtype, root, comm);
+}
+
+inline int MPI_Scatter(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                       void *recvbuf, int recvcount, MPI_Datatype recvtype, int root, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    state &s = shared();
+    const int rootProcess = root / s.size;
+    publish(sendbuf, sendcount, sendtype);
+    const collective_slot &rootSlot = slot(root % s.size);
+    std::vector<std::vector<char> > send(s.processes);
+    if ((rank() == 0) && (s.process == rootProcess))
+      for (int q=0; q<s.processes; q++)
+        if (q != rootProcess) pack(element(rootSlot.buf, (long) q*s.size*rootSlot.count, rootSlot.type), s.size*rootSlot.count, rootSlot.type, send[q]);
+    exchange_processes(send);
+    if ((world_rank() != root) || (recvbuf != MPI_IN_PLACE))
+    {
+      if (s.process == rootProcess) copy(element(rootSlot.buf, (long) world_rank()*rootSlot.count, rootSlot.type), rootSlot.count, rootSlot.type, recvbuf, recvcount, recvtype);
+      else
+      {
+        const long bytes = recvcount*type(recvtype).size;
+        copy(data(s.received[rootProcess]) + rank()*bytes, bytes, MPI_BYTE, recvbuf, recvcount, recvtype);
+      }
+    }
+    finish();
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Allgatherv(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                          void *recvbuf, const int recvcounts[], const int displs[], MPI_Datatype recvtype, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    state &s = shared();
+    if (sendbuf == MPI_IN_PLACE) publish(element(recvbuf, displs[world_rank()], recvtype), recvcounts[world_rank()], recvtype);
+    else publish(sendbuf, sendcount, sendtype);
+    std::vector<std::vector<char> > send(s.processes);
+    if ((rank() == 0) && (s.processes > 1))
+    {
+      std::vector<char> local;
+      for (int r=0; r<s.size; r++) pack(slot(r).buf, slot(r).count, slot(r).type, local);
+      for (int q=0; q<s.processes; q++) if (q != s.process) send[q] = local;
+    }
+    exchange_processes(send);
+    long offset = 0;
+    for (int w=0; w<world_size(); w++)
+    {
+      const int q = w / s.size, r = w % s.size;
+      char *out = (char *) recvbuf + displs[w]*type(recvtype).extent;
+      if (r == 0) offset = 0;
+      if (q == s.process) { if ((w != world_rank()) || (sendbuf != MPI_IN_PLACE)) copy(slot(r).buf, slot(r).count, slot(r).type, out, recvcounts[w], recvtype); }
+      else
+      {
+        const long bytes = recvcounts[w]*type(recvtype).size;
+        copy(data(s.received[q]) + offset, bytes, MPI_BYTE, out, recvcounts[w], recvtype);
+        offset += bytes;
+      }
+    }
+    finish();
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Allgather(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                         void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm)
+{
+    const int size = piston::thread_mpi::world_size();
+    std::vector<int> counts(size, recvcount), displs(size);
+    for (int r=0; r<size; r++) displs[r] = r*recvcount;
+    return MPI_Allgatherv(sendbuf, sendcount, sendtype, recvbuf, &counts[0], &displs[0], recvtype, comm);
+}
+
+inline int MPI_Alltoallv(const void *sendbuf, const int sendcounts[], const int sdispls[], MPI_Datatype sendtype,
+                         void *recvbuf, const int recvcounts[], const int rdispls[], MPI_Datatype recvtype, MPI_Comm)
+{
+    using namespace piston::thread_mpi;
+    state &s = shared();
+    publish(sendbuf, 0, sendtype, sendcounts, sdispls);
+
+    /* What this process sends to another process starts with the bytes from
+     * each rank here to each rank there, ordered by the receiving rank, and
+     * is followed by the data in the same order. */
+    std::vector<std::vector<char> > send(s.processes);
+    if (rank() == 0)
+      for (int q=0; q<s.processes; q++)
+      {
+        if (q == s.process) continue;
+        std::vector<long> bytes;
+        for (int u=0; u<s.size; u++)
+          for (int r=0; r<s.size; r++) bytes.push_back(slot(r).counts[q*s.size + u]*type(slot(r).type).size);
+        send[q].assign((const char *) &bytes[0], (const char *) &bytes[0] + bytes.size()*sizeof(long));
+        for (int u=0; u<s.size; u++)
+          for (int r=0; r<s.size; r++)
+          {
+            const collective_slot &c = slot(r);
+            pack(element(c.buf, c.displs[q*s.size + u], c.type), c.counts[q*s.size + u], c.type, send[q]);
+          }
+      }
+    exchange_processes(send);
+
+    for (int w=0; w<world_size(); w++)
+    {
+      const int q = w / s.size, r = w % s.size;
+      char *out = (char *) recvbuf + rdispls[w]*type(recvtype).extent;
+      if (q == s.process)
+      {
+        const collective_slot &c = slot(r);
+        copy(element(c.buf, c.displs[world_rank()], c.type), c.counts[world_rank()], c.type, out, recvcounts[w], recvtype);
+        continue;
+      }
+      std::vector<long> bytes(s.size*s.size);
+      std::memcpy(&bytes[0], data(s.received[q]), bytes.size()*sizeof(long));
+      long offset = bytes.size()*sizeof(long);
+      for (int i=0; i<rank()*s.size + r; i++) offset += bytes[i];
+      copy(data(s.received[q]) + offset, bytes[rank()*s.size + r], MPI_BYTE, out, recvcounts[w], recvtype);
+    }
+    finish();
+    return MPI_SUCCESS;
+}
+
+inline int MPI_Alltoall(const void *sendbuf, int sendcount, MPI_Datatype sendtype,
+                        void *recvbuf, int recvcount, MPI_Datatype recvtype, MPI_Comm comm)
+{
+    const int size = piston::thread_mpi::world_size();
+    std::vector<int> sendcounts(size, sendcount), sdispls(size), recvcounts(size, recvcount), rdispls(size);
+    for (int r=0; r<size; r++) { sdispls[r] = r*sendcount;  rdispls[r] = r*recvcount; }
+    return MPI_Alltoallv(sendbuf, &sendcounts[0], &sdispls[0], sendtype, recvbuf, &recvcounts[0], &rdispls[0], recvtype, comm);
+}
+
+
+inline int MPI_File_open(MPI_Comm, const char *filename, int amode, MPI_Info, MPI_File *fh)
+{
+    int flags = (amode & MPI_MODE_RDWR) ? O_RDWR : ((amode & MPI_MODE_WRONLY) ? O_WRONLY : O_RDONLY);
+    if (amode & MPI_MODE_CREATE) flags |= O_CREAT;
+    int fd = open(filename, flags, 0666);
+    piston::thread_mpi::world_barrier();
+    if (fd < 0) return MPI_ERR_FILE;
+    *fh = new piston::thread_mpi::file();
+    (*fh)->fd = fd;  (*fh)->disp = 0;  (*fh)->position = 0;  (*fh)->etype = MPI_BYTE;  (*fh)->filetype = MPI_BYTE;
+    return MPI_SUCCESS;
+}
+
+inline int MPI_File_close(MPI_File *fh)
+{
+    close((*fh)->fd);
+    delete *fh;
+    *fh = 0;
+    piston::thread_mpi::world_barrier();
+    return MPI_SUCCESS;
+}
+
+inline int MPI_File_get_size(MPI_File fh, MPI_Offset *size)
+{
+    struct stat s;
+    if (fstat(fh->fd, &s) != 0) return MPI_ERR_FILE;
+    *size = s.st_size;
+    return MPI_SUCCESS;
+}
+
+inline int MPI_File_set_size(MPI_File fh, MPI_Offset size)
+{
+    using namespace piston::thread_mpi;
+    world_barrier();
+    int result = ((world_rank() == 0) && (ftruncate(fh->fd, size) != 0)) ? MPI_ERR_FILE : MPI_SUCCESS;
+    world_barrier();
+    return result;
+}
+
+inline int MPI_File_set_view(MPI_File fh, MPI_Offset disp, MPI_Datatype etype, MPI_Datatype filetype, const char*, MPI_Info)
+{
+    fh->disp = disp;  fh->etype = etype;  fh->filetype = filetype;  fh->position = 0;
+    return MPI_SUCCESS;
+}
+
+inline int MPI_File_read_all(MPI_File fh, void *buf, int count, MPI_Datatype datatype, MPI_Status *status)
+{
+    int result = piston::thread_mpi::transfer(fh, fh->position, buf, count, datatype, false);
+    fh->position += count*piston::thread_mpi::type(datatype).size;
+    return result;
+}
+
+inline int MPI_File_write_at(MPI_File fh, MPI_Offset offset, const void *buf, int count, MPI_Datatype datatype, MPI_Status *status)
+{
+    return piston::thread_mpi::transfer(fh, offset*piston::thread_mpi::type(fh->etype).size, (void *) buf, count, datatype, true);
+}
+
+inline int MPI_File_write_at_all(MPI_File fh, MPI_Offset offset, const void *buf, int count, MPI_Datatype datatype, MPI_Status *status)
+{
+    return MPI_File_write_at(fh, offset, buf, count, datatype, status);
+}
+
+inline int MPI_File_read_at_all(MPI_File fh, MPI_Offset offset, void *buf, int count, MPI_Datatype datatype, MPI_Status *status)
+{
+    return piston::thread_mpi::transfer(fh, offset*piston::thread_mpi::type(fh->etype).size, buf, count, datatype, false);
+}
+
+#endif /* THREAD_MPI_H_ */
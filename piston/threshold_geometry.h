@@ -22,10 +22,15 @@ OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABIL
 ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifndef THRESHOLD_GEOMETRY_H_
+#define THRESHOLD_GEOMETRY_H_
+
 #include <thrust/iterator/counting_iterator.h>
 #include <thrust/iterator/zip_iterator.h>
 #include <thrust/iterator/permutation_iterator.h>
+#include <thrust/iterator/constant_iterator.h>
 #include <thrust/transform_scan.h>
+#include <thrust/transform_reduce.h>
 #include <thrust/binary_search.h>
 #include <thrust/tuple.h>
 #include <thrust/sort.h>
@@ -58,7 +63,13 @@ namespace piston
  * 	Invalid : cells with at least one vertices failing the threshold
  * 	Exterior valid : valid cells that generate geometry
  * 	Interior valid : valid cells that don't generate geometry, they are valid
- * 	cells surrounded by other valid cells, i.e. the number of valid neighbors is 6 */
+ * 	cells surrounded by other valid cells, i.e. the number of valid neighbors is 6
+ * 	Boundary face : face of an exterior valid cell whose neighbor across the
+ * 	face is invalid or outside of the dataset
+ *
+ * Valid and exterior flags are stored as bitmasks, one bit per cell and 32
+ * consecutive cells (in x-fastest order) per word. Cell c is bit (c % 32) of
+ * word (c / 32), bits past the last cell are always zero. */
 template <typename InputDataSet>
 struct threshold_geometry
 {
@@ -69,10 +80,19 @@ struct threshold_geometry
     typedef typename thrust::iterator_space<InputPointDataIterator>::type	space_type;
     typedef typename thrust::iterator_value<InputPointDataIterator>::type	value_type;
 
-    typedef typename thrust::counting_iterator<int, space_type>	CountingIterator;
+    // cell ids, vertex ids and enumerations are signed versions of the index
+    // type of the data set, 64 bit data sets get 64 bit ids.
+    typedef typename detail::signed_index<typename InputDataSet::IndexType>::type IndexType;
+
+    typedef typename thrust::counting_iterator<IndexType, space_type>	CountingIterator;
+
+    typedef unsigned int FlagWord;
+    static const int BitsPerWord = 32;
+    static const int AllFaces = 0x3f;
 
-    typedef typename detail::choose_container<InputPointDataIterator, int>::type  IndicesContainer;
-    typedef typename detail::choose_container<InputPointDataIterator, int>::type  ValidFlagsContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, IndexType>::type  IndicesContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, int>::type  MasksContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, FlagWord>::type  ValidFlagsContainer;
 
     typedef typename IndicesContainer::iterator IndicesIterator;
     typedef typename ValidFlagsContainer::iterator ValidFlagsIterator;
@@ -86,14 +106,14 @@ struct threshold_geometry
     float min_value;
     float max_value;
     bool colorFlip;
-
-    ValidFlagsContainer valid_cell_flags;
-    IndicesContainer    valid_cell_enum;
-    IndicesContainer    valid_cell_indices;
-    IndicesContainer    num_valid_cell_neighbors;
-    ValidFlagsContainer exterior_cell_flags;
-    IndicesContainer    exterior_cell_enum;
-    IndicesContainer    exterior_cell_indices;
+    bool boundaryFacesOnly;	// only generate quads for boundary faces of exterior cells
+
+    ValidFlagsContainer valid_cell_flags;	// one bit per cell, set if the cell passes the threshold
+    ValidFlagsContainer exterior_cell_flags;	// one bit per cell, set if the cell generates geometry
+    IndicesContainer    exterior_cell_enum;	// number of exterior cells before each flag word
+    IndicesContainer    exterior_cell_indices;	// global cell ids of exterior cells
+    MasksContainer      exterior_face_masks;	// bit f set if face f of an exterior cell is a boundary face
+    IndicesContainer    exterior_face_enum;	// enumeration of boundary faces of exterior cells
     IndicesContainer	vertices_indices;
     NormalsContainer 	normals;
 
@@ -109,83 +129,93 @@ struct threshold_geometry
 
 
     float minThresholdRange, maxThresholdRange;
-    unsigned int num_total_vertices;
+    typename InputDataSet::IndexType num_total_vertices;
 
     threshold_geometry(InputDataSet &input, float min_value, float max_value ) :
-	input(input), min_value(min_value), max_value(max_value), colorFlip(false), useInterop(false), vboSize(0)
+	input(input), min_value(min_value), max_value(max_value), colorFlip(false), boundaryFacesOnly(false),
+	useInterop(false), vboSize(0)
     {
     }
 
     void freeMemory(bool includeInput=true)
     {
-      valid_cell_flags.clear();  valid_cell_enum.clear();  valid_cell_indices.clear();
-      num_valid_cell_neighbors.clear();
+      valid_cell_flags.clear();
       exterior_cell_flags.clear();  exterior_cell_enum.clear();  exterior_cell_indices.clear();
+      exterior_face_masks.clear();  exterior_face_enum.clear();
       vertices_indices.clear(); normals.clear();
     }
 
     void operator()() {
-	const int NCells = input.NCells;
+	const IndexType NCells = input.NCells;
+	const IndexType NWords = (NCells + BitsPerWord - 1) / BitsPerWord;
 
-	valid_cell_flags.resize(NCells);
+	valid_cell_flags.resize(NWords);
 
-	// test and enumerate cells that pass threshold, we don't do kernel fusion
-	// because the flags are used in a later stage.
-	thrust::transform(CountingIterator(0), CountingIterator(0)+NCells,
+	// test cells that pass threshold, 32 cells at a time, we don't do kernel
+	// fusion because the flags are used in a later stage.
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NWords,
 	                  valid_cell_flags.begin(),
 	                  threshold_cell(input, min_value, max_value));
 
-	// enumerate valid cells
-	valid_cell_enum.resize(NCells);
-	thrust::inclusive_scan(valid_cell_flags.begin(), valid_cell_flags.end(),
-	                       valid_cell_enum.begin());
-	// the total number of valid cells is the last element of the enumeration.
-	int num_valid_cells = valid_cell_enum.back();
+	// the total number of valid cells is the number of bits set.
+	IndexType num_valid_cells = thrust::transform_reduce(valid_cell_flags.begin(), valid_cell_flags.end(),
+	                                                     count_cells(), IndexType(0), thrust::plus<IndexType>());
 
 	// no valid cells at all, return with empty vertices vector.
 	if (num_valid_cells == 0) {
+	    num_total_vertices = 0;
 	    vertices_indices.clear();
 	    normals.clear();
 	    return;
 	}
 
-	// generate indices to cells that pass threshold
 	// This ends the core part of the threshold filter, the rest is
 	// representation and mapper to geometry.
 	// TODO: should we move it to something like GoemetryFilter as VTK?
-	valid_cell_indices.resize(num_valid_cells);
-	thrust::upper_bound(valid_cell_enum.begin(), valid_cell_enum.end(),
-	                    CountingIterator(0), CountingIterator(0)+num_valid_cells,
-	                    valid_cell_indices.begin());
-
-	// calculate how many neighbors of a cell are valid.
-	num_valid_cell_neighbors.resize(num_valid_cells);
-	thrust::transform(valid_cell_indices.begin(), valid_cell_indices.end(),
-	                  num_valid_cell_neighbors.begin(),
-	                  valid_cell_neighbors(input, thrust::raw_pointer_cast(&*valid_cell_flags.begin())));
-
-	// test if a cell is at the exterior of the blob of valid cells.
-	exterior_cell_flags.resize(num_valid_cells);
-	thrust::transform(num_valid_cell_neighbors.begin(), num_valid_cell_neighbors.end(),
+
+	// test if a valid cell is at the exterior of the blob of valid cells,
+	// the neighbors of 32 cells are tested at once with word operations.
+	exterior_cell_flags.resize(NWords);
+	thrust::transform(CountingIterator(0), CountingIterator(0)+NWords,
 	                  exterior_cell_flags.begin(),
-	                  is_exterior_cell());
+	                  exterior_cell(input, thrust::raw_pointer_cast(&*valid_cell_flags.begin())));
 
-	// enumerate how many exterior cells we have
-	exterior_cell_enum.resize(num_valid_cells);
-	thrust::inclusive_scan(exterior_cell_flags.begin(), exterior_cell_flags.end(),
-	                       exterior_cell_enum.begin());
+	// enumerate how many exterior cells we have before each word
+	exterior_cell_enum.resize(NWords);
+	thrust::transform_exclusive_scan(exterior_cell_flags.begin(), exterior_cell_flags.end(),
+	                                 exterior_cell_enum.begin(),
+	                                 count_cells(), IndexType(0), thrust::plus<IndexType>());
 
 	// total number of exterior cells
-	int num_exterior_cells = exterior_cell_enum.back();
+	IndexType num_exterior_cells = exterior_cell_enum.back() + popcount(exterior_cell_flags.back());
 	//std::cout << "number of exterior cells: " << num_exterior_cells << std::endl;
 
-	// search for indices to exterior cells among all valid cells
+	// write out the global indices of exterior cells, each word writes
+	// its set bits starting at its enumeration.
 	exterior_cell_indices.resize(num_exterior_cells);
-	thrust::upper_bound(exterior_cell_enum.begin(), exterior_cell_enum.end(),
-	                    CountingIterator(0), CountingIterator(0)+num_exterior_cells,
-	                    exterior_cell_indices.begin());
-
-	num_total_vertices = num_exterior_cells*24;
+	thrust::for_each(CountingIterator(0), CountingIterator(0)+NWords,
+	                 enumerate_cells(thrust::raw_pointer_cast(&*exterior_cell_flags.begin()),
+	                                 thrust::raw_pointer_cast(&*exterior_cell_enum.begin()),
+	                                 thrust::raw_pointer_cast(&*exterior_cell_indices.begin())));
+
+	if (boundaryFacesOnly) {
+	    // find which faces of the exterior cells are boundary faces and
+	    // enumerate them, faces shared with other valid cells are culled.
+	    exterior_face_masks.resize(num_exterior_cells);
+	    thrust::transform(exterior_cell_indices.begin(), exterior_cell_indices.end(),
+	                      exterior_face_masks.begin(),
+	                      boundary_faces(input, thrust::raw_pointer_cast(&*valid_cell_flags.begin())));
+
+	    exterior_face_enum.resize(num_exterior_cells);
+	    thrust::transform_exclusive_scan(exterior_face_masks.begin(), exterior_face_masks.end(),
+	                                     exterior_face_enum.begin(),
+	                                     count_cells(), IndexType(0), thrust::plus<IndexType>());
+
+	    const IndexType num_boundary_faces = exterior_face_enum.back() + popcount(exterior_face_masks.back());
+	    num_total_vertices = num_boundary_faces*4;
+	} else {
+	    num_total_vertices = num_exterior_cells*24;
+	}
 	//std::cout << "number of vertices: " << numTotalVertices << std::endl;
 
 	if (useInterop) {
@@ -222,14 +252,27 @@ struct threshold_geometry
 #endif
 	}
 
-	// generate 6 quards for each exterior cell
 	vertices_indices.resize(num_total_vertices);
 	normals.resize(num_total_vertices);
-	thrust::for_each(thrust::make_zip_iterator(thrust::make_tuple(CountingIterator(0),
-	                                                              thrust::make_permutation_iterator(valid_cell_indices.begin(), exterior_cell_indices.begin()))),
-	                 thrust::make_zip_iterator(thrust::make_tuple(CountingIterator(0) + num_exterior_cells,
-	                                                              thrust::make_permutation_iterator(valid_cell_indices.begin(), exterior_cell_indices.begin()))),
-	                 generate_quads(input, thrust::raw_pointer_cast(&*vertices_indices.begin()), thrust::raw_pointer_cast(&*normals.begin())));
+	if (boundaryFacesOnly) {
+	    // generate one quad for each boundary face
+	    thrust::for_each(thrust::make_zip_iterator(thrust::make_tuple(exterior_cell_indices.begin(),
+	                                                                  exterior_face_enum.begin(),
+	                                                                  exterior_face_masks.begin())),
+	                     thrust::make_zip_iterator(thrust::make_tuple(exterior_cell_indices.end(),
+	                                                                  exterior_face_enum.end(),
+	                                                                  exterior_face_masks.end())),
+	                     generate_quads(input, thrust::raw_pointer_cast(&*vertices_indices.begin()), thrust::raw_pointer_cast(&*normals.begin())));
+	} else {
+	    // generate 6 quards for each exterior cell
+	    thrust::for_each(thrust::make_zip_iterator(thrust::make_tuple(exterior_cell_indices.begin(),
+	                                                                  thrust::make_transform_iterator(CountingIterator(0), first_face()),
+	                                                                  thrust::make_constant_iterator(int(AllFaces)))),
+	                     thrust::make_zip_iterator(thrust::make_tuple(exterior_cell_indices.end(),
+	                                                                  thrust::make_transform_iterator(CountingIterator(0), first_face()) + num_exterior_cells,
+	                                                                  thrust::make_constant_iterator(int(AllFaces)) + num_exterior_cells)),
+	                     generate_quads(input, thrust::raw_pointer_cast(&*vertices_indices.begin()), thrust::raw_pointer_cast(&*normals.begin())));
+	}
 
 	if (useInterop) {
 #if USE_INTEROP
@@ -250,17 +293,21 @@ struct threshold_geometry
 
     // FixME: the input data type should really be cells rather than cell_ids
     // FixME: change float to value_type
-    struct threshold_cell : public thrust::unary_function<int, bool>
+    // return the valid flags of the 32 cells starting at word_id*32
+    struct threshold_cell : public thrust::unary_function<IndexType, FlagWord>
     {
 	// FixME: constant iterator and/or iterator to const problem.
 	InputPointDataIterator point_data;
 	const float min_value;
 	const float max_value;
+	const typename InputDataSet::LayoutType layout;
+	const cell_culling<InputDataSet> culling;
 
 	const int xdim;
 	const int ydim;
 	const int zdim;
 	const int cells_per_layer;
+	const IndexType ncells;
 
 	__host__ __device__
 	bool threshold(float val) const {
@@ -270,111 +317,255 @@ struct threshold_geometry
 	threshold_cell(InputDataSet &input, float min_value, float max_value) :
 	    point_data(input.point_data_begin()),
 	    min_value(min_value), max_value(max_value),
+	    layout(input.layout),
+	    culling(input),
 	    xdim(input.dim0), ydim(input.dim1), zdim(input.dim2),
-	    cells_per_layer((xdim - 1) * (ydim - 1)) {}
+	    cells_per_layer((xdim - 1) * (ydim - 1)),
+	    ncells(input.NCells) {}
 
 	__host__ __device__
-	bool operator() (int cell_id) const {
-	    const int x = cell_id % (xdim - 1);
-	    const int y = (cell_id / (xdim - 1)) % (ydim -1);
-	    const int z = cell_id / cells_per_layer;
+	FlagWord operator() (IndexType word_id) const {
+	    const IndexType first_cell = word_id * BitsPerWord;
+	    const IndexType last_cell  = (first_cell + BitsPerWord < ncells) ? first_cell + BitsPerWord : ncells;
+
+	    // the integer division/modulus is only done for the first cell of
+	    // the word, the rest are walked incrementally.
+	    IndexType x = first_cell % (xdim - 1);
+	    IndexType y = (first_cell / (xdim - 1)) % (ydim -1);
+	    IndexType z = first_cell / cells_per_layer;
+
+	    FlagWord flags = 0;
+	    for (IndexType cell_id = first_cell; cell_id < last_cell; cell_id++) {
+		// cells known to be outside of the range are invalid
+		if (culling(x, y, z, min_value, max_value)) {
+		    // indices to the eight vertices of the voxel
+		    IndexType i[8];
+		    layout.cell_vertices(x, y, z, i);
+
+		    // a cell is considered passing the threshold if all of its vertices
+		    // are passing the threshold.
+		    bool valid = threshold(*(point_data + i[0]));
+		    valid &= threshold(*(point_data + i[1]));
+		    valid &= threshold(*(point_data + i[2]));
+		    valid &= threshold(*(point_data + i[3]));
+		    valid &= threshold(*(point_data + i[4]));
+		    valid &= threshold(*(point_data + i[5]));
+		    valid &= threshold(*(point_data + i[6]));
+		    valid &= threshold(*(point_data + i[7]));
+
+		    flags |= ((FlagWord) valid) << (cell_id - first_cell);
+		}
+
+		if (++x == xdim - 1) {
+		    x = 0;
+		    if (++y == ydim - 1) {
+			y = 0;
+			z++;
+		    }
+		}
+	    }
 
-	    // indices to the eight vertices of the voxel
-	    const int i0 = x    + y*xdim + z * xdim * ydim;
-	    const int i1 = i0   + 1;
-	    const int i2 = i0   + 1	+ xdim;
-	    const int i3 = i0   + xdim;
-
-	    const int i4 = i0   + xdim * ydim;
-	    const int i5 = i1   + xdim * ydim;
-	    const int i6 = i2   + xdim * ydim;
-	    const int i7 = i3   + xdim * ydim;
-
-	    // scalar values of the eight vertices
-	    const float f0 = *(point_data + i0);
-	    const float f1 = *(point_data + i1);
-	    const float f2 = *(point_data + i2);
-	    const float f3 = *(point_data + i3);
-	    const float f4 = *(point_data + i4);
-	    const float f5 = *(point_data + i5);
-	    const float f6 = *(point_data + i6);
-	    const float f7 = *(point_data + i7);
-
-	    // a cell is considered passing the threshold if all of its vertices
-	    // are passing the threshold.
-	    bool valid = threshold(f0);
-	    valid &= threshold(f1);
-	    valid &= threshold(f2);
-	    valid &= threshold(f3);
-	    valid &= threshold(f4);
-	    valid &= threshold(f5);
-	    valid &= threshold(f6);
-	    valid &= threshold(f7);
-
-	    return valid;
+	    return flags;
 	}
     };
 
-    // return the number of neighbors that are valid cells
-    struct valid_cell_neighbors : public thrust::unary_function<int, int>
+    // return the number of cells flagged in a word
+    struct count_cells : public thrust::unary_function<FlagWord, int>
+    {
+	__host__ __device__
+	int operator() (FlagWord flags) const {
+	    return popcount(flags);
+	}
+    };
+
+    // compute, for the 32 cells of a word, which of them have a valid
+    // neighbor across each of the six faces.
+    struct valid_cell_neighbors
     {
 	const int xdim;
 	const int ydim;
 	const int zdim;
 	const int cells_per_layer;
+	const IndexType ncells;
+	const IndexType nwords;
 
-	const int *valid_cell_flags;
+	const FlagWord *valid_cell_flags;
 
-	valid_cell_neighbors(InputDataSet &input, const int *valid_cell_flags) :
+	valid_cell_neighbors(InputDataSet &input, const FlagWord *valid_cell_flags) :
 	    xdim(input.dim0), ydim(input.dim1), zdim(input.dim2),
 	    cells_per_layer((xdim - 1) * (ydim - 1)),
+	    ncells(input.NCells),
+	    nwords((input.NCells + BitsPerWord - 1) / BitsPerWord),
 	    valid_cell_flags(valid_cell_flags) {}
 
+	// return the 32 valid flags starting at an arbitrary cell id, cells
+	// outside of the data set are read as invalid.
+	__host__ __device__
+	FlagWord flags_at(IndexType first_cell) const {
+	    if (first_cell <= -BitsPerWord || first_cell >= ncells)
+		return 0;
+
+	    // floor division, first_cell may be negative
+	    const IndexType word  = (first_cell + BitsPerWord) / BitsPerWord - 1;
+	    const int shift = first_cell - word * BitsPerWord;
+
+	    const FlagWord lo = (word >= 0)         ? valid_cell_flags[word]     : 0;
+	    if (shift == 0)
+		return lo;
+	    const FlagWord hi = (word + 1 < nwords) ? valid_cell_flags[word + 1] : 0;
+	    return (lo >> shift) | (hi << (BitsPerWord - shift));
+	}
+
+	// neighbors[f] has bit b set if cell word_id*32+b has a valid cell
+	// neighbor across face f, face numbering follows generate_quads.
 	__host__ __device__
-	int operator() (int valid_cell_id) const {
-	    // cell ids of the cell's six neighbors
-	    const int n0 = valid_cell_id - (xdim - 1);
-	    const int n1 = valid_cell_id + 1;
-	    const int n2 = valid_cell_id + (xdim - 1);
-	    const int n3 = valid_cell_id - 1;
-	    const int n4 = valid_cell_id - cells_per_layer;
-	    const int n5 = valid_cell_id + cells_per_layer;
+	void operator() (IndexType word_id, FlagWord neighbors[6]) const {
+	    const IndexType first_cell = word_id * BitsPerWord;
 
 	    // we are using fixed boundary conditions here, if a cell is at
 	    // the border of the data set, it DOES NOT have a valid cell
-	    // neighbor at that face.
-	    const int x = valid_cell_id % (xdim - 1);
-	    const int y = (valid_cell_id / (xdim - 1)) % (ydim -1);
-	    const int z = valid_cell_id / cells_per_layer;
+	    // neighbor at that face, build masks of cells at the borders.
+	    int x = first_cell % (xdim - 1);
+	    int y = (first_cell / (xdim - 1)) % (ydim -1);
+	    IndexType z = first_cell / cells_per_layer;
+
+	    FlagWord boundary[6] = { 0, 0, 0, 0, 0, 0 };
+	    for (int b = 0; b < BitsPerWord; b++) {
+		const FlagWord bit = ((FlagWord) 1) << b;
+		if (y == 0)          boundary[0] |= bit;
+		if (x == (xdim - 2)) boundary[1] |= bit;
+		if (y == (ydim - 2)) boundary[2] |= bit;
+		if (x == 0)          boundary[3] |= bit;
+		if (z == 0)          boundary[4] |= bit;
+		if (z == (zdim - 2)) boundary[5] |= bit;
+
+		if (++x == xdim - 1) {
+		    x = 0;
+		    if (++y == ydim - 1) {
+			y = 0;
+			z++;
+		    }
+		}
+	    }
+
+	    // the x neighbors are the adjacent bits of the same or the
+	    // neighboring word, the others are word aligned loads at the
+	    // offset of the neighboring row or layer.
+	    neighbors[0] = flags_at(first_cell - (xdim - 1))     & ~boundary[0];
+	    neighbors[1] = flags_at(first_cell + 1)              & ~boundary[1];
+	    neighbors[2] = flags_at(first_cell + (xdim - 1))     & ~boundary[2];
+	    neighbors[3] = flags_at(first_cell - 1)              & ~boundary[3];
+	    neighbors[4] = flags_at(first_cell - cells_per_layer) & ~boundary[4];
+	    neighbors[5] = flags_at(first_cell + cells_per_layer) & ~boundary[5];
+	}
+    };
+
+    // return the flags of the valid cells of a word that will actually
+    // generate geometry, i.e. have fewer than 6 valid neighbors.
+    struct exterior_cell : public thrust::unary_function<IndexType, FlagWord>
+    {
+	valid_cell_neighbors neighbors_of;
+
+	exterior_cell(InputDataSet &input, const FlagWord *valid_cell_flags) :
+	    neighbors_of(input, valid_cell_flags) {}
+
+	__host__ __device__
+	FlagWord operator() (IndexType word_id) const {
+	    const FlagWord valid = neighbors_of.valid_cell_flags[word_id];
+	    if (valid == 0)
+		return 0;
+
+	    FlagWord neighbors[6];
+	    neighbors_of(word_id, neighbors);
+
+	    const FlagWord interior = neighbors[0] & neighbors[1] & neighbors[2] &
+	                              neighbors[3] & neighbors[4] & neighbors[5];
+	    return valid & ~interior;
+	}
+    };
+
+    // write out the cell ids of the bits set in a word, starting at the
+    // enumeration of the word.
+    struct enumerate_cells : public thrust::unary_function<IndexType, void>
+    {
+	const FlagWord *cell_flags;
+	const IndexType *cell_enum;
+	IndexType * const cell_indices;
+
+	enumerate_cells(const FlagWord *cell_flags, const IndexType *cell_enum, IndexType * const cell_indices) :
+	    cell_flags(cell_flags), cell_enum(cell_enum), cell_indices(cell_indices) {}
+
+	__host__ __device__
+	void operator() (IndexType word_id) const {
+	    FlagWord flags = cell_flags[word_id];
+	    IndexType output = cell_enum[word_id];
+
+	    while (flags) {
+		cell_indices[output++] = word_id * BitsPerWord + lowest_bit(flags);
+		flags &= flags - 1;
+	    }
+	}
+    };
+
+    // return a mask of the faces of a valid cell whose neighbor across the
+    // face is invalid or outside of the dataset, face numbering follows
+    // generate_quads.
+    struct boundary_faces : public thrust::unary_function<IndexType, int>
+    {
+	const int xdim;
+	const int ydim;
+	const int zdim;
+	const int cells_per_layer;
+
+	const FlagWord *valid_cell_flags;
+
+	boundary_faces(InputDataSet &input, const FlagWord *valid_cell_flags) :
+	    xdim(input.dim0), ydim(input.dim1), zdim(input.dim2),
+	    cells_per_layer((xdim - 1) * (ydim - 1)),
+	    valid_cell_flags(valid_cell_flags) {}
+
+	__host__ __device__
+	bool is_valid(IndexType cell_id) const {
+	    return (valid_cell_flags[cell_id / BitsPerWord] >> (cell_id % BitsPerWord)) & 1;
+	}
+
+	__host__ __device__
+	int operator() (IndexType cell_id) const {
+	    const int x = cell_id % (xdim - 1);
+	    const int y = (cell_id / (xdim - 1)) % (ydim -1);
+	    const IndexType z = cell_id / cells_per_layer;
 
-	    // we are taking advantage of short-circuit && operator here,
 	    // the coordinates of the cell is tested first so we won't
-	    // access to data past boundary.
-	    int num_valid_cells = !(y == 0)          && *(valid_cell_flags + n0);
-	    num_valid_cells    += !(x == (xdim - 2)) && *(valid_cell_flags + n1);
-	    num_valid_cells    += !(y == (ydim - 2)) && *(valid_cell_flags + n2);
-	    num_valid_cells    += !(x == 0)          && *(valid_cell_flags + n3);
-	    num_valid_cells    += !(z == 0)          && *(valid_cell_flags + n4);
-	    num_valid_cells    += !(z == (zdim - 2)) && *(valid_cell_flags + n5);
-
-	    return num_valid_cells;
+	    // access to flags past boundary.
+	    int faces = 0;
+	    if ((y == 0)          || !is_valid(cell_id - (xdim - 1)))     faces |= 1;
+	    if ((x == (xdim - 2)) || !is_valid(cell_id + 1))              faces |= 2;
+	    if ((y == (ydim - 2)) || !is_valid(cell_id + (xdim - 1)))     faces |= 4;
+	    if ((x == 0)          || !is_valid(cell_id - 1))              faces |= 8;
+	    if ((z == 0)          || !is_valid(cell_id - cells_per_layer)) faces |= 16;
+	    if ((z == (zdim - 2)) || !is_valid(cell_id + cells_per_layer)) faces |= 32;
+
+	    return faces;
 	}
     };
 
-    // return true if the cell will actually generate geometry.
-    struct is_exterior_cell : public thrust::unary_function<int, bool>
+    // index of the first face of an exterior cell when all 6 faces are generated
+    struct first_face : public thrust::unary_function<IndexType, IndexType>
     {
 	__host__ __device__
-	bool operator() (int num_valid_cell_neighbors) const {
-	    return num_valid_cell_neighbors != 6;
+	IndexType operator() (IndexType exterior_cell_id) const {
+	    return exterior_cell_id*6;
 	}
     };
 
     // FixME: the input data type should really be cells rather than cell_ids
-    struct generate_quads : public thrust::unary_function<thrust::tuple<int, int>, void>
+    // generate a quad for each face in the face mask of a cell, quads are
+    // written consecutively starting at the given face index.
+    struct generate_quads : public thrust::unary_function<thrust::tuple<IndexType, IndexType, int>, void>
     {
     private:
 	InputGridCoordinatesIterator physical_coord;
+	const typename InputDataSet::LayoutType layout;
 
 	const int xdim;
 	const int ydim;
@@ -383,7 +574,7 @@ struct threshold_geometry
 
 	// crazy C++ const correctness, vertices_indices is a pointer that
 	// does not change the address it points to.
-	int * const vertices_indices;
+	IndexType * const vertices_indices;
 	float3 * const normals_output;
 
 	template <typename Tuple>
@@ -395,16 +586,18 @@ struct threshold_geometry
 	}
 
     public:
-	generate_quads(InputDataSet &input, int * const vertices_indices, float3 * const normals) :
+	generate_quads(InputDataSet &input, IndexType * const vertices_indices, float3 * const normals) :
 	    physical_coord(input.physical_coordinates_begin()),
+	    layout(input.layout),
 	    xdim(input.dim0), ydim(input.dim1), zdim(input.dim2),
 	    cells_per_layer((xdim - 1) * (ydim - 1)),
 	    vertices_indices(vertices_indices), normals_output(normals) {}
 
 	__host__ __device__
-	void operator() (const thrust::tuple<int, int>& indices_tuple) const {
-	    const int exterior_cell_id = thrust::get<0>(indices_tuple);
-	    const int global_cell_id   = thrust::get<1>(indices_tuple);
+	void operator() (const thrust::tuple<IndexType, IndexType, int>& indices_tuple) const {
+	    const IndexType global_cell_id = thrust::get<0>(indices_tuple);
+	    const IndexType first_face     = thrust::get<1>(indices_tuple);
+	    const int face_mask            = thrust::get<2>(indices_tuple);
 
 	    const int vertices_for_faces[] =
 	    {
@@ -416,25 +609,13 @@ struct threshold_geometry
 		 4, 5, 6, 7  // face 5
 	    };
 
-	    const int i = global_cell_id % (xdim - 1);
-	    const int j = (global_cell_id / (xdim - 1)) % (ydim -1);
-	    const int k = global_cell_id / cells_per_layer;
+	    const IndexType i = global_cell_id % (xdim - 1);
+	    const IndexType j = (global_cell_id / (xdim - 1)) % (ydim -1);
+	    const IndexType k = global_cell_id / cells_per_layer;
 
 	    // indices to the eight vertices of the voxel
-	    int indices[8];
-	    indices[0] = i            + j*xdim  + k * xdim * ydim;
-	    indices[1] = indices[0]   + 1;
-	    indices[2] = indices[0]   + 1	+ xdim;
-	    indices[3] = indices[0]   + xdim;
-
-	    indices[4] = indices[0]   + xdim * ydim;
-	    indices[5] = indices[1]   + xdim * ydim;
-	    indices[6] = indices[2]   + xdim * ydim;
-	    indices[7] = indices[3]   + xdim * ydim;
-
-	    for (int v = 0; v < 24; v++) {
-		*(vertices_indices + exterior_cell_id*24 + v) = indices[vertices_for_faces[v]];
-	    }
+	    IndexType indices[8];
+	    layout.cell_vertices(i, j, k, indices);
 
 	    // calculate surface normal by cross product of the diagonals of the quad.
 	    float3 p[8];
@@ -447,14 +628,25 @@ struct threshold_geometry
 	    p[6] = tuple2float3(*(physical_coord + indices[6]));
 	    p[7] = tuple2float3(*(physical_coord + indices[7]));
 
-	    for (int v = 0; v < 24; v += 4) {
+	    IndexType output = first_face*4;
+	    for (int f = 0; f < 6; f++) {
+		if (!(face_mask & (1 << f)))
+		    continue;
+
+		const int v = f*4;
+		*(vertices_indices + output)     = indices[vertices_for_faces[v]];
+		*(vertices_indices + output + 1) = indices[vertices_for_faces[v+1]];
+		*(vertices_indices + output + 2) = indices[vertices_for_faces[v+2]];
+		*(vertices_indices + output + 3) = indices[vertices_for_faces[v+3]];
+
 		const float3 edge0 = p[vertices_for_faces[v+2]] - p[vertices_for_faces[v]];
 		const float3 edge1 = p[vertices_for_faces[v+3]] - p[vertices_for_faces[v+1]];
 		const float3 normal = normalize(cross(edge0, edge1));
-		*(normals_output + exterior_cell_id*24 + v) =
-		*(normals_output + exterior_cell_id*24 + v + 1) =
-		*(normals_output + exterior_cell_id*24 + v + 2) =
-		*(normals_output + exterior_cell_id*24 + v + 3) = normal;
+		*(normals_output + output) =
+		*(normals_output + output + 1) =
+		*(normals_output + output + 2) =
+		*(normals_output + output + 3) = normal;
+		output += 4;
 	    }
 	}
     };
@@ -495,3 +687,5 @@ struct threshold_geometry
 };
 
 }
+
+#endif /* THRESHOLD_GEOMETRY_H_ */
@@ -1,17 +1,250 @@
 /*
- * threshold_points.h
- *
- *  Created on: Sep 21, 2011
- *      Author: ollie
- */
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
 
 #ifndef THRESHOLD_POINTS_H_
 #define THRESHOLD_POINTS_H_
 
-template <typename InputDataSet>
+#include <thrust/functional.h>
+#include <thrust/tuple.h>
+#include <thrust/for_each.h>
+#include <thrust/transform_scan.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/zip_iterator.h>
+
+#include <piston/choose_container.h>
+
+namespace piston
+{
+
+// default predicate of threshold_points, passes values in [min_value, max_value]
+struct in_range : public thrust::unary_function<float, bool>
+{
+    float min_value;
+    float max_value;
+
+    in_range(float min_value = 0.0f, float max_value = 0.0f) :
+	min_value(min_value), max_value(max_value) {}
+
+    __host__ __device__
+    bool operator()(float val) const {
+	return (min_value <= val) && (val <= max_value);
+    }
+};
+
+/* Select the points of a dataset whose scalar value passes a predicate.
+ *
+ * The input can be any dataset providing point_data_begin(),
+ * physical_coordinates_begin() and NPoints, e.g. image3d based fields or
+ * point_set. When stride is larger than 1 only every stride-th point is
+ * tested. The output is compacted into separate x, y, z, scalar and
+ * original point index arrays.
+ *
+ * The predicate is evaluated once per sample, together with the
+ * enumeration scan. The scan has one more entry than there are samples,
+ * so the scatter pass sees whether a sample was selected from two
+ * consecutive entries and no per point flags are stored. */
+template <typename InputDataSet, typename Predicate = in_range>
 struct threshold_points
 {
+    typedef typename InputDataSet::PointDataIterator InputPointDataIterator;
+    typedef typename InputDataSet::PhysicalCoordinatesIterator InputCoordinatesIterator;
+
+    typedef typename thrust::iterator_space<InputPointDataIterator>::type	space_type;
+    typedef typename thrust::iterator_value<InputPointDataIterator>::type	value_type;
+
+    typedef typename thrust::counting_iterator<int, space_type>	CountingIterator;
+
+    typedef typename detail::choose_container<InputPointDataIterator, int>::type	IndicesContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, float>::type	CoordinatesContainer;
+    typedef typename detail::choose_container<InputPointDataIterator, value_type>::type	ScalarsContainer;
+
+    typedef typename IndicesContainer::iterator		IndicesIterator;
+    typedef typename CoordinatesContainer::iterator	CoordinatesIterator;
+    typedef typename ScalarsContainer::iterator		ScalarsIterator;
+    typedef thrust::zip_iterator<thrust::tuple<CoordinatesIterator, CoordinatesIterator, CoordinatesIterator> > VerticesIterator;
+
+    InputDataSet &input;
+    Predicate predicate;
+    int stride;
+
+    IndicesContainer	 point_enum;	// enumeration of selected points among the sampled ones, plus their total
+    IndicesContainer	 point_indices;	// indices of selected points into the input
+    CoordinatesContainer x;		// compacted coordinates of selected points
+    CoordinatesContainer y;
+    CoordinatesContainer z;
+    ScalarsContainer	 scalars;	// compacted scalar values of selected points
+
+    unsigned int num_selected_points;
+
+    threshold_points(InputDataSet &input, float min_value, float max_value, int stride = 1) :
+	input(input), predicate(min_value, max_value), stride(stride), num_selected_points(0) {}
 
+    threshold_points(InputDataSet &input, Predicate predicate, int stride = 1) :
+	input(input), predicate(predicate), stride(stride), num_selected_points(0) {}
+
+    void freeMemory(bool includeInput=true)
+    {
+	point_enum.clear();  point_indices.clear();
+	x.clear();  y.clear();  z.clear();  scalars.clear();
+    }
+
+    void operator()() {
+	const int NSamples = (input.NPoints + stride - 1) / stride;
+
+	if (NSamples == 0) {
+	    num_selected_points = 0;
+	    freeMemory();
+	    return;
+	}
+
+	// test and enumerate the sampled points in one pass, the last entry
+	// is the number of selected points
+	point_enum.resize(NSamples+1);
+	thrust::transform_exclusive_scan(CountingIterator(0), CountingIterator(0)+NSamples+1,
+	                                 point_enum.begin(),
+	                                 select_point(input, predicate, stride, NSamples),
+	                                 0, thrust::plus<int>());
+
+	num_selected_points = point_enum.back();
+
+	// no point selected, return with empty vectors.
+	if (num_selected_points == 0) {
+	    point_indices.clear();
+	    x.clear();  y.clear();  z.clear();  scalars.clear();
+	    return;
+	}
+
+	point_indices.resize(num_selected_points);
+	x.resize(num_selected_points);
+	y.resize(num_selected_points);
+	z.resize(num_selected_points);
+	scalars.resize(num_selected_points);
+
+	// scatter the selected points to their enumerated positions
+	thrust::for_each(CountingIterator(0), CountingIterator(0)+NSamples,
+	                 scatter_point(input, stride,
+	                               thrust::raw_pointer_cast(&*point_enum.begin()),
+	                               thrust::raw_pointer_cast(&*point_indices.begin()),
+	                               thrust::raw_pointer_cast(&*x.begin()),
+	                               thrust::raw_pointer_cast(&*y.begin()),
+	                               thrust::raw_pointer_cast(&*z.begin()),
+	                               thrust::raw_pointer_cast(&*scalars.begin())));
+    }
+
+    // return 1 if the sample passes the predicate, 0 otherwise or past the last sample
+    struct select_point : public thrust::unary_function<int, int>
+    {
+	// FixME: constant iterator and/or iterator to const problem.
+	InputPointDataIterator point_data;
+	const Predicate predicate;
+	const int stride;
+	const int num_samples;
+
+	select_point(InputDataSet &input, Predicate predicate, int stride, int num_samples) :
+	    point_data(input.point_data_begin()),
+	    predicate(predicate), stride(stride), num_samples(num_samples) {}
+
+	__host__ __device__
+	int operator() (int sample_id) const {
+	    if (sample_id >= num_samples)
+		return 0;
+	    return predicate(*(point_data + sample_id*stride)) ? 1 : 0;
+	}
+    };
+
+    struct scatter_point : public thrust::unary_function<int, void>
+    {
+	InputPointDataIterator	 point_data;
+	InputCoordinatesIterator physical_coord;
+	const int stride;
+
+	const int *point_enum;
+	int   * const indices_output;
+	float * const x_output;
+	float * const y_output;
+	float * const z_output;
+	value_type * const scalars_output;
+
+	scatter_point(InputDataSet &input, int stride,
+	              const int *point_enum, int *indices,
+	              float *x, float *y, float *z, value_type *scalars) :
+	    point_data(input.point_data_begin()),
+	    physical_coord(input.physical_coordinates_begin()),
+	    stride(stride),
+	    point_enum(point_enum), indices_output(indices),
+	    x_output(x), y_output(y), z_output(z), scalars_output(scalars) {}
+
+	__host__ __device__
+	void operator() (int sample_id) const {
+	    // the enumeration only advances past selected samples
+	    const int output = point_enum[sample_id];
+	    if (point_enum[sample_id+1] == output)
+		return;
+
+	    const int point_id = sample_id*stride;
+	    const value_type value = *(point_data + point_id);
+	    const typename thrust::iterator_value<InputCoordinatesIterator>::type pos = *(physical_coord + point_id);
+
+	    indices_output[output] = point_id;
+	    x_output[output] = (float) thrust::get<0>(pos);
+	    y_output[output] = (float) thrust::get<1>(pos);
+	    z_output[output] = (float) thrust::get<2>(pos);
+	    scalars_output[output] = value;
+	}
+    };
+
+    VerticesIterator vertices_begin() {
+	return thrust::make_zip_iterator(thrust::make_tuple(x.begin(), y.begin(), z.begin()));
+    }
+    VerticesIterator vertices_end() {
+	return thrust::make_zip_iterator(thrust::make_tuple(x.end(), y.end(), z.end()));
+    }
+
+    ScalarsIterator scalars_begin() {
+	return scalars.begin();
+    }
+    ScalarsIterator scalars_end() {
+	return scalars.end();
+    }
+
+    IndicesIterator indices_begin() {
+	return point_indices.begin();
+    }
+    IndicesIterator indices_end() {
+	return point_indices.end();
+    }
+
+    // Set threshold range, only for the default in_range predicate
+    void set_threshold_range(float minVal, float maxVal) {
+	predicate = Predicate(minVal, maxVal);
+    }
+
+    void set_predicate(Predicate pred) {
+	predicate = pred;
+    }
 };
 
+} // namespace piston
+
 #endif /* THRESHOLD_POINTS_H_ */
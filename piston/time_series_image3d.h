@@ -0,0 +1,316 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TIME_SERIES_IMAGE3D_H_
+#define TIME_SERIES_IMAGE3D_H_
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include <thrust/copy.h>
+#include <thrust/host_vector.h>
+
+#include <piston/image3d.h>
+#include <piston/choose_container.h>
+
+namespace piston {
+
+// Loader for time series stored as one raw float32 file per timestep, the
+// file names are generated from a printf pattern such as "data/t%04d.raw".
+struct raw_series_loader
+{
+    std::string pattern;
+    long header_bytes;	// skipped at the beginning of each file
+
+    raw_series_loader(const std::string &pattern, long header_bytes = 0) :
+	pattern(pattern), header_bytes(header_bytes) {}
+
+    bool operator()(int timestep, float *values, size_t npoints) const {
+	char filename[4096];
+	std::snprintf(filename, sizeof(filename), pattern.c_str(), timestep);
+
+	std::FILE *file = std::fopen(filename, "rb");
+	if (!file) {
+	    std::cout << "File: " << filename << " can't be opened " << std::endl;
+	    return false;
+	}
+	const bool ok = (std::fseek(file, header_bytes, SEEK_SET) == 0) &&
+	                (std::fread(values, sizeof(float), npoints, file) == npoints);
+	std::fclose(file);
+	if (!ok)
+	    std::cout << "File: " << filename << " is too short " << std::endl;
+	return ok;
+    }
+};
+
+namespace detail {
+
+// read a timestep into a point data buffer, host buffers are loaded in
+// place, others through a host staging buffer.
+template <typename Loader, typename Container>
+bool load_timestep(Loader &loader, int timestep, Container &buffer, thrust::host_vector<float> &staging) {
+    staging.resize(buffer.size());
+    if (!loader(timestep, thrust::raw_pointer_cast(&*staging.begin()), staging.size()))
+	return false;
+    thrust::copy(staging.begin(), staging.end(), buffer.begin());
+    return true;
+}
+
+template <typename Loader>
+bool load_timestep(Loader &loader, int timestep, thrust::host_vector<float> &buffer, thrust::host_vector<float> &) {
+    return loader(timestep, thrust::raw_pointer_cast(&*buffer.begin()), buffer.size());
+}
+
+} // namespace detail
+
+/* image3d over a series of timesteps. It owns num_buffers (2 or 3) point data
+ * buffers: filters run on the current one while a background thread loads
+ * the next num_buffers-1 timesteps into the others. set_timestep() only
+ * waits if the requested timestep is not loaded yet, then swaps buffers,
+ * nothing is reallocated after construction.
+ *
+ * The Loader is a functor bool(int timestep, float *values, size_t npoints)
+ * that fills the host array with the values of a timestep and returns false
+ * on error, see raw_series_loader. It is only called from the background
+ * thread. With the CUDA backend, the copy to the device is done by the
+ * background thread as well.
+ *
+ * The values are in the order of Layout, which has to be linear_layout for
+ * the raw_series_loader. Timesteps of more than 2^32 points need a 64 bit
+ * layout such as linear_layout<unsigned long long>. */
+template <typename Loader, typename MemorySpace = thrust::detail::default_device_space_tag,
+          typename Layout = linear_layout<> >
+struct time_series_image3d : public piston::image3d<MemorySpace, Layout>
+{
+    typedef piston::image3d<MemorySpace, Layout> Parent;
+
+    enum { Empty, Queued, Loading, Ready, Failed };
+
+    //TODO: move this to parent class?
+    typedef typename thrust::iterator_traits<typename Parent::GridCoordinatesIterator>::value_type
+	    GridCoordinatesType;
+
+    // transfrom grid_coordinates (i, j, k) generated by image3d to shifted and
+    // scaled physical_coordinates (x, y, z)
+    struct physical_coordinates_functor : public thrust::unary_function<GridCoordinatesType,
+								        thrust::tuple<float, float, float> >
+    {
+        const float xmin, ymin, zmin;
+        const float deltax, deltay, deltaz;
+
+        physical_coordinates_functor(float xmin   = 0.0f, float ymin   = 0.0f, float zmin   = 0.0f,
+                                     float deltax = 1.0f, float deltay = 1.0f, float deltaz = 1.0f) :
+            xmin(xmin), ymin(ymin), zmin(zmin),
+            deltax(deltax), deltay(deltay), deltaz(deltaz) {}
+
+        __host__ __device__
+        thrust::tuple<float, float, float> operator()(const GridCoordinatesType& grid_coord) const {
+            const float x = xmin + deltax * thrust::get<0>(grid_coord);
+            const float y = ymin + deltay * thrust::get<1>(grid_coord);
+            const float z = zmin + deltaz * thrust::get<2>(grid_coord);
+
+            return thrust::make_tuple(x, y, z);
+        }
+    };
+
+    typedef typename thrust::transform_iterator<physical_coordinates_functor,
+	    typename Parent::GridCoordinatesIterator> PhysicalCoordinatesIterator;
+    PhysicalCoordinatesIterator phys_coordinates_iterator;
+
+    typedef typename detail::choose_container<typename Parent::CountingIterator, float>::type PointDataContainer;
+    typedef typename PointDataContainer::iterator PointDataIterator;
+
+    Loader loader;
+    const int num_timesteps;
+
+    std::vector<PointDataContainer> buffers;
+    std::vector<int> buffer_timestep;	// timestep held by or queued for each buffer
+    std::vector<int> buffer_state;
+    int current;			// buffer the filters see
+    thrust::host_vector<float> staging;
+
+    pthread_t worker;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    bool stop;
+
+    time_series_image3d(int xdim, int ydim, int zdim, int num_timesteps, const Loader &loader,
+                        int num_buffers = 2, const float *origin = 0, const float *spacing = 0) :
+	Parent(xdim, ydim, zdim),
+	phys_coordinates_iterator(Parent::grid_coordinates_iterator,
+	                          physical_coordinates_functor(origin  ? origin[0]  : 0.0f, origin  ? origin[1]  : 0.0f,
+	                                                       origin  ? origin[2]  : 0.0f, spacing ? spacing[0] : 1.0f,
+	                                                       spacing ? spacing[1] : 1.0f, spacing ? spacing[2] : 1.0f)),
+	loader(loader), num_timesteps(num_timesteps),
+	buffers((num_buffers < 2) ? 2 : num_buffers, PointDataContainer(Parent::NPoints)),
+	buffer_timestep(buffers.size(), -1), buffer_state(buffers.size(), Empty),
+	current(0), stop(false)
+    {
+	pthread_mutex_init(&mutex, 0);
+	pthread_cond_init(&changed, 0);
+	pthread_create(&worker, 0, prefetch_thread, this);
+
+	set_timestep(0);
+    }
+
+    ~time_series_image3d() {
+	pthread_mutex_lock(&mutex);
+	stop = true;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&mutex);
+
+	pthread_join(worker, 0);
+	pthread_cond_destroy(&changed);
+	pthread_mutex_destroy(&mutex);
+    }
+
+    // make a timestep current, waiting for it to be loaded if it was not
+    // prefetched, then start prefetching the ones after it. Returns false
+    // and keeps the current timestep if it can't be loaded.
+    bool set_timestep(int timestep) {
+	if ((timestep < 0) || (timestep >= num_timesteps))
+	    return false;
+
+	// with all other buffers being loaded, the timestep is queued as soon
+	// as one of them is done.
+	pthread_mutex_lock(&mutex);
+	schedule(timestep);
+
+	int b = find(timestep);
+	while ((b < 0) || (buffer_state[b] == Queued) || (buffer_state[b] == Loading)) {
+	    pthread_cond_wait(&changed, &mutex);
+	    schedule(timestep);
+	    b = find(timestep);
+	}
+
+	const bool ok = (buffer_state[b] == Ready);
+	if (ok) {
+	    if (b != current)
+		this->modified();
+	    current = b;
+	    schedule(timestep);
+	} else {
+	    buffer_state[b] = Empty;
+	}
+	pthread_mutex_unlock(&mutex);
+	return ok;
+    }
+
+    bool next_timestep() {
+	return set_timestep(timestep() + 1);
+    }
+
+    int timestep() const {
+	return buffer_timestep[current];
+    }
+
+    // FixME: const correctness, should we change it to cbegin()/cend()?
+    PhysicalCoordinatesIterator physical_coordinates_begin() {
+	return phys_coordinates_iterator;
+    }
+    PhysicalCoordinatesIterator physical_coordinates_end() {
+	return phys_coordinates_iterator+this->NPoints;
+    }
+
+    PointDataIterator point_data_begin() {
+	return buffers[current].begin();
+    }
+    PointDataIterator point_data_end() {
+	return buffers[current].end();
+    }
+
+private:
+    // buffer holding or queued for a timestep, -1 if there is none
+    int find(int timestep) const {
+	for (size_t b = 0; b < buffers.size(); b++) {
+	    if ((buffer_timestep[b] == timestep) && (buffer_state[b] != Empty))
+		return b;
+	}
+	return -1;
+    }
+
+    // queue timestep and the ones after it into the buffers that hold
+    // neither the current timestep nor one of them. Buffers that are being
+    // loaded are left alone. The mutex is held.
+    void schedule(int timestep) {
+	for (size_t n = 0; n < buffers.size(); n++) {
+	    const int t = timestep + n;
+	    if ((t >= num_timesteps) || (find(t) >= 0))
+		continue;
+
+	    for (size_t b = 0; b < buffers.size(); b++) {
+		const bool wanted = (buffer_state[b] != Empty) && (buffer_timestep[b] >= timestep) &&
+		                    (buffer_timestep[b] < timestep + (int) buffers.size());
+		if (((int) b != current || buffer_state[b] != Ready) && (buffer_state[b] != Loading) && !wanted) {
+		    buffer_timestep[b] = t;
+		    buffer_state[b] = Queued;
+		    break;
+		}
+	    }
+	}
+	pthread_cond_broadcast(&changed);
+    }
+
+    // load the queued buffers, earliest timestep first
+    static void *prefetch_thread(void *arg) {
+	time_series_image3d &series = *static_cast<time_series_image3d *>(arg);
+
+	pthread_mutex_lock(&series.mutex);
+	while (!series.stop) {
+	    int b = -1;
+	    for (size_t i = 0; i < series.buffers.size(); i++) {
+		if ((series.buffer_state[i] == Queued) &&
+		    ((b < 0) || (series.buffer_timestep[i] < series.buffer_timestep[b])))
+		    b = i;
+	    }
+	    if (b < 0) {
+		pthread_cond_wait(&series.changed, &series.mutex);
+		continue;
+	    }
+
+	    series.buffer_state[b] = Loading;
+	    const int t = series.buffer_timestep[b];
+	    pthread_mutex_unlock(&series.mutex);
+
+	    const bool ok = detail::load_timestep(series.loader, t, series.buffers[b], series.staging);
+
+	    pthread_mutex_lock(&series.mutex);
+	    series.buffer_state[b] = ok ? Ready : Failed;
+	    pthread_cond_broadcast(&series.changed);
+	}
+	pthread_mutex_unlock(&series.mutex);
+	return 0;
+    }
+
+    // the buffers and the thread are owned, the series is not copied
+    time_series_image3d(const time_series_image3d &);
+    time_series_image3d &operator=(const time_series_image3d &);
+};
+
+}
+
+#endif /* TIME_SERIES_IMAGE3D_H_ */
@@ -27,13 +27,16 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 
 #include <piston/image3d.h>
 #include <piston/choose_container.h>
+#include <piston/util/evaluation_policy.h>
 
 namespace piston {
 
-template <typename MemorySpace>
-struct cayley_field : public piston::image3d<MemorySpace>
+// Evaluation is one of the policies of evaluation_policy.h.
+template <typename MemorySpace, typename Layout = piston::linear_layout<>,
+          typename Evaluation = piston::materialized_evaluation>
+struct cayley_field : public piston::image3d<MemorySpace, Layout>
 {
-    typedef piston::image3d<MemorySpace> Parent;
+    typedef piston::image3d<MemorySpace, Layout> Parent;
 
     //TODO: move this to parent class?
     typedef typename thrust::iterator_traits<typename Parent::GridCoordinatesIterator>::value_type
@@ -85,18 +88,17 @@ struct cayley_field : public piston::image3d<MemorySpace>
 	}
     };
 
-    // Instead of computing the scalar values on the fly with a transform iterator
-    // as the Mandelbrot field, we cache them in the point_data_vector.
-    typedef typename detail::choose_container<typename Parent::CountingIterator, float>::type PointDataContainer;
-    PointDataContainer point_data_vector;
-    typedef typename PointDataContainer::iterator PointDataIterator;
+    // By default, instead of computing the scalar values on the fly with a
+    // transform iterator as the Mandelbrot field, we cache them in the point data.
+    typedef typename Evaluation::template point_data<thrust::transform_iterator<cayley_functor, PhysicalCoordinatesIterator> > PointData;
+    PointData point_data;
+    typedef typename PointData::iterator PointDataIterator;
 
     cayley_field(unsigned dim0, unsigned dim1, unsigned dim2) :
 	Parent(dim0, dim1, dim2),
 	phys_coordinates_iterator(Parent::grid_coordinates_iterator,
 	                          physical_coordinates_functor(dim0, dim1, dim2)),
-	point_data_vector(thrust::make_transform_iterator(physical_coordinates_begin(), cayley_functor()),
-	                  thrust::make_transform_iterator(physical_coordinates_end(),   cayley_functor()))
+	point_data(thrust::make_transform_iterator(physical_coordinates_begin(), cayley_functor()), this->NPoints)
 	                  {}
 
     PhysicalCoordinatesIterator physical_coordinates_begin() {
@@ -107,10 +109,10 @@ struct cayley_field : public piston::image3d<MemorySpace>
     }
 
     PointDataIterator point_data_begin() {
-	return point_data_vector.begin();
+	return point_data.begin();
     }
     PointDataIterator point_data_end() {
-	return point_data_vector.end();
+	return point_data.begin() + this->NPoints;
     }
 };
 
@@ -0,0 +1,203 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef EVALUATION_POLICY_H_
+#define EVALUATION_POLICY_H_
+
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+
+#include <piston/choose_container.h>
+
+namespace piston {
+
+/* Evaluation policies of the implicit function fields (tangle_field,
+ * cayley_field, height_field, plane_field and sphere_field). A policy turns
+ * an iterator evaluating the function at each point id into the point data
+ * of the field:
+ * 	- materialized_evaluation: every point is evaluated once when the field
+ * 	  is constructed and stored, one float per point. Best for repeated
+ * 	  filtering of the same field.
+ * 	- lazy_evaluation: the function is evaluated every time a filter reads
+ * 	  a point, no storage at all. Every read redoes the point id to grid
+ * 	  coordinates conversion, so this trades time for memory.
+ * 	- brick_cached_evaluation: runs of BrickPoints consecutive point ids
+ * 	  are evaluated when first read into a small LRU cache, one per OpenMP
+ * 	  thread. With blocked_layout<B>, BrickPoints == B^3 and dimensions
+ * 	  that are multiples of B, a run is a brick of the volume; smaller
+ * 	  border bricks shift the runs after them, so then runs straddle
+ * 	  bricks. Memory is bounded by the cache size, the cache lives on the
+ * 	  host so this only works with the host and OpenMP backends. The
+ * 	  iterators point to the point_data, so it can't be copied. */
+
+struct materialized_evaluation
+{
+    template <typename ValueIterator>
+    struct point_data
+    {
+	typedef typename thrust::iterator_difference<ValueIterator>::type IndexType;
+	typedef typename detail::choose_container<ValueIterator, float>::type PointDataContainer;
+	typedef typename PointDataContainer::iterator iterator;
+
+	PointDataContainer point_data_vector;
+
+	point_data(ValueIterator values, IndexType npoints) :
+	    point_data_vector(values, values + npoints) {}
+
+	iterator begin() {
+	    return point_data_vector.begin();
+	}
+    };
+};
+
+struct lazy_evaluation
+{
+    template <typename ValueIterator>
+    struct point_data
+    {
+	typedef typename thrust::iterator_difference<ValueIterator>::type IndexType;
+	typedef ValueIterator iterator;
+
+	ValueIterator values;
+
+	point_data(ValueIterator values, IndexType) : values(values) {}
+
+	iterator begin() {
+	    return values;
+	}
+    };
+};
+
+template <int BrickPoints = 32768, int CacheBricks = 16>
+struct brick_cached_evaluation
+{
+    template <typename ValueIterator>
+    struct point_data
+    {
+	typedef typename thrust::iterator_difference<ValueIterator>::type IndexType;
+	typedef typename thrust::iterator_space<ValueIterator>::type space_type;
+
+	// evaluated bricks of one thread, least recently used one is replaced
+	struct brick_cache
+	{
+	    std::vector<float> values;
+	    std::vector<IndexType> brick_of_slot;
+	    std::vector<unsigned> last_use;
+	    unsigned clock;
+	    int mru_slot;
+
+	    brick_cache() : values(CacheBricks * BrickPoints), brick_of_slot(CacheBricks, -1),
+	                    last_use(CacheBricks, 0), clock(0), mru_slot(0) {}
+	};
+
+	struct cached_value : public thrust::unary_function<IndexType, float>
+	{
+	    const point_data *data;
+
+	    cached_value(const point_data *data) : data(data) {}
+
+	    __host__
+	    float operator()(IndexType point_id) const {
+		return data->value(point_id);
+	    }
+	};
+
+	typedef thrust::transform_iterator<cached_value, thrust::counting_iterator<IndexType, space_type> > iterator;
+
+	ValueIterator values;
+	IndexType npoints;
+
+	// FixME: const correctness, the caches are modified by const lookups
+	mutable std::vector<brick_cache> caches;
+
+	point_data(ValueIterator values, IndexType npoints) :
+	    values(values), npoints(npoints) {
+#ifdef _OPENMP
+	    caches.resize(omp_get_max_threads());
+#else
+	    caches.resize(1);
+#endif
+	}
+
+	iterator begin() {
+	    return thrust::make_transform_iterator(thrust::counting_iterator<IndexType, space_type>(0), cached_value(this));
+	}
+
+	// the hot path is a hit on the most recently used brick of the thread
+	float value(IndexType point_id) const {
+#ifdef _OPENMP
+	    brick_cache &cache = caches[omp_get_thread_num()];
+#else
+	    brick_cache &cache = caches[0];
+#endif
+	    const IndexType brick = point_id / BrickPoints;
+	    int slot = cache.mru_slot;
+	    if (cache.brick_of_slot[slot] != brick) {
+		slot = lookup(cache, brick);
+		cache.mru_slot = slot;
+	    }
+	    return cache.values[slot * BrickPoints + point_id % BrickPoints];
+	}
+
+    private:
+	// find a brick in the cache, evaluating it into the least recently
+	// used slot if it is not there.
+	int lookup(brick_cache &cache, IndexType brick) const {
+	    cache.clock++;
+
+	    int victim = 0;
+	    for (int s = 0; s < CacheBricks; s++) {
+		if (cache.brick_of_slot[s] == brick) {
+		    cache.last_use[s] = cache.clock;
+		    return s;
+		}
+		if (cache.last_use[s] < cache.last_use[victim])
+		    victim = s;
+	    }
+
+	    cache.brick_of_slot[victim] = brick;
+	    cache.last_use[victim] = cache.clock;
+
+	    const IndexType first = brick * BrickPoints;
+	    const IndexType last  = (first + BrickPoints < npoints) ? first + BrickPoints : npoints;
+	    for (IndexType p = first; p < last; p++)
+		cache.values[victim * BrickPoints + (p - first)] = *(values + p);
+	    return victim;
+	}
+
+	// the iterators handed out point to this object
+	point_data(const point_data&);
+	point_data& operator=(const point_data&);
+    };
+};
+
+} // namespace piston
+
+#endif /* EVALUATION_POLICY_H_ */
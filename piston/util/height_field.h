@@ -27,32 +27,38 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 
 #include <piston/image3d.h>
 #include <piston/util/height_functor.h>
+#include <piston/util/evaluation_policy.h>
 
 namespace piston {
 
-template <typename MemorySpace>
-struct height_field : public piston::image3d<MemorySpace>
+// Evaluation is one of the policies of evaluation_policy.h, the height is
+// computed on the fly by default.
+template <typename MemorySpace, typename Layout = piston::linear_layout<>,
+          typename Evaluation = piston::lazy_evaluation>
+struct height_field : public piston::image3d<MemorySpace, Layout>
 {
-    typedef piston::image3d<MemorySpace> Parent;
+    typedef piston::image3d<MemorySpace, Layout> Parent;
 
     //TODO: move this to parent class?
     typedef typename thrust::iterator_traits<typename Parent::GridCoordinatesIterator>::value_type
 	    GridCoordinatesType;
 
     typedef thrust::transform_iterator<height_functor<GridCoordinatesType, float>,
-				       typename Parent::PhysicalCoordinatesIterator> PointDataIterator;
-    PointDataIterator point_data_iterator;
+				       typename Parent::PhysicalCoordinatesIterator> HeightIterator;
+    typedef typename Evaluation::template point_data<HeightIterator> PointData;
+    PointData point_data;
+    typedef typename PointData::iterator PointDataIterator;
 
     height_field(int xdim, int ydim, int zdim) :
 	Parent(xdim, ydim, zdim),
-	point_data_iterator(this->physical_coordinates_begin(),
-	                    height_functor<GridCoordinatesType, float>()){}
+	point_data(HeightIterator(this->physical_coordinates_begin(),
+	                          height_functor<GridCoordinatesType, float>()), this->NPoints) {}
 
     PointDataIterator point_data_begin() {
-	return point_data_iterator;
+	return point_data.begin();
     }
     PointDataIterator point_data_end() {
-	return point_data_iterator + this->NPoints;
+	return point_data.begin() + this->NPoints;
     }
 };
 
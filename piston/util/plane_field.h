@@ -28,14 +28,16 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #include <piston/image3d.h>
 #include <piston/choose_container.h>
 #include <piston/util/plane_functor.h>
+#include <piston/util/evaluation_policy.h>
 
 namespace piston {
 
-// TODO: turn this into a factory with different level of caching
-template <typename MemorySpace>
-struct plane_field : public piston::image3d<MemorySpace>
+// Evaluation is one of the policies of evaluation_policy.h.
+template <typename MemorySpace, typename Layout = piston::linear_layout<>,
+          typename Evaluation = piston::materialized_evaluation>
+struct plane_field : public piston::image3d<MemorySpace, Layout>
 {
-    typedef piston::image3d<MemorySpace> Parent;
+    typedef piston::image3d<MemorySpace, Layout> Parent;
 
     //TODO: move this to parent class?
     typedef typename thrust::iterator_traits<typename Parent::GridCoordinatesIterator>::value_type
@@ -43,23 +45,24 @@ struct plane_field : public piston::image3d<MemorySpace>
 
     typedef typename Parent::PhysicalCoordinatesIterator PhysicalCoordinatesIterator;
 
-    typedef typename detail::choose_container<typename Parent::CountingIterator, float>::type PointDataContainer;
-    PointDataContainer point_data_vector;
-    typedef typename PointDataContainer::iterator PointDataIterator;
+    typedef typename Evaluation::template point_data<thrust::transform_iterator<plane_functor<GridCoordinatesType, float>,
+                                                                                PhysicalCoordinatesIterator> > PointData;
+    PointData point_data;
+    typedef typename PointData::iterator PointDataIterator;
 
 
     plane_field(float3 origin, float3 normal, int xdim, int ydim, int zdim) :
 	Parent(xdim, ydim, zdim),
-	point_data_vector(thrust::make_transform_iterator(this->physical_coordinates_begin(), plane_functor<GridCoordinatesType, float>(origin, normal)),
-	                  thrust::make_transform_iterator(this->physical_coordinates_end(),   plane_functor<GridCoordinatesType, float>(origin, normal)))
-	                  {}
+	point_data(thrust::make_transform_iterator(this->physical_coordinates_begin(), plane_functor<GridCoordinatesType, float>(origin, normal)),
+	           this->NPoints)
+	           {}
 
 
     PointDataIterator point_data_begin() {
-	return point_data_vector.begin();
+	return point_data.begin();
     }
     PointDataIterator point_data_end() {
-	return point_data_vector.end();
+	return point_data.begin() + this->NPoints;
     }
 };
 
@@ -28,29 +28,32 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #include <piston/image3d.h>
 #include <piston/choose_container.h>
 #include <piston/util/sphere_functor.h>
+#include <piston/util/evaluation_policy.h>
 
 namespace piston {
 
-// TODO: turn this into a factory with different level of caching
-template <typename Space>
-struct sphere_field : public piston::image3d<Space>
+// Evaluation is one of the policies of evaluation_policy.h.
+template <typename Space, typename Layout = piston::linear_layout<>,
+          typename Evaluation = piston::materialized_evaluation>
+struct sphere_field : public piston::image3d<Space, Layout>
 {
-    typedef piston::image3d<Space> Parent;
+    typedef piston::image3d<Space, Layout> Parent;
 
     //TODO: move this to parent class?
     typedef typename thrust::iterator_traits<typename Parent::GridCoordinatesIterator>::value_type
 	    GridCoordinatesType;
 
-    typedef typename detail::choose_container<typename Parent::CountingIterator, float>::type PointDataContainer;
-    PointDataContainer point_data_vector;
-    typedef typename PointDataContainer::iterator PointDataIterator;
+    typedef typename Evaluation::template point_data<thrust::transform_iterator<sphere_functor<GridCoordinatesType, float>,
+                                                                                typename Parent::GridCoordinatesIterator> > PointData;
+    PointData point_data;
+    typedef typename PointData::iterator PointDataIterator;
 
     sphere_field(int xdim, int ydim, int zdim) :
 	Parent(xdim, ydim, zdim),
 //	grid_coordinates_vector(Parent::grid_coordinates_begin(), Parent::grid_coordinates_end()),
-	point_data_vector(thrust::make_transform_iterator(this->grid_coordinates_begin(), sphere_functor<GridCoordinatesType, float>(xdim/2, ydim/2, zdim/2)),
-	                  thrust::make_transform_iterator(this->grid_coordinates_end(),   sphere_functor<GridCoordinatesType, float>(xdim/2, ydim/2, zdim/2)))
-	                  {}
+	point_data(thrust::make_transform_iterator(this->grid_coordinates_begin(), sphere_functor<GridCoordinatesType, float>(xdim/2, ydim/2, zdim/2)),
+	           this->NPoints)
+	           {}
 
 
     // FixME: const correctness, should we change it to cbegin()/cend()?
@@ -62,10 +65,10 @@ struct sphere_field : public piston::image3d<Space>
 //    }
 
     PointDataIterator point_data_begin() {
-	return point_data_vector.begin();
+	return point_data.begin();
     }
     PointDataIterator point_data_end() {
-	return point_data_vector.end();
+	return point_data.begin() + this->NPoints;
     }
 };
 
@@ -28,14 +28,17 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #include <piston/image3d.h>
 #include <piston/choose_container.h>
 #include <piston/implicit_function.h>
+#include <piston/util/evaluation_policy.h>
 
 namespace piston {
 
 // TODO: should we parameterize the ValueType? only float makes sense.
-template <typename MemorySpace>
-struct tangle_field : public piston::image3d<MemorySpace>
+// Evaluation is one of the policies of evaluation_policy.h.
+template <typename MemorySpace, typename Layout = piston::linear_layout<>,
+          typename Evaluation = piston::materialized_evaluation>
+struct tangle_field : public piston::image3d<MemorySpace, Layout>
 {
-    typedef piston::image3d<MemorySpace> Parent;
+    typedef piston::image3d<MemorySpace, Layout> Parent;
 
     //TODO: move this to parent class?
     typedef typename thrust::iterator_traits<typename Parent::GridCoordinatesIterator>::value_type
@@ -87,9 +90,9 @@ struct tangle_field : public piston::image3d<MemorySpace>
     };
 
 #ifndef DISTRIBUTED_PISTON
-    typedef typename detail::choose_container<typename Parent::CountingIterator, float>::type PointDataContainer;
-    PointDataContainer point_data_vector;
-    typedef typename PointDataContainer::iterator PointDataIterator;
+    typedef typename Evaluation::template point_data<thrust::transform_iterator<tangle_functor, PhysicalCoordinatesIterator> > PointData;
+    PointData point_data;
+    typedef typename PointData::iterator PointDataIterator;
 #endif
 
     tangle_field(int dim0, int dim1, int dim2) :
@@ -97,8 +100,7 @@ struct tangle_field : public piston::image3d<MemorySpace>
 	phys_coordinates_iterator(Parent::grid_coordinates_iterator,
 	                          physical_coordinates_functor(dim0, dim1, dim2))
 #ifndef DISTRIBUTED_PISTON
-	, point_data_vector(thrust::make_transform_iterator(physical_coordinates_begin(), tangle_functor()),
-	                  thrust::make_transform_iterator(physical_coordinates_end(),   tangle_functor())) { }
+	, point_data(thrust::make_transform_iterator(physical_coordinates_begin(), tangle_functor()), this->NPoints) { }
 #else                  
     {
         Parent::point_data_vector.resize(this->NPoints);
@@ -116,10 +118,10 @@ struct tangle_field : public piston::image3d<MemorySpace>
 
 #ifndef DISTRIBUTED_PISTON
     PointDataIterator point_data_begin() {
-	return point_data_vector.begin();
+	return point_data.begin();
     }
     PointDataIterator point_data_end() {
-	return point_data_vector.end();
+	return point_data.begin() + this->NPoints;
     }
 #endif
 };
@@ -0,0 +1,247 @@
+/*
+Copyright (c) 2011, Los Alamos National Security, LLC
+All rights reserved.
+Copyright 2011. Los Alamos National Security, LLC. This software was produced under U.S. Government contract DE-AC52-06NA25396 for Los Alamos National Laboratory (LANL),
+which is operated by Los Alamos National Security, LLC for the U.S. Department of Energy. The U.S. Government has rights to use, reproduce, and distribute this software.
+
+NEITHER THE GOVERNMENT NOR LOS ALAMOS NATIONAL SECURITY, LLC MAKES ANY WARRANTY, EXPRESS OR IMPLIED, OR ASSUMES ANY LIABILITY FOR THE USE OF THIS SOFTWARE.
+
+If software is modified to produce derivative works, such modified software should be clearly marked, so as not to confuse it with the version available from LANL.
+
+Additionally, redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+·         Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+·         Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other
+          materials provided with the distribution.
+·         Neither the name of Los Alamos National Security, LLC, Los Alamos National Laboratory, LANL, the U.S. Government, nor the names of its contributors may be used
+          to endorse or promote products derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY LOS ALAMOS NATIONAL SECURITY, LLC AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL LOS ALAMOS NATIONAL SECURITY, LLC OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef VOLUME_PYRAMID_H_
+#define VOLUME_PYRAMID_H_
+
+#include <vector>
+
+#include <thrust/transform.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
+#include <thrust/iterator/permutation_iterator.h>
+
+#include <piston/image3d.h>
+#include <piston/choose_container.h>
+
+namespace piston {
+
+/* Multi-resolution pyramid of a structured dataset for progressive
+ * filtering. Level 0 is the input itself, level l has about 1/2^l of the
+ * points along each axis and is a dataset of its own, so any filter can
+ * run on it, e.g. a coarse contour first, then refined level by level.
+ *
+ * Point (i, j, k) of level l sits on point (2i, 2j, 2k) of level l-1,
+ * clamped to the last point, so the levels have the same extent and their
+ * physical coordinates are those of the input. Its value is the minimum,
+ * maximum or mean of the 3^3 neighborhood of that point, clamped at the
+ * borders. With Min or Max, a cell of level l holds the extremes of the
+ * finer cells it covers, so it can be used to skip regions conservatively.
+ *
+ * Each level is computed in parallel from the previous one. */
+template <typename InputDataSet>
+struct volume_pyramid
+{
+    enum { Min = 0, Max = 1, Mean = 2 };
+
+    typedef typename InputDataSet::PointDataIterator InputPointDataIterator;
+    typedef typename InputDataSet::PhysicalCoordinatesIterator InputPhysicalCoordinatesIterator;
+    typedef typename InputDataSet::LayoutType InputLayout;
+    typedef typename InputDataSet::IndexType IndexType;
+
+    typedef typename thrust::iterator_space<InputPointDataIterator>::type space_type;
+
+    // return the input point a point of a level sits on
+    struct input_point_functor : public thrust::unary_function<IndexType, IndexType>
+    {
+	linear_layout<IndexType> coarse;
+	InputLayout input_layout;
+	IndexType dim0, dim1, dim2;
+	int shift;
+
+	input_point_functor(const linear_layout<IndexType> &coarse, InputDataSet &input, int shift) :
+	    coarse(coarse), input_layout(input.layout),
+	    dim0(input.dim0), dim1(input.dim1), dim2(input.dim2), shift(shift) {}
+
+	__host__ __device__
+	IndexType operator()(IndexType point_id) const {
+	    const thrust::tuple<IndexType, IndexType, IndexType> ijk = coarse.coordinates(point_id);
+	    const IndexType i = thrust::get<0>(ijk) << shift;
+	    const IndexType j = thrust::get<1>(ijk) << shift;
+	    const IndexType k = thrust::get<2>(ijk) << shift;
+
+	    return input_layout.index((i < dim0) ? i : dim0 - 1,
+	                              (j < dim1) ? j : dim1 - 1,
+	                              (k < dim2) ? k : dim2 - 1);
+	}
+    };
+
+    // one level of the pyramid, a dataset with linear layout
+    struct level_dataset : public image3d<space_type, linear_layout<IndexType> >
+    {
+	typedef image3d<space_type, linear_layout<IndexType> > Parent;
+
+	typedef typename detail::choose_container<InputPointDataIterator, float>::type PointDataContainer;
+	PointDataContainer point_data_vector;
+	typedef typename PointDataContainer::iterator PointDataIterator;
+
+	typedef thrust::permutation_iterator<InputPhysicalCoordinatesIterator,
+	        thrust::transform_iterator<input_point_functor, typename Parent::CountingIterator> > PhysicalCoordinatesIterator;
+	PhysicalCoordinatesIterator phys_coordinates_iterator;
+
+	level_dataset(InputDataSet &input, IndexType xdim, IndexType ydim, IndexType zdim, int level) :
+	    Parent(xdim, ydim, zdim),
+	    point_data_vector(this->NPoints),
+	    phys_coordinates_iterator(input.physical_coordinates_begin(),
+	                              thrust::make_transform_iterator(typename Parent::CountingIterator(0),
+	                                                              input_point_functor(this->layout, input, level))) {}
+
+	PhysicalCoordinatesIterator physical_coordinates_begin() {
+	    return phys_coordinates_iterator;
+	}
+	PhysicalCoordinatesIterator physical_coordinates_end() {
+	    return phys_coordinates_iterator + this->NPoints;
+	}
+
+	PointDataIterator point_data_begin() {
+	    return point_data_vector.begin();
+	}
+	PointDataIterator point_data_end() {
+	    return point_data_vector.end();
+	}
+    };
+
+    // FixME: change float to value_type
+    // reduce the neighborhood of the finer point a coarse point sits on
+    template <typename FineIterator, typename FineLayout>
+    struct downsample : public thrust::unary_function<IndexType, float>
+    {
+	FineIterator fine_data;
+	FineLayout fine_layout;
+	linear_layout<IndexType> coarse;
+	int fine_dim[3];
+	int reduction;
+
+	downsample(FineIterator fine_data, const FineLayout &fine_layout,
+	           IndexType xdim, IndexType ydim, IndexType zdim,
+	           const linear_layout<IndexType> &coarse, int reduction) :
+	    fine_data(fine_data), fine_layout(fine_layout), coarse(coarse), reduction(reduction) {
+	    fine_dim[0] = xdim;  fine_dim[1] = ydim;  fine_dim[2] = zdim;
+	}
+
+	__host__ __device__
+	float operator()(IndexType point_id) const {
+	    const thrust::tuple<IndexType, IndexType, IndexType> ijk = coarse.coordinates(point_id);
+	    const int c[3] = { (int) thrust::get<0>(ijk) * 2, (int) thrust::get<1>(ijk) * 2, (int) thrust::get<2>(ijk) * 2 };
+
+	    int lo[3], hi[3];
+	    for (int d = 0; d < 3; d++) {
+		const int center = (c[d] < fine_dim[d]) ? c[d] : fine_dim[d] - 1;
+		lo[d] = (center > 0) ? center - 1 : 0;
+		hi[d] = (center + 1 < fine_dim[d]) ? center + 1 : center;
+	    }
+
+	    float result = *(fine_data + fine_layout.index(lo[0], lo[1], lo[2]));
+	    float sum = 0.0f;
+	    for (int k = lo[2]; k <= hi[2]; k++) {
+		for (int j = lo[1]; j <= hi[1]; j++) {
+		    for (int i = lo[0]; i <= hi[0]; i++) {
+			const float f = *(fine_data + fine_layout.index(i, j, k));
+			sum += f;
+			if (reduction == Min)
+			    result = (f < result) ? f : result;
+			else
+			    result = (f > result) ? f : result;
+		    }
+		}
+	    }
+	    if (reduction == Mean)
+		return sum / ((hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1));
+	    return result;
+	}
+    };
+
+    InputDataSet &input;
+    int reduction;
+    std::vector<level_dataset *> levels;	// levels[l-1] is level l
+
+    // build levels until the coarsest one has at most min_dim points along
+    // its longest axis, or until max_levels levels besides the input.
+    volume_pyramid(InputDataSet &input, int reduction = Mean, int min_dim = 16, int max_levels = 16) :
+	input(input), reduction(reduction)
+    {
+	IndexType dims[3] = { input.dim0, input.dim1, input.dim2 };
+	for (int l = 1; l <= max_levels; l++) {
+	    if ((dims[0] <= (IndexType) min_dim) && (dims[1] <= (IndexType) min_dim) && (dims[2] <= (IndexType) min_dim))
+		break;
+	    for (int d = 0; d < 3; d++)
+		dims[d] = (dims[d] > 2) ? dims[d]/2 + 1 : dims[d];
+
+	    level_dataset *coarse = new level_dataset(input, dims[0], dims[1], dims[2], l);
+	    if (l == 1)
+		build(*coarse, input.point_data_begin(), input.layout, input.dim0, input.dim1, input.dim2);
+	    else {
+		level_dataset &fine = *levels.back();
+		build(*coarse, fine.point_data_begin(), fine.layout, fine.dim0, fine.dim1, fine.dim2);
+	    }
+	    levels.push_back(coarse);
+	}
+    }
+
+    ~volume_pyramid() {
+	for (size_t l = 0; l < levels.size(); l++)
+	    delete levels[l];
+    }
+
+    // number of levels including the input
+    int num_levels() const {
+	return levels.size() + 1;
+    }
+
+    // level l >= 1, level 0 is the input
+    level_dataset &level(int l) {
+	return *levels[l-1];
+    }
+
+    // the finest level with at most max_cells cells, the coarsest level if
+    // there is none. Filters can use it to bound their output size.
+    int level_for_budget(IndexType max_cells) const {
+	if (input.NCells <= max_cells)
+	    return 0;
+	for (size_t l = 0; l < levels.size(); l++) {
+	    if (levels[l]->NCells <= max_cells)
+		return l + 1;
+	}
+	return levels.size();
+    }
+
+private:
+    template <typename FineIterator, typename FineLayout>
+    void build(level_dataset &coarse, FineIterator fine_data, const FineLayout &fine_layout,
+               IndexType xdim, IndexType ydim, IndexType zdim) {
+	thrust::transform(typename level_dataset::CountingIterator(0),
+	                  typename level_dataset::CountingIterator(0) + coarse.NPoints,
+	                  coarse.point_data_vector.begin(),
+	                  downsample<FineIterator, FineLayout>(fine_data, fine_layout, xdim, ydim, zdim,
+	                                                       coarse.layout, reduction));
+    }
+
+    // levels own device memory, the pyramid is not copied
+    volume_pyramid(const volume_pyramid &);
+    volume_pyramid &operator=(const volume_pyramid &);
+};
+
+}
+
+#endif /* VOLUME_PYRAMID_H_ */
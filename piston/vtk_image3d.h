@@ -30,13 +30,19 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSI
 #include <vtkFloatArray.h>
 #include <piston/image3d.h>
 #include <piston/choose_container.h>
+#include <piston/quantized_data.h>
+#include <thrust/iterator/permutation_iterator.h>
 
 namespace piston {
 
-template <typename MemorySpace =  thrust::detail::default_device_space_tag>
-struct vtk_image3d : public piston::image3d<MemorySpace>
+// StorageType selects how the point data is kept in memory, see
+// quantized_data.h, the filters always see float values. The VTK scalars are
+// reordered into the given point layout.
+template <typename MemorySpace =  thrust::detail::default_device_space_tag, typename StorageType = float,
+          typename Layout = piston::linear_layout<> >
+struct vtk_image3d : public piston::image3d<MemorySpace, Layout>
 {
-    typedef piston::image3d<MemorySpace> Parent;
+    typedef piston::image3d<MemorySpace, Layout> Parent;
     double origin[3];
     double spacing[3];
     int extents[6];
@@ -72,9 +78,31 @@ struct vtk_image3d : public piston::image3d<MemorySpace>
 	    typename Parent::GridCoordinatesIterator> PhysicalCoordinatesIterator;
     PhysicalCoordinatesIterator phys_coordinates_iterator;
 
-    typedef typename detail::choose_container<typename Parent::CountingIterator, float>::type PointDataContainer;
+    // transform from point_id in the layout to the point_id in VTK's x
+    // fastest order
+    struct vtk_point_id_functor : public thrust::unary_function<typename Parent::IndexType, typename Parent::IndexType>
+    {
+	Layout layout;
+	linear_layout<typename Parent::IndexType> linear;
+
+	vtk_point_id_functor(const Layout &layout, int xdim, int ydim, int zdim) :
+	    layout(layout), linear(xdim, ydim, zdim) {}
+
+	__host__ __device__
+	typename Parent::IndexType operator()(typename Parent::IndexType point_id) const {
+	    const thrust::tuple<typename Parent::IndexType, typename Parent::IndexType, typename Parent::IndexType> ijk = layout.coordinates(point_id);
+	    return linear.index(thrust::get<0>(ijk), thrust::get<1>(ijk), thrust::get<2>(ijk));
+	}
+    };
+
+    typedef typename detail::choose_container<typename Parent::CountingIterator, StorageType>::type PointDataContainer;
     PointDataContainer point_data_vector;
-    typedef typename PointDataContainer::iterator PointDataIterator;
+    typedef decoded_iterator<typename PointDataContainer::iterator> DecodedIterator;
+    typedef typename DecodedIterator::type PointDataIterator;
+
+    // decoding of the stored point data
+    float scale;
+    float offset;
 
     vtk_image3d(vtkImageData *image) :
 	Parent(image->GetDimensions()[0], image->GetDimensions()[1], image->GetDimensions()[2]),
@@ -86,9 +114,13 @@ struct vtk_image3d : public piston::image3d<MemorySpace>
 	                        		           image->GetSpacing()[0],
 	                        		           image->GetSpacing()[1],
 	                        		           image->GetSpacing()[2])),
-	point_data_vector((float *) image->GetScalarPointer(),
-	                  (float *) image->GetScalarPointer() + this->NPoints)
+	scale(1.0f), offset(0.0f)
     {
+        // the scalars are converted according to their actual VTK type
+        switch (image->GetScalarType()) {
+            vtkTemplateMacro(this->assign_scalars(static_cast<VTK_TT *>(image->GetScalarPointer())));
+        }
+
         this->origin[0] = image->GetOrigin()[0];
         this->origin[1] = image->GetOrigin()[1];
         this->origin[2] = image->GetOrigin()[2];
@@ -127,9 +159,9 @@ struct vtk_image3d : public piston::image3d<MemorySpace>
     vtk_image3d(int dims[3], thrust::device_vector<float> v) :
         Parent(dims[0], dims[1], dims[2]),
         phys_coordinates_iterator(Parent::grid_coordinates_iterator,
-                                  physical_coordinates_functor(0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f)),
-        point_data_vector(v.begin(), v.end()) {
+                                  physical_coordinates_functor(0.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f)) {
 	// TODO: this is completely wrong.
+	quantize(in_layout(v.begin()), in_layout(v.begin()) + this->NPoints, point_data_vector, scale, offset);
     }
 
     // TODO: COPY Constructor??, Constructor from another image/vector?
@@ -143,9 +175,10 @@ struct vtk_image3d : public piston::image3d<MemorySpace>
           origin[2]+((float)extents[4]*spacing[2]),
           spacing[0],
           spacing[1],
-          spacing[2])),
-        point_data_vector(v.begin(), v.end())
+          spacing[2]))
     {
+        quantize(in_layout(v.begin()), in_layout(v.begin()) + this->NPoints, point_data_vector, scale, offset);
+
         this->origin[0] = origin[0];
         this->origin[1] = origin[1];
         this->origin[2] = origin[2];
@@ -178,10 +211,34 @@ struct vtk_image3d : public piston::image3d<MemorySpace>
     }
 
     PointDataIterator point_data_begin() {
-	return point_data_vector.begin();
+	return DecodedIterator::make(point_data_vector.begin(), scale, offset);
     }
     PointDataIterator point_data_end() {
-	return point_data_vector.end();
+	return point_data_begin() + this->NPoints;
+    }
+
+private:
+    // iterator over values in VTK order returning them in layout order
+    template <typename Iterator>
+    thrust::permutation_iterator<Iterator, thrust::transform_iterator<vtk_point_id_functor, thrust::counting_iterator<typename Parent::IndexType> > >
+    in_layout(Iterator values) {
+	return thrust::make_permutation_iterator(values,
+	    thrust::make_transform_iterator(thrust::counting_iterator<typename Parent::IndexType>(0),
+	                                    vtk_point_id_functor(this->layout, this->dim0, this->dim1, this->dim2)));
+    }
+
+    // scalars already in the storage type are kept as they are, e.g. 16 bit
+    // CT data, others are quantized.
+    void assign_scalars(const StorageType *scalars) {
+	point_data_vector.assign(in_layout(scalars), in_layout(scalars) + this->NPoints);
+	scale = 1.0f;
+	offset = 0.0f;
+	this->modified();
+    }
+    template <typename T>
+    void assign_scalars(const T *scalars) {
+	quantize(in_layout(scalars), in_layout(scalars) + this->NPoints, point_data_vector, scale, offset);
+	this->modified();
     }
 };
 